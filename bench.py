@@ -0,0 +1,701 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+import json
+import time
+import socket
+import struct
+import subprocess
+import tempfile
+
+TEST_BINARY = './main'
+
+SERVER_SOCKET = '/tmp/posix_shell_bench.sock'
+SERVER_MAGIC = 0x70736831
+
+def timed(f, repeat):
+    start = time.perf_counter()
+    for _ in range(repeat):
+        f()
+    return time.perf_counter() - start
+
+def report(name, seconds, count, unit):
+    print('  {:<40} {:>12.1f} {}/s'.format(name, count / seconds, unit))
+
+# 10^levels iterations of body, with the loop variables $a0, $a1, ...
+def nested_loops(levels, body):
+    digits = ' '.join(str(i) for i in range(10))
+    return ''.join('for a{} in {}; do '.format(i, digits) for i in range(levels)) + body + '; done' * levels
+
+# server mode
+
+def server_request(script):
+    payload = b''.join(s.encode() + b'\0' for s in [os.getcwd(), script, 'bench'])
+    payload += b''.join(('{}={}'.format(k, v)).encode() + b'\0' for k, v in os.environ.items())
+    header = struct.pack('=IIII', SERVER_MAGIC, 0, len(os.environ), len(payload))
+
+    with open(os.devnull, 'r+') as null, socket.socket(socket.AF_UNIX) as s:
+        s.connect(SERVER_SOCKET)
+        socket.send_fds(s, [header], [null.fileno()] * 3)
+        s.sendall(payload)
+        return struct.unpack('=i', s.recv(4))[0]
+
+def bench_server():
+    repeat = 300
+    devnull = subprocess.DEVNULL
+    server = subprocess.Popen([TEST_BINARY, '-S', SERVER_SOCKET])
+
+    try:
+        while not os.path.exists(SERVER_SOCKET):
+            time.sleep(0.01)
+
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-c', 'true'], stdout=devnull), repeat)
+        report('-c invocations', t, repeat, 'req')
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-C', SERVER_SOCKET, '-c', 'true'], stdout=devnull), repeat)
+        report('thin client invocations', t, repeat, 'req')
+        t = timed(lambda: server_request('true'), repeat)
+        report('direct socket requests', t, repeat, 'req')
+    finally:
+        server.kill()
+        server.wait()
+        os.unlink(SERVER_SOCKET)
+
+# script cache
+
+def generated_script(lines):
+    parts = []
+    for i in range(lines // 5):
+        parts.append('f{0}() {{\n  for x in a b $1; do\n    case $x in a) A{0}=$x ;; *) B{0}="$x $2" ;; esac\n  done\n}}\n'.format(i))
+    return ''.join(parts)
+
+def bench_cache():
+    repeat = 5
+
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, 'script.sh')
+        cache_dir = os.path.join(tmp, 'cache')
+        os.mkdir(cache_dir)
+        with open(script, 'w') as f:
+            f.write(generated_script(50000))
+
+        def run(env):
+            subprocess.run([TEST_BINARY, script], env=dict(os.environ, **env), check=True)
+
+        t = timed(lambda: run({}), repeat)
+        report('50k lines, no cache', t, repeat, 'run')
+
+        def cold():
+            for entry in os.listdir(cache_dir):
+                os.unlink(os.path.join(cache_dir, entry))
+            run({'POSIX_SHELL_CACHE_DIR': cache_dir})
+
+        t = timed(cold, repeat)
+        report('50k lines, cold cache', t, repeat, 'run')
+        t = timed(lambda: run({'POSIX_SHELL_CACHE_DIR': cache_dir}), repeat)
+        report('50k lines, warm cache', t, repeat, 'run')
+
+# cat builtin
+
+def bench_cat():
+    size_mb = int(os.environ.get('BENCH_CAT_MB', '1024'))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        data = os.path.join(tmp, 'data')
+        out = os.path.join(tmp, 'out')
+        line = b'x' * 63 + b'\n'
+        with open(data, 'wb') as f:
+            block = line * (1 << 14)
+            for _ in range(size_mb):
+                f.write(block)
+
+        def run(script):
+            subprocess.run([TEST_BINARY, '-c', script], stdout=subprocess.DEVNULL, check=True)
+
+        for cat in ['cat', '/bin/cat']:
+            t = timed(lambda: run('{} {} | wc -l'.format(cat, data)), 1)
+            report('{} file | wc -l'.format(cat), t, size_mb / 1024, 'GB')
+            t = timed(lambda: run('{} {} > {}'.format(cat, data, out)), 1)
+            report('{} file > file'.format(cat), t, size_mb / 1024, 'GB')
+
+# read builtin
+
+def bench_read():
+    lines = int(os.environ.get('BENCH_READ_LINES', '1000000'))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        data = os.path.join(tmp, 'data')
+        with open(data, 'w') as f:
+            for i in range(lines):
+                f.write('line {} of the file\n'.format(i))
+
+        loop = 'cat {} | while read -r line; do A=$line; done'.format(data)
+        # The external command never runs, but it keeps the pipe shared,
+        # so read has to go byte by byte
+        bytewise_loop = 'cat {} | while read -r line; do case $line in never) /bin/true;; esac; done'.format(data)
+
+        def run(binary, script):
+            subprocess.run([binary, '-c', script], check=True)
+
+        t = timed(lambda: run(TEST_BINARY, loop), 1)
+        report('buffered while read', t, lines, 'lines')
+        t = timed(lambda: run(TEST_BINARY, bytewise_loop), 1)
+        report('byte-wise while read', t, lines, 'lines')
+        for reference in ['/bin/bash', '/bin/dash']:
+            if os.path.exists(reference):
+                t = timed(lambda: run(reference, loop), 1)
+                report('{} while read'.format(reference), t, lines, 'lines')
+
+# inline pipelines
+
+def bench_pipeline():
+    words = ' '.join('w{}'.format(i) for i in range(1000))
+    many_small = 'for x in {}; do echo $x | cat | read y; done'.format(words)
+    lines = int(os.environ.get('BENCH_READ_LINES', '1000000'))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        data = os.path.join(tmp, 'data')
+        with open(data, 'w') as f:
+            for i in range(lines):
+                f.write('line {}\n'.format(i))
+
+        one_large = 'cat {} | cat | while read -r line; do A=$line; done'.format(data)
+
+        for name, env in [('inline', {}), ('forking', {'POSIX_SHELL_FORK_PIPELINES': '1'})]:
+            def run(script):
+                subprocess.run([TEST_BINARY, '-c', script], env=dict(os.environ, **env), check=True)
+
+            t = timed(lambda: run(many_small), 1)
+            report('{}: 1000 x echo | cat | read'.format(name), t, 1000, 'pipelines')
+            t = timed(lambda: run(one_large), 1)
+            report('{}: cat | cat | while read'.format(name), t, lines, 'lines')
+
+# virtual subshells
+
+def bench_subshell():
+    words = ' '.join('w{}'.format(i) for i in range(2000))
+    scripts = [
+        ('( cd dir && build_vars )', 'build_vars() { A=1; B=2; }; for x in {}; do ( cd / && build_vars ); done'),
+        ('$(my_function)', 'my_function() { echo $1; }; for x in {}; do y=$(my_function $x); done'),
+    ]
+
+    for name, env in [('in-process', {}), ('forking', {'POSIX_SHELL_FORK_SUBSHELLS': '1'})]:
+        for label, script in scripts:
+            def run():
+                subprocess.run([TEST_BINARY, '-c', script.replace('{}', words)], env=dict(os.environ, **env), check=True)
+
+            t = timed(run, 1)
+            report('{}: {}'.format(name, label), t, 2000, 'calls')
+
+# shared variable values
+
+def bench_values():
+    size_mb = 50
+    rounds = 1000
+    script = 'A=$(cat {}); for i in {}; do B=$A; C="$B"; A=${{C}}; n=${{#A}}; done'
+
+    with tempfile.TemporaryDirectory() as tmp:
+        data = os.path.join(tmp, 'data')
+        with open(data, 'w') as f:
+            f.write(('x' * 1023 + '\n') * (size_mb * 1024))
+
+        def run(binary, rounds):
+            loop = ' '.join(str(i) for i in range(rounds))
+            subprocess.run([binary, '-c', script.format(data, loop)], check=True)
+
+        t = timed(lambda: run(TEST_BINARY, rounds), 1)
+        report('{} MB value, 3 assignments + ${{#A}}'.format(size_mb), t, rounds, 'rounds')
+        # Reference shells copy every time, a few rounds are enough
+        if os.path.exists('/bin/bash'):
+            t = timed(lambda: run('/bin/bash', 10), 1)
+            report('/bin/bash, same loop', t, 10, 'rounds')
+
+# self-append
+
+def bench_append():
+    for exponent in range(4, 7):
+        # One append per innermost iteration
+        script = 's=; x=abcdefgh; ' + nested_loops(exponent, 's="$s$x"')
+
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-c', script], check=True), 1)
+        report('10^{} x s="$s$x"'.format(exponent), t, 10 ** exponent, 'appends')
+
+# positional parameters
+
+def bench_shift():
+    for exponent in range(4, 7):
+        count = 10 ** exponent
+        script = 'set -- $(seq {}); while [ $# -gt 0 ]; do shift; done'.format(count)
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-c', script], check=True), 1)
+        report('10^{} args, while [ $# -gt 0 ]; shift'.format(exponent), t, count, 'shifts')
+
+    calls = ' '.join(str(i) for i in range(1000))
+    script = 'f() {{ A=$#; }}; set -- $(seq 100000); for i in {}; do f "$@"; done'.format(calls)
+    t = timed(lambda: subprocess.run([TEST_BINARY, '-c', script], check=True), 1)
+    report('f "$@" with 10^5 args', t, 1000, 'calls')
+
+# prefix and suffix removal
+
+def bench_strip():
+    path = 'p=/srv/data$a0/run$a1/file$a2$a3$a4$a5.tar.gz; '
+    in_process = path + 'base=${p##*/}; dir=${p%/*}; stem=${base%%.*}; ext=${p##*.}'
+    external = path + 'base=$(basename $p); dir=$(dirname $p); stem=$(echo $base | cut -d. -f1); ext=$(echo $p | sed "s/.*\\.//")'
+
+    def run(script):
+        subprocess.run([TEST_BINARY, '-c', script], check=True)
+
+    levels = int(os.environ.get('BENCH_STRIP_LEVELS', '6'))
+    t = timed(lambda: run(nested_loops(levels, in_process)), 1)
+    report('10^{} paths, ${{p##*/}} etc'.format(levels), t, 10 ** levels, 'paths')
+    # Every call forks and execs, a sample is enough
+    t = timed(lambda: run(nested_loops(3, external)), 1)
+    report('10^3 paths, basename/dirname/cut/sed', t, 1000, 'paths')
+
+# break, continue and return
+
+def bench_control():
+    levels = int(os.environ.get('BENCH_CONTINUE_LEVELS', '7'))
+    for body, label in [(':', ':'), ('continue; echo never', 'continue')]:
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-c', nested_loops(levels, body)], check=True), 1)
+        report('10^{} x {}'.format(levels, label), t, 10 ** levels, 'iterations')
+
+    # Recursion 1000 deep, returning all the way up, 100 times
+    recursive = 'r() { [ $# -eq 0 ] && return 0; shift; r "$@"; return $?; }; set -- $(seq 1000); ' + nested_loops(2, 'r "$@"')
+    t = timed(lambda: subprocess.run([TEST_BINARY, '-c', recursive], check=True), 1)
+    report('recursive r with return', t, 100 * 1000, 'calls')
+
+# lazy function bodies
+
+def function_library(count):
+    parts = []
+    for i in range(count):
+        parts.append(
+            'lib_f{0}() {{\n'
+            '  for x in "$@"; do\n'
+            '    case $x in -*) opt_{0}=${{x#-}} ;; *) {{ arg_{0}="$arg_{0} $x"; }} ;; esac\n'
+            '  done\n'
+            '  if [ -n "$opt_{0}" ]; then echo "{0}: $opt_{0}"; else echo "{0}:$arg_{0}"; fi\n'
+            '}}\n'.format(i))
+    return ''.join(parts)
+
+def bench_functions():
+    count = 2000
+    repeat = 20
+    script = ' '.join('lib_f{} -v a b;'.format(i) for i in range(0, count, count // 12))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        library = os.path.join(tmp, 'library.sh')
+        # The cat builtin reads the status of the shell itself, the rusage
+        # of a child would include the memory of the forking Python process
+        library_status = os.path.join(tmp, 'library_status.sh')
+        for path, tail in [(library, ''), (library_status, 'cat /proc/self/status\n')]:
+            with open(path, 'w') as f:
+                f.write(function_library(count))
+                f.write(script + '\n' + tail)
+
+        for name, env in [('eager', {}), ('lazy', {'POSIX_SHELL_LAZY_FUNCTIONS': '1'})]:
+            def run(path):
+                return subprocess.run([TEST_BINARY, path], env=dict(os.environ, **env), stdout=subprocess.PIPE, check=True).stdout
+
+            t = timed(lambda: run(library), repeat)
+            report('{}: {} functions, 12 called'.format(name, count), t, repeat, 'runs')
+            status = run(library_status).decode().splitlines()
+            peak = next(line.split()[1] for line in status if line.startswith('VmHWM:'))
+            print('  {:<40} {:>12} KB'.format('{}: peak RSS'.format(name), peak))
+
+# child reaping
+
+def bench_reap():
+    children = 1000
+    sleep = 0.5
+    # All the children run at the same time, what is left beyond the sleep
+    # is forking and waiting
+    script = ' | '.join(['sleep {}'.format(sleep)] * children)
+
+    shells = [
+        ('pidfd', [TEST_BINARY], {}),
+        ('SIGCHLD self-pipe', [TEST_BINARY], {'POSIX_SHELL_SIGCHLD_WAIT': '1'}),
+    ]
+    for reference in ['/bin/bash', '/bin/dash']:
+        if os.path.exists(reference):
+            shells.append((reference, [reference], {}))
+
+    for name, command, env in shells:
+        t = timed(lambda: subprocess.run(command + ['-c', script], env=dict(os.environ, **env), check=True), 1)
+        report('{}: {} x sleep, overhead'.format(name, children), t - sleep, children, 'children')
+
+# buffered builtin output
+
+def bench_output():
+    levels = int(os.environ.get('BENCH_OUTPUT_LEVELS', '6'))
+    loop = nested_loops(levels, 'echo line $a0$a1$a2$a3$a4$a5')
+
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, 'out')
+        scripts = [
+            ('file', '{} > {}'.format(loop, out)),
+            # An external reader, so the output goes through a real pipe
+            ('pipe', '{} | /bin/cat > /dev/null'.format(loop)),
+        ]
+
+        for name, env in [('buffered', {}), ('unbuffered', {'POSIX_SHELL_UNBUFFERED_OUTPUT': '1'})]:
+            for label, script in scripts:
+                t = timed(lambda: subprocess.run([TEST_BINARY, '-c', script], env=dict(os.environ, **env), check=True), 1)
+                report('{}: 10^{} x echo to {}'.format(name, levels, label), t, 10 ** levels, 'lines')
+
+# persistent fds
+
+def bench_exec():
+    levels = int(os.environ.get('BENCH_EXEC_LEVELS', '6'))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        log = os.path.join(tmp, 'log')
+        scripts = [
+            ('exec 3>>', 'exec 3>>{}; {}'.format(log, nested_loops(levels, 'echo x >&3'))),
+            ('reopen >>', nested_loops(levels, 'echo x >> {}'.format(log))),
+        ]
+
+        for label, script in scripts:
+            t = timed(lambda: subprocess.run([TEST_BINARY, '-c', script], check=True), 1)
+            report('{}: 10^{} appends'.format(label, levels), t, 10 ** levels, 'appends')
+            os.unlink(log)
+
+# eval and . parse cache
+
+def bench_eval():
+    levels = int(os.environ.get('BENCH_EVAL_LEVELS', '5'))
+    # Ten distinct strings, one per value of the innermost variable
+    script = nested_loops(levels, 'eval "if [ \\$a0 = $a{} ]; then v=\\$a1; else v=\\$a2; fi"'.format(levels - 1))
+
+    shells = [
+        ('cached', TEST_BINARY, {}),
+        ('uncached', TEST_BINARY, {'POSIX_SHELL_PARSE_CACHE_SIZE': '0'}),
+    ]
+    for reference in ['/bin/bash', '/bin/dash']:
+        if os.path.exists(reference):
+            shells.append((reference, reference, {}))
+
+    for name, binary, env in shells:
+        t = timed(lambda: subprocess.run([binary, '-c', script], env=dict(os.environ, **env), check=True), 1)
+        report('{}: 10^{} evals'.format(name, levels), t, 10 ** levels, 'evals')
+
+# integer variables
+
+def bench_arith():
+    levels = int(os.environ.get('BENCH_ARITH_LEVELS', '7'))
+    script = 'i=0; n={}; while [ $i -lt $n ]; do i=$((i + 1)); done; [ $i -eq $n ]'.format(10 ** levels)
+
+    shells = [TEST_BINARY]
+    for reference in ['/bin/bash', '/bin/dash']:
+        if os.path.exists(reference):
+            shells.append(reference)
+
+    for binary in shells:
+        t = timed(lambda: subprocess.run([binary, '-c', script], check=True), 1)
+        report('{}: 10^{} iterations'.format(binary, levels), t, 10 ** levels, 'iterations')
+
+# optimization pass
+
+def bench_optimize():
+    levels = int(os.environ.get('BENCH_OPTIMIZE_LEVELS', '5'))
+    body = ('if true; then [ "${prefix%/*}" = /usr/local ] && : "${name#posix_}" "$prefix/$name"; fi; '
+            'mode=fast; case $mode in fast) : ;; esac')
+    script = 'prefix=/usr/local/bin; name=posix_shell; ' + nested_loops(levels, body)
+
+    for level in ['0', '1']:
+        t = timed(lambda: subprocess.run([TEST_BINARY, '-O', level, '-c', script], check=True), 3)
+        report('-O{}: 10^{} iterations'.format(level, levels), t, 10 ** levels, 'iterations')
+
+# streaming for loops
+
+def bench_stream():
+    lines = int(os.environ.get('BENCH_STREAM_LINES', '1000000'))
+    env = dict(os.environ, POSIX_SHELL_UNBUFFERED_OUTPUT='1')
+
+    for level in ['1', '2']:
+        # The producer keeps running for a second after its first line
+        script = 'for x in $(echo first; sleep 1; echo second); do echo $x; done'
+        start = time.perf_counter()
+        p = subprocess.Popen([TEST_BINARY, '-O', level, '-c', script], stdout=subprocess.PIPE, env=env)
+        p.stdout.readline()
+        first = time.perf_counter() - start
+        p.communicate()
+        print('  {:<40} {:>12.1f} ms'.format('-O{}: time to first iteration'.format(level), first * 1000))
+
+        script = 'for x in $(seq 1 {}); do :; done'.format(lines)
+        start = time.perf_counter()
+        p = subprocess.Popen([TEST_BINARY, '-O', level, '-c', script])
+        _, _, usage = os.wait4(p.pid, 0)
+        report('-O{}: {} fields'.format(level, lines), time.perf_counter() - start, lines, 'fields')
+        print('  {:<40} {:>12} KB'.format('-O{}: peak RSS'.format(level), usage.ru_maxrss))
+
+# AST layout
+
+def bench_ast():
+    lines = int(os.environ.get('BENCH_AST_LINES', '6000'))
+
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, 'library.sh')
+        with open(script, 'w') as f:
+            # The stats builtin runs while the whole program is still alive
+            f.write(function_library(lines // 6) + 'stats\n')
+
+        stats = subprocess.run([MEMORY_PROFILE_BINARY, script], stdout=subprocess.PIPE, check=True).stdout.decode()
+
+    values = dict(line.split() for line in stats.splitlines())
+    ast_bytes = int(values['memory_lex_live_bytes']) + int(values['memory_parse_live_bytes'])
+    print('  {:<40} {:>12.1f} bytes'.format('AST per 1k lines', ast_bytes * 1000 / lines))
+
+    body = 'if [ $a0 = 5 ]; then x=$a1; elif [ $a1 = 5 ]; then x=$a2; else case $a2 in 1|2) x=1 ;; *) x=2 ;; esac; fi'
+    loop = nested_loops(5, body)
+    t = timed(lambda: subprocess.run([TEST_BINARY, '-c', loop], check=True), 3)
+    report('if/case loop body', t, 3 * 10 ** 5, 'iterations')
+
+# startup
+
+STATIC_BINARY = './main_static'
+
+# Counts the instructions retired by this process and the processes it
+# starts while enabled. The Python part is the same for every shell.
+# Needs hardware counters, which most VMs don't have.
+class instruction_counter:
+    def __init__(self):
+        import ctypes
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        # perf_event_attr: type, size, config, then the flags at offset 40:
+        # disabled, inherit, exclude_kernel, exclude_hv
+        attr = bytearray(128)
+        struct.pack_into('=IIQ', attr, 0, 0, len(attr), 1)
+        struct.pack_into('=Q', attr, 40, 1 | 2 | 32 | 64)
+        self.fd = self.libc.syscall(298, (ctypes.c_char * len(attr)).from_buffer(attr), 0, -1, -1, 0)
+
+    def available(self):
+        return self.fd >= 0
+
+    def count(self, f):
+        PERF_EVENT_IOC_ENABLE, PERF_EVENT_IOC_DISABLE, PERF_EVENT_IOC_RESET = 0x2400, 0x2401, 0x2403
+        import fcntl
+        fcntl.ioctl(self.fd, PERF_EVENT_IOC_RESET, 0)
+        fcntl.ioctl(self.fd, PERF_EVENT_IOC_ENABLE, 0)
+        f()
+        fcntl.ioctl(self.fd, PERF_EVENT_IOC_DISABLE, 0)
+        return struct.unpack('=Q', os.read(self.fd, 8))[0]
+
+def bench_startup():
+    repeat = 500
+    devnull = subprocess.DEVNULL
+    counter = instruction_counter()
+    if not counter.available():
+        print('  no hardware counters, instructions retired not measured')
+
+    for shell in [TEST_BINARY, STATIC_BINARY, '/bin/bash', '/bin/dash']:
+        if not os.path.exists(shell):
+            continue
+
+        run = lambda: subprocess.run([shell, '-c', 'true'], stdout=devnull)
+        t = timed(run, repeat)
+        report('{} -c true'.format(shell), t, repeat, 'runs')
+        if counter.available():
+            instructions = counter.count(lambda: [run() for _ in range(10)]) // 10
+            print('  {:<40} {:>12} instructions'.format('', instructions))
+
+# memory per phase
+
+MEMORY_PROFILE_BINARY = './main_memprof'
+
+def memory_reference_script():
+    calls = ' '.join('lib_f{} -v a b;'.format(i) for i in range(0, 500, 25))
+    loops = 'for i in $(seq 2000); do s="$s $i"; done; for w in $s; do case $w in *7) n="$n$w" ;; esac; done'
+    return function_library(500) + calls + '\n' + loops + '\n'
+
+# Peak bytes of the reference script, regenerate with BENCH_MEMORY_UPDATE=1
+MEMORY_BASELINE = {
+    'memory_peak_bytes': 1170803,
+    'memory_other_peak_bytes': 344641,
+    'memory_lex_peak_bytes': 62,
+    'memory_parse_peak_bytes': 924073,
+    'memory_expand_peak_bytes': 107414,
+    'memory_exec_peak_bytes': 163323,
+}
+# 10%, and some slack for the phases that barely allocate
+MEMORY_TOLERANCE = 1.1
+MEMORY_SLACK = 4096
+
+def bench_memory():
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, 'reference.sh')
+        with open(script, 'w') as f:
+            f.write(memory_reference_script())
+
+        stats = subprocess.run([MEMORY_PROFILE_BINARY, '--stats', script],
+            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, check=True).stderr.decode()
+
+    peaks = {}
+    for line in stats.splitlines():
+        name, value = line.split()
+        if name.startswith('memory_') and name.endswith('peak_bytes'):
+            peaks[name] = int(value)
+
+    if os.environ.get('BENCH_MEMORY_UPDATE'):
+        for name, value in peaks.items():
+            print("    '{}': {},".format(name, value))
+        return
+
+    grown = []
+    for name, value in peaks.items():
+        baseline = MEMORY_BASELINE.get(name, 0)
+        print('  {:<40} {:>12} bytes (baseline {})'.format(name, value, baseline))
+        if value > baseline * MEMORY_TOLERANCE + MEMORY_SLACK:
+            grown.append(name)
+
+    if grown:
+        raise SystemExit('memory peak grew: ' + ', '.join(grown))
+
+# differential suite against bash and dash
+
+SUITE_SHELLS = [TEST_BINARY, '/bin/bash', '/bin/dash']
+
+# Appended to every workload, works the same in all the shells
+SUITE_PEAK_RSS = '\nwhile read -r key value unit; do case $key in VmHWM:) echo "$value" >&2 ;; esac; done < /proc/$$/status\n'
+
+def suite_workloads(tmp):
+    data = os.path.join(tmp, 'data')
+    with open(data, 'w') as f:
+        for i in range(100000):
+            f.write('{} field{} more text on the line\n'.format(i, i % 7))
+
+    words = ' '.join(str(i) for i in range(1000))
+
+    return [
+        # Comparisons with test and an if/elif chain, arithmetic has its own benchmarks
+        ('test loop', nested_loops(4, 'if [ $a0 -lt $a1 ]; then n=$a2; elif [ $a2 -ge 5 ]; then n=$a3; fi') + '; echo $n'),
+        ('while read', 'n=0; while read -r num field rest; do n=$field; done < {}; echo $n'.format(data)),
+        ('substitution', 'for i in {0}; do x=$(echo $i); y=$(echo "$x$x"); done; for i in 1 2 3 4 5 6 7 8 9 10; do z=$(/bin/echo $i); done; echo $y $z'.format(words)),
+        ('pipelines', 'for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do echo $i | tr 0-9 a-j | cat | cat > /dev/null; done; grep field3 {} | cut -d" " -f1 | sort -n | uniq | tail -1'.format(data)),
+        ('recursion', 'r() { [ $# -eq 0 ] && return 0; shift; r "$@"; }; set -- $(seq 300); for i in 1 2 3 4 5 6 7 8 9 10; do r "$@"; done; echo done'),
+        ('case dispatch', nested_loops(4, 'case $a0$a1$a2 in 0*) x=zero ;; 1?5) x=mid ;; *9) x=nine ;; [2-4]*) x=low ;; *) x=other ;; esac') + '; echo $x'),
+        ('large script', function_library(2000) + ' '.join('lib_f{} -v a b;'.format(i) for i in range(0, 2000, 100)) + '\n'),
+    ]
+
+def percentile(samples, p):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+def read_int(path):
+    with open(path) as f:
+        return int(f.read())
+
+def suite_run(shell, path):
+    before = read_int('/proc/sys/kernel/ns_last_pid')
+    start = time.perf_counter()
+    p = subprocess.run([shell, path], stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+    seconds = time.perf_counter() - start
+    # Every new pid but the shell's own, other processes on the machine
+    # make this an upper bound
+    forks = (read_int('/proc/sys/kernel/ns_last_pid') - before - 1) % read_int('/proc/sys/kernel/pid_max')
+    peak_rss = int(p.stderr.split()[-1])
+    return seconds, forks, peak_rss, p.stdout
+
+# Median seconds of our shell divided by those of bash, which takes out
+# most of the differences between machines and runs. Regenerate with
+# BENCH_SUITE_UPDATE=1.
+SUITE_BASELINE = {
+    'test loop': 2.906,
+    'while read': 2.106,
+    'substitution': 0.135,
+    'pipelines': 2.301,
+    'recursion': 0.118,
+    'case dispatch': 2.872,
+    'large script': 20.968,
+}
+SUITE_THRESHOLD = float(os.environ.get('BENCH_SUITE_THRESHOLD', '0.25'))
+
+def bench_suite():
+    repeat = int(os.environ.get('BENCH_SUITE_REPEAT', '5'))
+    shells = [shell for shell in SUITE_SHELLS if os.path.exists(shell)]
+    results = []
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, script in suite_workloads(tmp):
+            path = os.path.join(tmp, 'workload.sh')
+            with open(path, 'w') as f:
+                f.write(script + SUITE_PEAK_RSS)
+
+            outputs = {}
+            for shell in shells:
+                runs = [suite_run(shell, path) for _ in range(repeat)]
+                seconds = [run[0] for run in runs]
+                outputs[shell] = runs[0][3]
+                results.append({
+                    'workload': name,
+                    'shell': shell,
+                    'median': percentile(seconds, 0.5),
+                    'p95': percentile(seconds, 0.95),
+                    'forks': min(run[1] for run in runs),
+                    'peak_rss_kb': max(run[2] for run in runs),
+                })
+
+            # A faster wrong answer doesn't count
+            if any(output != outputs[shells[0]] for output in outputs.values()):
+                raise SystemExit('{}: the shells disagree on the output'.format(name))
+
+    print('  {:<16} {:<12} {:>10} {:>10} {:>8} {:>10}'.format('workload', 'shell', 'median s', 'p95 s', 'forks', 'peak KB'))
+    for r in results:
+        print('  {:<16} {:<12} {:>10.4f} {:>10.4f} {:>8} {:>10}'.format(
+            r['workload'], os.path.basename(r['shell']), r['median'], r['p95'], r['forks'], r['peak_rss_kb']))
+
+    json_path = os.environ.get('BENCH_SUITE_JSON')
+    if json_path:
+        with open(json_path, 'w') as f:
+            json.dump(results, f, indent=2)
+
+    medians = {(r['workload'], r['shell']): r['median'] for r in results}
+    if '/bin/bash' not in shells:
+        print('  no /bin/bash, skipping the baseline check')
+        return
+    ratios = {r['workload']: r['median'] / medians[r['workload'], '/bin/bash'] for r in results if r['shell'] == TEST_BINARY}
+
+    if os.environ.get('BENCH_SUITE_UPDATE'):
+        for name, ratio in ratios.items():
+            print("    '{}': {:.3f},".format(name, ratio))
+        return
+
+    regressed = [name for name, ratio in ratios.items()
+        if name in SUITE_BASELINE and ratio > SUITE_BASELINE[name] * (1 + SUITE_THRESHOLD)]
+    if regressed:
+        raise SystemExit('slower than the baseline by more than {:.0%}: {}'.format(SUITE_THRESHOLD, ', '.join(regressed)))
+
+BENCHMARKS = {
+    'server': bench_server,
+    'cache': bench_cache,
+    'startup': bench_startup,
+    'cat': bench_cat,
+    'read': bench_read,
+    'pipeline': bench_pipeline,
+    'subshell': bench_subshell,
+    'values': bench_values,
+    'append': bench_append,
+    'output': bench_output,
+    'exec': bench_exec,
+    'eval': bench_eval,
+    'arith': bench_arith,
+    'optimize': bench_optimize,
+    'stream': bench_stream,
+    'ast': bench_ast,
+    'shift': bench_shift,
+    'strip': bench_strip,
+    'control': bench_control,
+    'functions': bench_functions,
+    'reap': bench_reap,
+    'memory': bench_memory,
+    'suite': bench_suite,
+}
+
+def main():
+    names = sys.argv[1:] or list(BENCHMARKS)
+    for name in names:
+        print(name)
+        BENCHMARKS[name]()
+
+if __name__ == '__main__':
+    main()
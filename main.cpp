@@ -6,21 +6,40 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <getopt.h>
 
-#include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
-#include <fstream>
-#include <sstream>
+#include <list>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <bitset>
 #include <algorithm>
 #include <memory>
+#include <atomic>
 #include <variant>
-
-#include <readline/readline.h>
-#include <readline/history.h>
-#undef NEWLINE // Readline is annoying and defines this
+#include <exception>
 
 using std::vector;
 using std::string;
@@ -28,6 +47,7 @@ using std::map;
 using std::variant;
 
 #define SHELL_NAME "posix_shell"
+#define SHELL_VERSION "0.1"
 
 // Errors
 
@@ -50,11 +70,129 @@ public:
     throw shell_exception(msg);
 }
 
+bool output_write(int fd, const char *data, size_t size);
+
 void error_message(const string &msg)
 {
-    std::cerr << SHELL_NAME << ": " << msg << std::endl;
+    string line = SHELL_NAME ": " + msg + "\n";
+    output_write(2, line.data(), line.size());
+}
+
+// Memory profiling
+//
+// Built with -DMEMORY_PROFILE (make main_memprof), every allocation is
+// charged to the phase the shell is in: lexing, parsing, expansion or
+// execution. Phases nest and an allocation goes to the innermost one, so
+// the words of the AST are charged to lexing. --stats and the stats
+// builtin then report live bytes, peak bytes and allocations per phase.
+
+enum memory_phase
+{
+    PHASE_OTHER,
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_EXPAND,
+    PHASE_EXEC,
+    PHASE_COUNT,
+};
+
+#ifdef MEMORY_PROFILE
+
+const char *const memory_phase_names[PHASE_COUNT] = {"other", "lex", "parse", "expand", "exec"};
+
+struct memory_phase_usage
+{
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t allocations;
+};
+
+memory_phase_usage memory_phases[PHASE_COUNT];
+memory_phase current_memory_phase = PHASE_OTHER;
+size_t memory_live_bytes = 0;
+size_t memory_peak_bytes = 0;
+
+// Sits in front of every allocation, 16 bytes keep the alignment of malloc
+struct alignas(16) allocation_header
+{
+    size_t size;
+    memory_phase phase;
+};
+
+void *operator new(size_t size)
+{
+    auto *header = static_cast<allocation_header *>(malloc(sizeof(allocation_header) + size));
+    if (!header)
+        throw std::bad_alloc();
+
+    header->size = size;
+    header->phase = current_memory_phase;
+
+    memory_phase_usage &usage = memory_phases[current_memory_phase];
+    usage.live_bytes += size;
+    usage.peak_bytes = std::max(usage.peak_bytes, usage.live_bytes);
+    usage.allocations++;
+
+    memory_live_bytes += size;
+    memory_peak_bytes = std::max(memory_peak_bytes, memory_live_bytes);
+
+    return header + 1;
+}
+
+void operator delete(void *p) noexcept
+{
+    if (!p)
+        return;
+
+    auto *header = static_cast<allocation_header *>(p) - 1;
+    memory_phases[header->phase].live_bytes -= header->size;
+    memory_live_bytes -= header->size;
+    free(header);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+string format_memory_usage()
+{
+    string result = "memory_peak_bytes " + std::to_string(memory_peak_bytes) + "\n";
+
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        string prefix = string("memory_") + memory_phase_names[i];
+        result += prefix + "_live_bytes " + std::to_string(memory_phases[i].live_bytes) + "\n"
+            + prefix + "_peak_bytes " + std::to_string(memory_phases[i].peak_bytes) + "\n"
+            + prefix + "_allocations " + std::to_string(memory_phases[i].allocations) + "\n";
+    }
+
+    return result;
 }
 
+class phase_scope
+{
+    memory_phase saved;
+
+public:
+
+    phase_scope(memory_phase phase)
+        : saved{current_memory_phase}
+    {
+        current_memory_phase = phase;
+    }
+
+    ~phase_scope() { current_memory_phase = saved; }
+};
+
+#else
+
+struct phase_scope
+{
+    phase_scope(memory_phase) { }
+};
+
+#endif
+
 // Utils
 
 int str_to_int(const char *str)
@@ -67,12 +205,24 @@ int str_to_int(const char *str)
     return n;
 }
 
+string read_fd(int fd);
+
+// An unreadable file reads as empty
 string read_file(const char *path)
 {
-    std::ifstream f(path);
-    std::stringstream buffer;
-    buffer << f.rdbuf();
-    return buffer.str();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return "";
+
+    string result;
+    try {
+        result = read_fd(fd);
+    }
+    catch (const shell_exception &) {
+        result.clear();
+    }
+    close(fd);
+    return result;
 }
 
 string read_fd(int fd)
@@ -93,6 +243,127 @@ string read_fd(int fd)
     return result;
 }
 
+bool write_full(int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+
+    while (size > 0) {
+        ssize_t res = write(fd, p, size);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        p += res;
+        size -= res;
+    }
+
+    return true;
+}
+
+// write_full for sockets, a peer that is gone makes it fail instead of
+// raising SIGPIPE
+bool send_full(int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+
+    while (size > 0) {
+        ssize_t res = send(fd, p, size, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        p += res;
+        size -= res;
+    }
+
+    return true;
+}
+
+// Output buffering
+//
+// Builtin output goes through one shell-owned buffer, so a loop printing a
+// million lines doesn't make a million write calls. The buffer holds the
+// output of one fd at a time: writing to another fd flushes it first, so
+// stdout and stderr keep their order when they share a file. It is flushed
+// before fork and exec, before blocking reads, when redirections change
+// fds and at exit. Output to a tty is flushed at every newline.
+
+const size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+
+struct output_buffer
+{
+    // -1 when nothing is known about the fd
+    int fd = -1;
+    bool is_tty = false;
+    string data;
+};
+
+output_buffer output;
+
+// Set by POSIX_SHELL_UNBUFFERED_OUTPUT, for comparison
+bool output_unbuffered = false;
+
+bool output_flush()
+{
+    bool written = output.data.empty() || write_full(output.fd, output.data.data(), output.data.size());
+    output.data.clear();
+    return written;
+}
+
+void output_flush_at_exit()
+{
+    output_flush();
+}
+
+// Before the fds change under the buffer
+void output_forget_fds()
+{
+    output_flush();
+    output.fd = -1;
+}
+
+bool output_write(int fd, const char *data, size_t size)
+{
+    if (fd != output.fd) {
+        if (!output_flush())
+            return false;
+        output.fd = fd;
+        output.is_tty = isatty(fd);
+    }
+
+    if (output.data.size() + size > OUTPUT_BUFFER_SIZE) {
+        if (!output_flush())
+            return false;
+        // Large writes skip the buffer
+        if (size >= OUTPUT_BUFFER_SIZE)
+            return write_full(fd, data, size);
+    }
+
+    output.data.append(data, size);
+
+    if (output_unbuffered || (output.is_tty && memchr(data, '\n', size)))
+        return output_flush();
+
+    return true;
+}
+
+bool read_full(int fd, void *data, size_t size)
+{
+    char *p = static_cast<char *>(data);
+
+    while (size > 0) {
+        ssize_t res = read(fd, p, size);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        p += res;
+        size -= res;
+    }
+
+    return true;
+}
+
 // Prasing
 
 vector<string> operators
@@ -167,6 +438,18 @@ bool is_special_param(char c)
     return c == '@' || c == '*' || c == '#' || c == '?' || c =='-' || c == '$' || c == '!' || c =='0';
 }
 
+bool is_name(const string &str)
+{
+    if (str.empty() || !(isalpha(str[0]) || str[0] == '_'))
+        return false;
+
+    for (char c : str)
+        if (!(isalnum(c) || c == '_'))
+            return false;
+
+    return true;
+}
+
 class Reader
 {
     string data;
@@ -177,6 +460,10 @@ public:
     Reader(const string &data)
         : data{data}, i{0} { }
 
+    size_t position() { return i; }
+
+    string slice(size_t start, size_t end) { return data.substr(start, end - start); }
+
     bool eof() { return i >= data.size(); }
 
     char peek()
@@ -465,6 +752,7 @@ public:
 
     string read_token(bool *out_is_io_number)
     {
+        phase_scope phase(PHASE_LEX);
         *out_is_io_number = false;
 
         string result;
@@ -629,6 +917,15 @@ public:
     void eat(TokenType type, const char *value) { _eat(type, value, false); }
     void eat_reserved(TokenType type, const char *value) { _eat(type, value, true); }
 
+    // Source position after the current token and the blanks that follow it
+    size_t position()
+    {
+        assert(extra_token.empty());
+        return r.position();
+    }
+
+    string slice(size_t start, size_t end) { return r.slice(start, end); }
+
     // This exists just so we could parse function definitions
     bool at_lookahead(TokenType type, const char *value)
     {
@@ -641,55 +938,88 @@ public:
     }
 };
 
-struct ast_redirect
+// Abstract syntax tree
+//
+// A parsed program is one ast_pool. The nodes of each kind sit next to each
+// other in an array of their own and refer to other nodes by 32-bit index,
+// and every distinct word is stored once in the string table. Lists of
+// children, like the and-ors of a compound list or the words of a command,
+// are ranges of consecutive entries: the parser collects the children of a
+// node and appends them together. Running a loop body then walks a few
+// dense arrays, instead of a vector and a string allocation per node.
+
+typedef uint32_t ast_index;
+
+const ast_index NO_INDEX = UINT32_MAX;
+
+// Entries begin to begin + count - 1 of one of the pool arrays
+struct ast_range
 {
-    string lhs;
-    string op;
-    string rhs;
-};
+    uint32_t begin = 0;
+    uint32_t count = 0;
 
-struct ast_and_or;
+    bool empty() const { return count == 0; }
+};
 
-struct ast_compound_list
+// The strings are indices into the string table, lhs is empty without an
+// io number
+struct ast_redirect
 {
-    vector<ast_and_or> and_ors;
+    ast_index lhs;
+    ast_index op;
+    ast_index rhs;
 };
 
+// A range of and-ors
+typedef ast_range ast_compound_list;
+
 struct ast_simple_command
 {
-    vector<string> assignments;
-    vector<string> args;
-    vector<ast_redirect> redirections;
+    ast_range assignments;
+    ast_range args;
+    ast_range redirections;
 };
 
 struct ast_brace_group
 {
     ast_compound_list commands;
+    ast_range redirections;
 };
 
 struct ast_subshell
 {
     ast_compound_list commands;
+    ast_range redirections;
 };
 
 struct ast_for_clause
 {
-    string var_name;
-    vector<string> wordlist;
+    ast_index var_name;
+    ast_range wordlist;
+    ast_compound_list body;
+    ast_range redirections;
+};
+
+struct ast_case_item
+{
+    ast_range patterns;
     ast_compound_list body;
 };
 
 struct ast_case_clause
 {
-    string value;
-    vector<vector<string>> patterns;
-    vector<ast_compound_list> bodies;
+    ast_index value;
+    ast_range items;
+    ast_range redirections;
 };
 
+// Ranges of compound lists, with an else there is one more body than
+// conditions
 struct ast_if_clause
 {
-    vector<ast_compound_list> conditions;
-    vector<ast_compound_list> bodies;
+    ast_range conditions;
+    ast_range bodies;
+    ast_range redirections;
 };
 
 struct ast_while_clause
@@ -697,43 +1027,244 @@ struct ast_while_clause
     ast_compound_list condition;
     ast_compound_list body;
     bool until = false;
+    ast_range redirections;
 };
 
 struct ast_function_definition
 {
-    string name;
-    ast_brace_group body;
+    ast_index name;
+    // A brace group, NO_INDEX when the body is lazy
+    ast_index body;
+    // Source of a lazy body and its redirections (see function_body)
+    ast_index lazy_source;
+};
+
+enum class ast_kind : uint8_t
+{
+    SIMPLE_COMMAND,
+    BRACE_GROUP,
+    SUBSHELL,
+    FOR_CLAUSE,
+    CASE_CLAUSE,
+    IF_CLAUSE,
+    WHILE_CLAUSE,
+    FUNCTION_DEFINITION,
 };
 
 struct ast_command
 {
-    variant<
-        ast_simple_command,
-        ast_brace_group,
-        ast_subshell,
-        ast_for_clause,
-        ast_case_clause,
-        ast_if_clause,
-        ast_while_clause,
-        ast_function_definition> cmd;
+    ast_kind kind;
+    // Into the array of nodes of that kind
+    ast_index index;
 };
 
 struct ast_pipeline
 {
-    bool invert_exit_code = 0;
-    vector<ast_command> commands;
+    ast_range commands;
+    bool invert_exit_code = false;
+    // Whether && or || comes before it, unused for the first of an and-or
+    bool is_and = false;
 };
 
 struct ast_and_or
 {
-    bool async = 0;
+    ast_range pipelines;
+    bool async = false;
+};
+
+// A range of a pool array, for range-based for
+template<typename T>
+struct ast_slice
+{
+    const T *first;
+    const T *last;
+
+    const T *begin() const { return first; }
+    const T *end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    const T &operator[](size_t i) const { return first[i]; }
+};
+
+// A range of words, as strings
+class ast_words
+{
+    const vector<string> *strings;
+    const ast_index *first;
+    const ast_index *last;
+
+public:
+
+    struct iterator
+    {
+        const vector<string> *strings;
+        const ast_index *p;
+
+        const string &operator*() const { return (*strings)[*p]; }
+        iterator &operator++() { ++p; return *this; }
+        bool operator!=(const iterator &other) const { return p != other.p; }
+    };
+
+    ast_words(const vector<string> *strings, const ast_index *first, const ast_index *last)
+        : strings{strings}, first{first}, last{last} { }
+
+    iterator begin() const { return {strings, first}; }
+    iterator end() const { return {strings, last}; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+    const string &operator[](size_t i) const { return (*strings)[first[i]]; }
+};
+
+// What optimize_program found out about a string
+struct ast_string_info
+{
+    // Expanding it gives the string itself
+    bool literal = false;
+    // Indices into literal_values, for a literal for word and for the
+    // value of a literal assignment, NO_INDEX otherwise
+    ast_index value = NO_INDEX;
+    ast_index assigned_value = NO_INDEX;
+};
+
+// An and-or that is just true, false or :, with its exit status. It only
+// holds while no function has that name.
+struct ast_constant
+{
+    ast_index name = NO_INDEX;
+    int status = 0;
+};
+
+struct ast_loop_info
+{
+    // Some words of the body are marked WORD_INVARIANT
+    bool invariants = false;
+    // Every word of a for list is literal
+    bool literal_words = false;
+    // The for list is a lone $(...) or `...` (see command_stream)
+    bool streams = false;
+    // Command names of the body, none of them may be a function when the
+    // loop starts for the invariants to hold. Indices into guard_names.
+    ast_range guard;
+};
+
+// Flags of word_flags
+const uint8_t WORD_INVARIANT = 1;
+
+// Pools are always shared, functions keep the pool of their body alive
+struct ast_pool : std::enable_shared_from_this<ast_pool>
+{
+    vector<string> strings;
+    vector<ast_index> words;
+    vector<ast_redirect> redirects;
+    vector<ast_compound_list> lists;
+    vector<ast_case_item> case_items;
+    vector<ast_command> commands;
     vector<ast_pipeline> pipelines;
-    vector<bool> is_and;
+    vector<ast_and_or> and_ors;
+    vector<ast_simple_command> simple_commands;
+    vector<ast_brace_group> brace_groups;
+    vector<ast_subshell> subshells;
+    vector<ast_for_clause> for_clauses;
+    vector<ast_case_clause> case_clauses;
+    vector<ast_if_clause> if_clauses;
+    vector<ast_while_clause> while_clauses;
+    vector<ast_function_definition> function_definitions;
+
+    // The top level compound list
+    ast_compound_list program;
+
+    // Filled in by optimize_program, next to the arrays they describe. They
+    // are computed again after loading from the script cache, so they are
+    // never stored there.
+    vector<ast_string_info> string_info;
+    vector<std::shared_ptr<const string>> literal_values;
+    vector<ast_constant> constants;
+    vector<uint8_t> word_flags;
+    vector<ast_loop_info> for_loops;
+    vector<ast_loop_info> while_loops;
+    vector<ast_index> guard_names;
+
+    template<typename T>
+    static ast_slice<T> slice(const vector<T> &array, ast_range range)
+    {
+        const T *first = array.data() + range.begin;
+        return {first, first + range.count};
+    }
+
+    const string &str(ast_index i) const { return strings[i]; }
+
+    ast_words words_of(ast_range range) const
+    {
+        const ast_index *first = words.data() + range.begin;
+        return ast_words(&strings, first, first + range.count);
+    }
+
+    ast_slice<ast_redirect> redirects_of(ast_range range) const { return slice(redirects, range); }
+    ast_slice<ast_compound_list> lists_of(ast_range range) const { return slice(lists, range); }
+    ast_slice<ast_case_item> case_items_of(ast_range range) const { return slice(case_items, range); }
+    ast_slice<ast_command> commands_of(const ast_pipeline &pipeline) const { return slice(commands, pipeline.commands); }
+    ast_slice<ast_pipeline> pipelines_of(const ast_and_or &and_or) const { return slice(pipelines, and_or.pipelines); }
+    ast_slice<ast_and_or> and_ors_of(ast_compound_list list) const { return slice(and_ors, list); }
 };
 
-struct ast_program
+typedef std::shared_ptr<const ast_pool> shared_program;
+
+void optimize_program(ast_pool &pool);
+
+// Fills a pool while parsing
+class ast_builder
 {
-    ast_compound_list commands;
+    std::unordered_map<string, ast_index> interned;
+
+public:
+
+    std::shared_ptr<ast_pool> pool = std::make_shared<ast_pool>();
+
+    ast_index intern(const string &str)
+    {
+        auto it = interned.find(str);
+        if (it != interned.end())
+            return it->second;
+
+        ast_index index = pool->strings.size();
+        pool->strings.push_back(str);
+        interned.emplace(str, index);
+        return index;
+    }
+
+    template<typename T>
+    ast_index add(vector<T> &array, const T &node)
+    {
+        array.push_back(node);
+        return array.size() - 1;
+    }
+
+    // Appends the children of one node, so they end up next to each other
+    template<typename T>
+    ast_range append(vector<T> &array, const vector<T> &nodes)
+    {
+        ast_range range{(uint32_t)array.size(), (uint32_t)nodes.size()};
+        array.insert(array.end(), nodes.begin(), nodes.end());
+        return range;
+    }
+};
+
+// A lazy function body, parsed into a pool of its own on the first call.
+// All copies of the function share it.
+struct lazy_function_body
+{
+    string source;
+    shared_program pool;
+    ast_index body = NO_INDEX;
+};
+
+// A function as the environment keeps it
+struct shell_function
+{
+    shared_program pool;
+    // A brace group in pool, NO_INDEX when the body is lazy
+    ast_index body = NO_INDEX;
+    std::shared_ptr<lazy_function_body> lazy;
 };
 
 // Read zero or more new lines
@@ -759,21 +1290,19 @@ bool at_redirect(TokenReader &r)
     return r.at(TokenType::IO_NUMBER) || at_redirect_operator(r);
 }
 
-ast_redirect parse_redirect(TokenReader &r)
+ast_redirect parse_redirect(TokenReader &r, ast_builder &b)
 {
     ast_redirect redirect;
 
-    if (r.at(TokenType::IO_NUMBER)) {
-        redirect.lhs = r.pop(TokenType::IO_NUMBER);
-    }
+    redirect.lhs = b.intern(r.at(TokenType::IO_NUMBER) ? r.pop(TokenType::IO_NUMBER) : "");
 
     if (!at_redirect_operator(r)) {
         panic("syntax error: expected redirection, but got '" + (r.eof() ? "EOF" : r.peek()) + "'");
     }
 
-    redirect.op = r.pop();        
+    redirect.op = b.intern(r.pop());
 
-    redirect.rhs = r.pop(TokenType::WORD);
+    redirect.rhs = b.intern(r.pop(TokenType::WORD));
 
     return redirect;
 }
@@ -796,86 +1325,112 @@ bool at_assignment_word(TokenReader &r)
     return true;
 }
 
-ast_simple_command parse_simple_command(TokenReader &r)
+// Redirections after a compound command
+ast_range parse_redirect_list(TokenReader &r, ast_builder &b)
+{
+    vector<ast_redirect> redirections;
+    while (at_redirect(r))
+        redirections.push_back(parse_redirect(r, b));
+
+    return b.append(b.pool->redirects, redirections);
+}
+
+ast_simple_command parse_simple_command(TokenReader &r, ast_builder &b)
 {
     ast_simple_command simple_command;
+    vector<ast_index> assignments;
+    vector<ast_index> args;
+    vector<ast_redirect> redirections;
 
     while (true) {
         if (at_assignment_word(r))
-            simple_command.assignments.push_back(r.pop());
+            assignments.push_back(b.intern(r.pop()));
         else if (at_redirect(r))
-            simple_command.redirections.push_back(parse_redirect(r));
+            redirections.push_back(parse_redirect(r, b));
         else
             break;
     }
 
     while (true) {
         if (r.at(TokenType::WORD))
-            simple_command.args.push_back(r.pop());
+            args.push_back(b.intern(r.pop()));
         else if (at_redirect(r))
-            simple_command.redirections.push_back(parse_redirect(r));
+            redirections.push_back(parse_redirect(r, b));
         else
             break;
     }
 
+    simple_command.assignments = b.append(b.pool->words, assignments);
+    simple_command.args = b.append(b.pool->words, args);
+    simple_command.redirections = b.append(b.pool->redirects, redirections);
+
     return simple_command;
 }
 
-ast_compound_list parse_compound_list(TokenReader &r);
+ast_compound_list parse_compound_list(TokenReader &r, ast_builder &b);
 
-ast_brace_group parse_brace_group(TokenReader &r)
+ast_brace_group parse_brace_group(TokenReader &r, ast_builder &b)
 {
     ast_brace_group brace_group;
 
     r.eat_reserved(TokenType::RESERVED_WORD, "{");
-    brace_group.commands = parse_compound_list(r);
+    brace_group.commands = parse_compound_list(r, b);
     r.eat_reserved(TokenType::RESERVED_WORD, "}");
+    brace_group.redirections = parse_redirect_list(r, b);
 
     return brace_group;
 }
 
-ast_subshell parse_subshell(TokenReader &r)
+ast_subshell parse_subshell(TokenReader &r, ast_builder &b)
 {
     ast_subshell subshell;
 
     r.eat_reserved(TokenType::OPERATOR, "(");
-    subshell.commands = parse_compound_list(r);
+    subshell.commands = parse_compound_list(r, b);
     r.eat_reserved(TokenType::OPERATOR, ")");
+    subshell.redirections = parse_redirect_list(r, b);
 
     return subshell;
 }
 
-ast_for_clause parse_for_clause(TokenReader &r)
+ast_for_clause parse_for_clause(TokenReader &r, ast_builder &b)
 {
     ast_for_clause for_clause;
+    vector<ast_index> wordlist;
 
     r.eat_reserved(TokenType::RESERVED_WORD, "for");
-    for_clause.var_name = r.pop(TokenType::WORD);
+    for_clause.var_name = b.intern(r.pop(TokenType::WORD));
     parse_skip_linebreak(r);
 
     if (r.at_reserved(TokenType::RESERVED_WORD, "in")) {
         r.pop();
         while (r.at(TokenType::WORD))
-            for_clause.wordlist.push_back(r.pop());
+            wordlist.push_back(b.intern(r.pop()));
+    }
+    else {
+        wordlist.push_back(b.intern("\"$@\""));
     }
+    for_clause.wordlist = b.append(b.pool->words, wordlist);
 
     if (r.at(TokenType::OPERATOR, ";"))
         r.pop();
     parse_skip_linebreak(r);
 
     r.eat_reserved(TokenType::RESERVED_WORD, "do");
-    for_clause.body = parse_compound_list(r);
+    for_clause.body = parse_compound_list(r, b);
     r.eat_reserved(TokenType::RESERVED_WORD, "done");
+    for_clause.redirections = parse_redirect_list(r, b);
 
     return for_clause;
 }
 
-ast_case_clause parse_case_clause(TokenReader &r)
+ast_case_clause parse_case_clause(TokenReader &r, ast_builder &b)
 {
     ast_case_clause case_clause;
+    vector<ast_case_item> items;
 
     r.eat_reserved(TokenType::RESERVED_WORD, "case");
-    case_clause.value = r.pop(TokenType::WORD);
+    case_clause.value = b.intern(r.pop(TokenType::WORD));
     parse_skip_linebreak(r);
     r.eat_reserved(TokenType::RESERVED_WORD, "in");
     parse_skip_linebreak(r);
@@ -884,20 +1439,22 @@ ast_case_clause parse_case_clause(TokenReader &r)
         if (r.at(TokenType::OPERATOR, "("))
             r.pop();
         
-        vector<string> pattern;
+        vector<ast_index> patterns;
 
-        pattern.push_back(r.pop(TokenType::WORD));
+        patterns.push_back(b.intern(r.pop(TokenType::WORD)));
 
         while (r.at(TokenType::OPERATOR, "|")) {
             r.pop();
-            pattern.push_back(r.pop(TokenType::WORD));
+            patterns.push_back(b.intern(r.pop(TokenType::WORD)));
         }
 
         // TODO: Doesn't really need to be reserved
         r.eat_reserved(TokenType::OPERATOR, ")");
 
-        case_clause.patterns.push_back(pattern);
-        case_clause.bodies.push_back(parse_compound_list(r));
+        ast_case_item item;
+        item.patterns = b.append(b.pool->words, patterns);
+        item.body = parse_compound_list(r, b);
+        items.push_back(item);
 
         if (r.at_reserved(TokenType::OPERATOR, ";;")) {
             r.pop();
@@ -906,86 +1463,190 @@ ast_case_clause parse_case_clause(TokenReader &r)
     }
 
     r.eat_reserved(TokenType::RESERVED_WORD, "esac");
+    case_clause.items = b.append(b.pool->case_items, items);
+    case_clause.redirections = parse_redirect_list(r, b);
 
     return case_clause;
 }
 
-ast_if_clause parse_if_clause(TokenReader &r)
+ast_if_clause parse_if_clause(TokenReader &r, ast_builder &b)
 {
     ast_if_clause if_clause;
+    vector<ast_compound_list> conditions;
+    vector<ast_compound_list> bodies;
 
     r.eat_reserved(TokenType::RESERVED_WORD, "if");
 
-    do {
-        if_clause.conditions.push_back(parse_compound_list(r));
+    while (true) {
+        conditions.push_back(parse_compound_list(r, b));
         r.eat_reserved(TokenType::RESERVED_WORD, "then");
-        if_clause.bodies.push_back(parse_compound_list(r));
-    } while(r.at_reserved(TokenType::RESERVED_WORD, "elif"));
+        bodies.push_back(parse_compound_list(r, b));
+
+        // Each elif is consumed before its condition, like the if
+        if (!r.at_reserved(TokenType::RESERVED_WORD, "elif"))
+            break;
+        r.pop();
+    }
 
     if (r.at_reserved(TokenType::RESERVED_WORD, "else")) {
         r.pop();
-        if_clause.bodies.push_back(parse_compound_list(r));
+        bodies.push_back(parse_compound_list(r, b));
     }
     r.eat_reserved(TokenType::RESERVED_WORD, "fi");
 
+    if_clause.conditions = b.append(b.pool->lists, conditions);
+    if_clause.bodies = b.append(b.pool->lists, bodies);
+    if_clause.redirections = parse_redirect_list(r, b);
+
     return if_clause;
 }
 
-ast_while_clause parse_while_clause(TokenReader &r)
+ast_while_clause parse_while_clause(TokenReader &r, ast_builder &b)
 {
     ast_while_clause while_clause;
 
     while_clause.until = r.at_reserved(TokenType::RESERVED_WORD, "until");
     r.pop();
-    while_clause.condition = parse_compound_list(r);
+    while_clause.condition = parse_compound_list(r, b);
     r.eat_reserved(TokenType::RESERVED_WORD, "do");
-    while_clause.body = parse_compound_list(r);
+    while_clause.body = parse_compound_list(r, b);
     r.eat_reserved(TokenType::RESERVED_WORD, "done");
+    while_clause.redirections = parse_redirect_list(r, b);
 
     return while_clause;
 }
 
-ast_function_definition parse_function_definition(TokenReader &r)
+// Set by POSIX_SHELL_LAZY_FUNCTIONS: function bodies are only skimmed when
+// they are defined, and parsed when they are called for the first time.
+// Large libraries of functions then load quickly, but syntax errors in a
+// body only show up when the function is called.
+bool lazy_function_bodies = false;
+
+// Moves r past a brace group, without building its AST, and returns its
+// source. Only braces in command position count, like in the parser.
+string skip_brace_group(TokenReader &r)
+{
+    // Reserved words after which a command may follow. The closing ones
+    // are here because another } may follow them.
+    static const vector<string> command_starters {"{", "}", "then", "do", "else", "elif", "if", "while", "until", "!", "fi", "done", "esac"};
+
+    if (!r.at_reserved(TokenType::RESERVED_WORD, "{"))
+        panic(string("syntax error near unexpected token '") + r.peek() + "'");
+
+    // The reader is past the { and the blanks after it
+    size_t start = r.position();
+    int depth = 0;
+    bool command_position = true;
+
+    while (true) {
+        if (r.eof())
+            panic("syntax error near unexpected EOF");
+
+        string token = r.peek();
+
+        if (command_position && token == "}" && --depth == 0) {
+            string source = "{ " + r.slice(start, r.position());
+            r.pop();
+            return source;
+        }
+
+        if (command_position && token == "{")
+            depth++;
+
+        if (r.at(TokenType::WORD))
+            command_position = command_position
+                && std::find(command_starters.begin(), command_starters.end(), token) != command_starters.end();
+        else
+            // A word after a redirection operator is a file name
+            command_position = token[0] != '<' && token[0] != '>';
+        r.pop();
+    }
+}
+
+ast_function_definition parse_function_definition(TokenReader &r, ast_builder &b)
 {
     ast_function_definition function_definition;
 
-    function_definition.name = r.pop_reserved(TokenType::WORD);
+    function_definition.name = b.intern(r.pop_reserved(TokenType::WORD));
     r.eat(TokenType::OPERATOR, "(");
     r.eat(TokenType::OPERATOR, ")");
     parse_skip_linebreak(r);
     // TODO: Allow other compound commands as body
-    function_definition.body = parse_brace_group(r);
+
+    if (lazy_function_bodies) {
+        // The redirections go into the source too, so it parses on its own
+        string source = skip_brace_group(r);
+        while (at_redirect(r)) {
+            ast_redirect redirect = parse_redirect(r, b);
+            source += " " + b.pool->str(redirect.lhs) + b.pool->str(redirect.op) + " " + b.pool->str(redirect.rhs);
+        }
+        function_definition.body = NO_INDEX;
+        function_definition.lazy_source = b.intern(source);
+    }
+    else {
+        function_definition.body = b.add(b.pool->brace_groups, parse_brace_group(r, b));
+        function_definition.lazy_source = NO_INDEX;
+    }
 
     return function_definition;
 }
 
-ast_command parse_command(TokenReader &r)
+// Where the body of a function is
+struct function_code
+{
+    const ast_pool &pool;
+    const ast_brace_group &body;
+};
+
+// Parses a lazy body on first use
+function_code function_body(const shell_function &function)
+{
+    if (function.body != NO_INDEX)
+        return {*function.pool, function.pool->brace_groups[function.body]};
+
+    lazy_function_body &lazy = *function.lazy;
+
+    if (!lazy.pool) {
+        phase_scope phase(PHASE_PARSE);
+        ast_builder b;
+        TokenReader r = TokenReader(Reader(lazy.source));
+        ast_index body = b.add(b.pool->brace_groups, parse_brace_group(r, b));
+        if (!r.eof())
+            panic(string("syntax error near unexpected token '") + r.peek() + "'");
+        optimize_program(*b.pool);
+        lazy.pool = b.pool;
+        lazy.body = body;
+    }
+
+    return {*lazy.pool, lazy.pool->brace_groups[lazy.body]};
+}
+
+ast_command parse_command(TokenReader &r, ast_builder &b)
 {
-    ast_command command;
+    ast_pool &pool = *b.pool;
 
     if (r.at_reserved(TokenType::RESERVED_WORD, "{"))
-        command.cmd = parse_brace_group(r);
+        return {ast_kind::BRACE_GROUP, b.add(pool.brace_groups, parse_brace_group(r, b))};
     else if (r.at_reserved(TokenType::OPERATOR, "("))
-        command.cmd = parse_subshell(r);
+        return {ast_kind::SUBSHELL, b.add(pool.subshells, parse_subshell(r, b))};
     else if (r.at_reserved(TokenType::RESERVED_WORD, "for"))
-        command.cmd = parse_for_clause(r);
+        return {ast_kind::FOR_CLAUSE, b.add(pool.for_clauses, parse_for_clause(r, b))};
     else if (r.at_reserved(TokenType::RESERVED_WORD, "case"))
-        command.cmd = parse_case_clause(r);
+        return {ast_kind::CASE_CLAUSE, b.add(pool.case_clauses, parse_case_clause(r, b))};
     else if (r.at_reserved(TokenType::RESERVED_WORD, "if"))
-        command.cmd = parse_if_clause(r);
+        return {ast_kind::IF_CLAUSE, b.add(pool.if_clauses, parse_if_clause(r, b))};
     else if (r.at_reserved(TokenType::RESERVED_WORD, "while") || r.at_reserved(TokenType::RESERVED_WORD, "until"))
-        command.cmd = parse_while_clause(r);
+        return {ast_kind::WHILE_CLAUSE, b.add(pool.while_clauses, parse_while_clause(r, b))};
     else if (r.at_reserved(TokenType::WORD) && r.at_lookahead(TokenType::OPERATOR, "("))
-        command.cmd = parse_function_definition(r);
+        return {ast_kind::FUNCTION_DEFINITION, b.add(pool.function_definitions, parse_function_definition(r, b))};
     else
-        command.cmd = parse_simple_command(r);
-
-    return command;
+        return {ast_kind::SIMPLE_COMMAND, b.add(pool.simple_commands, parse_simple_command(r, b))};
 }
 
-ast_pipeline parse_pipeline(TokenReader &r)
+ast_pipeline parse_pipeline(TokenReader &r, ast_builder &b)
 {
     ast_pipeline pipeline;
+    vector<ast_command> commands;
 
     if (r.at(TokenType::RESERVED_WORD, "!")) {
         r.pop();
@@ -993,7 +1654,7 @@ ast_pipeline parse_pipeline(TokenReader &r)
     }
 
     while (true) {
-        pipeline.commands.push_back(parse_command(r));
+        commands.push_back(parse_command(r, b));
 
         if (r.at(TokenType::OPERATOR, "|")) {
             r.pop();
@@ -1004,18 +1665,22 @@ ast_pipeline parse_pipeline(TokenReader &r)
         }
     }
 
+    pipeline.commands = b.append(b.pool->commands, commands);
     return pipeline;
 };
 
-ast_and_or parse_and_or(TokenReader &r)
+ast_and_or parse_and_or(TokenReader &r, ast_builder &b)
 {
     ast_and_or and_or;
+    vector<ast_pipeline> pipelines;
+    bool is_and = false;
 
     while (true) {
-        and_or.pipelines.push_back(parse_pipeline(r));
+        pipelines.push_back(parse_pipeline(r, b));
+        pipelines.back().is_and = is_and;
 
         if (r.at(TokenType::OPERATOR, "&&") || r.at(TokenType::OPERATOR, "||")) {
-            and_or.is_and.push_back(r.at(TokenType::OPERATOR, "&&"));
+            is_and = r.at(TokenType::OPERATOR, "&&");
             r.pop();
             parse_skip_linebreak(r);
         }
@@ -1029,6 +1694,7 @@ ast_and_or parse_and_or(TokenReader &r)
         r.pop();
     }
 
+    and_or.pipelines = b.append(b.pool->pipelines, pipelines);
     return and_or;
 }
 
@@ -1046,552 +1712,5321 @@ bool at_compound_list_end(TokenReader &r)
         || r.at_reserved(TokenType::OPERATOR, ";;");
 }
 
-ast_compound_list parse_compound_list(TokenReader &r)
+ast_compound_list parse_compound_list(TokenReader &r, ast_builder &b)
 {
-    ast_compound_list compound_list;
+    vector<ast_and_or> and_ors;
 
     parse_skip_linebreak(r);
 
     while (!r.eof() && !at_compound_list_end(r)) {
-        compound_list.and_ors.push_back(parse_and_or(r));
+        and_ors.push_back(parse_and_or(r, b));
         parse_skip_linebreak(r);
     }
 
-    return compound_list;
+    return b.append(b.pool->and_ors, and_ors);
 }
 
-ast_program parse_program(TokenReader &r)
+shared_program parse_program(TokenReader &r)
 {
-    ast_program program;
+    phase_scope phase(PHASE_PARSE);
+    ast_builder b;
 
-    program.commands = parse_compound_list(r);
+    b.pool->program = parse_compound_list(r, b);
 
     if (!r.eof())
         panic("syntax error near unexpected token '" + r.peek() + "'");
 
-    return program;
+    optimize_program(*b.pool);
+    return b.pool;
 }
 
-// Shell Execution environment
-
-struct var
+// Optimization
+//
+// optimize_program runs over a freshly parsed (or loaded) pool and fills
+// in its side tables, which the executor uses to skip work:
+//
+// - Literal words, without quotes or expansions, are their own expansion.
+//   Literal for lists and assignment values get a shared value up front.
+// - And-ors that are just true, false or : have a known exit status, so
+//   if true, while false and the like skip running the command. A function
+//   with that name still wins, so the executor checks for one.
+// - Words in a loop body whose variables the body never assigns expand
+//   to the same fields on every iteration. The first expansion is kept
+//   for the rest of the loop (see loop_invariants). This needs a body that
+//   can't change variables behind our back: no eval, ., read, set, shift,
+//   cd or exec, no function definitions, and none of its command names
+//   may be a function when the loop starts.
+//
+// -O0 (or POSIX_SHELL_OPTIMIZE=0) leaves the tables empty-handed, which
+// runs everything the long way, for comparing the two with test.py.
+//
+// -O2 adds optimizations that results can tell apart: for lists that are
+// a lone $(...) stream the output of the command into the loop (see
+// command_stream).
+
+int optimization_level = 1;
+
+size_t param_name_length(const string &param);
+
+bool is_literal_word(const string &word)
 {
-    string value;
-    bool exported;
-};
+    return word.size() && word[0] != '~' && word.find_first_of("$`'\"\\") == string::npos;
+}
 
-class ex_env
+class ast_optimizer
 {
-    map<string, var> vars;
-    map<string, ast_function_definition> functions;
-    string arg0;
-    pid_t shell_pid;
-    vector<vector<string>> args;
+    ast_pool &pool;
 
-public:
+    // What a loop body may do to the variables
+    struct loop_effects
+    {
+        std::set<string> assigned;
+        std::set<ast_index> command_names;
+        bool pure = true;
+    };
 
-    bool has_var(const string &name)
+    ast_index literal_value(const string &value)
     {
-        if (name.size() && is_digits(name)) {
-            return has_arg(str_to_int(name.c_str()));
-        }
+        pool.literal_values.push_back(std::make_shared<const string>(value));
+        return pool.literal_values.size() - 1;
+    }
 
-        if (name.size() == 1 && is_special_param(name[0]))
-            return true;
+    void fold_constant(ast_index index)
+    {
+        const ast_and_or &and_or = pool.and_ors[index];
+        ast_slice<ast_pipeline> pipelines = pool.pipelines_of(and_or);
 
-        return vars.find(name) != vars.end();
+        if (and_or.async || pipelines.size() != 1)
+            return;
+
+        const ast_pipeline &pipeline = pipelines[0];
+        ast_slice<ast_command> commands = pool.commands_of(pipeline);
+        if (commands.size() != 1 || commands[0].kind != ast_kind::SIMPLE_COMMAND)
+            return;
+
+        const ast_simple_command &simple_command = pool.simple_commands[commands[0].index];
+        if (!simple_command.assignments.empty() || !simple_command.redirections.empty() || simple_command.args.count != 1)
+            return;
+
+        ast_index name = pool.words[simple_command.args.begin];
+        const string &str = pool.str(name);
+        if (str != "true" && str != ":" && str != "false")
+            return;
+
+        int status = str == "false";
+        pool.constants[index] = {name, pipeline.invert_exit_code ? !status : status};
     }
 
-    const string get_var(const string &name)
+    // Collects the variables that a word may assign, false when it can't
+    // be told from the text: arithmetic assignments and ${x=...}
+    bool word_assignments_known(const string &word)
     {
-        if (name.size() == 1 && is_special_param(name[0])) {
-            char c = name[0];
-            if (c == '#') {
-                return std::to_string(args.back().size());
-            }
-            else if (c == '0') {
-                return arg0;
-            }
-            else if (c == '$') {
-                return std::to_string(shell_pid);
-            }
-            else {
-                std::cerr << "warning: special param not implemented" << std::endl;
-                return "";
-            }
-        }
+        size_t equals = word.find('=');
+        if (equals == string::npos)
+            return true;
 
-        if (name.size() && is_digits(name)) {
-            return get_arg(str_to_int(name.c_str()));
+        // Anything but == and != in arithmetic may assign
+        if (word.find("$((") != string::npos) {
+            for (size_t i = 0; i < word.size(); i++)
+                if (word[i] == '=' && !(i + 1 < word.size() && word[i + 1] == '=')
+                        && !(i > 0 && (word[i - 1] == '=' || word[i - 1] == '!')))
+                    return false;
         }
 
-        return vars.at(name).value;
-    }
-    
-    void set_var(const string &name, const string &value)
-    {
-        vars[name].value = value;
+        return word.find("${") == string::npos;
     }
 
-    void mark_export(const string &name)
+    void collect_words(ast_range words, loop_effects &effects)
     {
-        setenv(name.c_str(), get_var(name).c_str(), 1);
+        for (const string &word : pool.words_of(words))
+            if (!word_assignments_known(word))
+                effects.pure = false;
     }
 
-    void init_from_environ()
+    void collect_redirects(ast_range redirections, loop_effects &effects)
     {
-        for (char **s = environ; *s; s++) {
-            char *equals = strchr(*s, '=');
-            if (!equals)
-                continue;
-            
-            string name = string(*s, equals - *s);
-            const char *value = equals + 1;
-
-            set_var(name, value);
-            mark_export(name);
-        }
+        for (const ast_redirect &redirect : pool.redirects_of(redirections))
+            if (!word_assignments_known(pool.str(redirect.rhs)))
+                effects.pure = false;
     }
 
-    void push_args(const vector<string> &args)
+    void collect_list(ast_compound_list list, loop_effects &effects)
     {
-        this->args.push_back(args);
+        for (const ast_and_or &and_or : pool.and_ors_of(list))
+            for (const ast_pipeline &pipeline : pool.pipelines_of(and_or))
+                for (const ast_command &command : pool.commands_of(pipeline))
+                    collect_command(command, effects);
     }
 
-    void pop_args()
+    void collect_command(const ast_command &command, loop_effects &effects)
     {
-        if (this->args.size() == 0)
-            assert(0);
-        
-        this->args.pop_back();
+        static const std::set<string> impure_builtins {".", "eval", "read", "set", "shift", "cd", "exec"};
+
+        switch (command.kind) {
+        case ast_kind::SIMPLE_COMMAND: {
+            const ast_simple_command &simple_command = pool.simple_commands[command.index];
+
+            for (const string &assignment : pool.words_of(simple_command.assignments))
+                effects.assigned.insert(assignment.substr(0, assignment.find('=')));
+            collect_words(simple_command.assignments, effects);
+            collect_words(simple_command.args, effects);
+            collect_redirects(simple_command.redirections, effects);
+
+            if (simple_command.args.empty())
+                break;
+
+            ast_index name = pool.words[simple_command.args.begin];
+            if (!pool.string_info[name].literal || impure_builtins.count(pool.str(name)))
+                effects.pure = false;
+            effects.command_names.insert(name);
+            break;
+        }
+        case ast_kind::BRACE_GROUP: {
+            const ast_brace_group &brace_group = pool.brace_groups[command.index];
+            collect_list(brace_group.commands, effects);
+            collect_redirects(brace_group.redirections, effects);
+            break;
+        }
+        case ast_kind::SUBSHELL: {
+            const ast_subshell &subshell = pool.subshells[command.index];
+            collect_list(subshell.commands, effects);
+            collect_redirects(subshell.redirections, effects);
+            break;
+        }
+        case ast_kind::FOR_CLAUSE: {
+            const ast_for_clause &for_clause = pool.for_clauses[command.index];
+            effects.assigned.insert(pool.str(for_clause.var_name));
+            collect_words(for_clause.wordlist, effects);
+            collect_list(for_clause.body, effects);
+            collect_redirects(for_clause.redirections, effects);
+            break;
+        }
+        case ast_kind::CASE_CLAUSE: {
+            const ast_case_clause &case_clause = pool.case_clauses[command.index];
+            if (!word_assignments_known(pool.str(case_clause.value)))
+                effects.pure = false;
+            for (const ast_case_item &item : pool.case_items_of(case_clause.items)) {
+                collect_words(item.patterns, effects);
+                collect_list(item.body, effects);
+            }
+            collect_redirects(case_clause.redirections, effects);
+            break;
+        }
+        case ast_kind::IF_CLAUSE: {
+            const ast_if_clause &if_clause = pool.if_clauses[command.index];
+            for (ast_compound_list condition : pool.lists_of(if_clause.conditions))
+                collect_list(condition, effects);
+            for (ast_compound_list body : pool.lists_of(if_clause.bodies))
+                collect_list(body, effects);
+            collect_redirects(if_clause.redirections, effects);
+            break;
+        }
+        case ast_kind::WHILE_CLAUSE: {
+            const ast_while_clause &while_clause = pool.while_clauses[command.index];
+            collect_list(while_clause.condition, effects);
+            collect_list(while_clause.body, effects);
+            collect_redirects(while_clause.redirections, effects);
+            break;
+        }
+        default:
+            effects.pure = false;
+        }
     }
 
-    bool has_arg(int i)
+    // Whether a word always expands the same while none of its variables
+    // change. Only plain parameter expansions qualify, and the variables
+    // go into names. Unquoted expansions also depend on IFS.
+    bool is_lone_substitution(const string &word)
     {
-        if (i == 0)
-            return true;
-        if (args.size() == 0)
+        Reader r(word);
+
+        if (r.at("$(("))
+            return false;
+        else if (r.at("$("))
+            r.read_subshell(false);
+        else if (r.at('`'))
+            r.read_subshell_backquote(false);
+        else
             return false;
 
-        return i >= 1 && i - 1 < (int)args.back().size();
+        return r.eof();
     }
 
-    const string &get_arg(int i)
+    bool word_is_invariant(const string &word, bool quoted, std::set<string> &names)
     {
-        assert(has_arg(i));
+        static const char *const safe_ops[] = {"%%", "##", ":-", ":+", "%", "#", "-", "+"};
 
-        if (i == 0)
-            return arg0;
+        if (!quoted && word.size() && word[0] == '~')
+            return false;
+
+        Reader r(word);
+
+        while (!r.eof()) {
+            if (r.at('\\')) {
+                r.read_slash_quote(false);
+            }
+            else if (r.at('\'')) {
+                r.read_single_quote(false);
+            }
+            else if (r.at('"')) {
+                if (!word_is_invariant(r.read_double_quote(false), true, names))
+                    return false;
+            }
+            else if (r.at("$(") || r.at('`')) {
+                return false;
+            }
+            else if (r.at("${")) {
+                string param = r.read_param_expand_in_braces(false);
+                if (param.size() >= 2 && param[0] == '#') {
+                    param = param.substr(1);
+                    if (!is_name(param))
+                        return false;
+                    names.insert(param);
+                }
+                else {
+                    size_t length = param_name_length(param);
+                    string name = param.substr(0, length);
+                    string op = param.substr(length);
+                    if (!is_name(name))
+                        return false;
+
+                    if (op.size()) {
+                        const char *matched = nullptr;
+                        for (const char *safe_op : safe_ops) {
+                            if (op.compare(0, strlen(safe_op), safe_op) == 0) {
+                                matched = safe_op;
+                                break;
+                            }
+                        }
+                        if (!matched || !word_is_invariant(op.substr(strlen(matched)), true, names))
+                            return false;
+                    }
+                    names.insert(name);
+                }
+                if (!quoted)
+                    names.insert("IFS");
+            }
+            else if (r.at('$')) {
+                string name = r.read_param_expand(false);
+                if (name == "$")
+                    continue;
+                if (!is_name(name))
+                    return false;
+                names.insert(name);
+                if (!quoted)
+                    names.insert("IFS");
+            }
+            else {
+                r.pop();
+            }
+        }
 
-        return args.back()[i - 1];
+        return true;
     }
 
-    void set_arg0(const string &value)
+    void mark_invariant_words(ast_range words, const loop_effects &effects, bool &any)
     {
-        arg0 = value;
+        for (uint32_t i = words.begin; i < words.begin + words.count; i++) {
+            ast_index str = pool.words[i];
+            if (pool.string_info[str].literal)
+                continue;
+
+            std::set<string> names;
+            bool invariant = word_is_invariant(pool.str(str), false, names);
+            for (const string &name : names)
+                invariant = invariant && !effects.assigned.count(name);
+
+            if (invariant) {
+                pool.word_flags[i] |= WORD_INVARIANT;
+                any = true;
+            }
+        }
     }
 
-    void set_shell_pid(pid_t pid)
+    // Marks the words that expand_words expands for this loop: the
+    // arguments in its body, and the lists of the loops right inside it.
+    // Deeper words belong to the inner loops.
+    void mark_list(ast_compound_list list, const loop_effects &effects, bool &any)
     {
-        shell_pid = pid;
+        for (const ast_and_or &and_or : pool.and_ors_of(list))
+            for (const ast_pipeline &pipeline : pool.pipelines_of(and_or))
+                for (const ast_command &command : pool.commands_of(pipeline))
+                    mark_command(command, effects, any);
     }
 
-    void set_func(const string &name, const ast_function_definition &value)
+    void mark_command(const ast_command &command, const loop_effects &effects, bool &any)
     {
-        functions[name] = value;
+        switch (command.kind) {
+        case ast_kind::SIMPLE_COMMAND:
+            mark_invariant_words(pool.simple_commands[command.index].args, effects, any);
+            break;
+        case ast_kind::BRACE_GROUP:
+            mark_list(pool.brace_groups[command.index].commands, effects, any);
+            break;
+        case ast_kind::SUBSHELL:
+            mark_list(pool.subshells[command.index].commands, effects, any);
+            break;
+        case ast_kind::FOR_CLAUSE:
+            mark_invariant_words(pool.for_clauses[command.index].wordlist, effects, any);
+            break;
+        case ast_kind::CASE_CLAUSE:
+            for (const ast_case_item &item : pool.case_items_of(pool.case_clauses[command.index].items))
+                mark_list(item.body, effects, any);
+            break;
+        case ast_kind::IF_CLAUSE:
+            for (ast_compound_list condition : pool.lists_of(pool.if_clauses[command.index].conditions))
+                mark_list(condition, effects, any);
+            for (ast_compound_list body : pool.lists_of(pool.if_clauses[command.index].bodies))
+                mark_list(body, effects, any);
+            break;
+        default:
+            // While loops mark their own condition and body
+            break;
+        }
     }
 
-    bool has_func(const string &name)
+    void optimize_loop(ast_loop_info &info, const loop_effects &effects, ast_compound_list condition, ast_compound_list body)
     {
-        return functions.find(name) != functions.end();
+        if (!effects.pure)
+            return;
+
+        bool any = false;
+        mark_list(condition, effects, any);
+        mark_list(body, effects, any);
+        if (!any)
+            return;
+
+        info.invariants = true;
+        info.guard.begin = pool.guard_names.size();
+        info.guard.count = effects.command_names.size();
+        pool.guard_names.insert(pool.guard_names.end(), effects.command_names.begin(), effects.command_names.end());
     }
 
-    const ast_function_definition &get_func(const string &name)
+public:
+
+    ast_optimizer(ast_pool &pool) : pool{pool} { }
+
+    void run()
     {
-        return functions.at(name);
-    }
-};
+        pool.string_info.assign(pool.strings.size(), ast_string_info());
+        pool.literal_values.clear();
+        pool.constants.assign(pool.and_ors.size(), ast_constant());
+        pool.word_flags.assign(pool.words.size(), 0);
+        pool.for_loops.assign(pool.for_clauses.size(), ast_loop_info());
+        pool.while_loops.assign(pool.while_clauses.size(), ast_loop_info());
+        pool.guard_names.clear();
+
+        if (optimization_level < 1)
+            return;
+
+        for (size_t i = 0; i < pool.strings.size(); i++)
+            pool.string_info[i].literal = is_literal_word(pool.strings[i]);
+
+        for (const ast_simple_command &simple_command : pool.simple_commands) {
+            for (ast_index i : ast_pool::slice(pool.words, simple_command.assignments)) {
+                ast_string_info &info = pool.string_info[i];
+                const string &assignment = pool.str(i);
+                string value = assignment.substr(assignment.find('=') + 1);
+                // Tildes expand after a colon too
+                if (info.assigned_value == NO_INDEX && is_literal_word(value) && value.find('~') == string::npos)
+                    info.assigned_value = literal_value(value);
+            }
+        }
 
-ex_env xenv;
+        for (size_t i = 0; i < pool.and_ors.size(); i++)
+            fold_constant(i);
 
-// Expansion
+        // Loops with literal lists walk the shared values
+        for (size_t i = 0; i < pool.for_clauses.size(); i++) {
+            const ast_for_clause &for_clause = pool.for_clauses[i];
+            bool literal_words = true;
 
-string expand_tilde_prefix(const string &tilde_prefix)
-{
-    string expand_value;
+            for (ast_index word : ast_pool::slice(pool.words, for_clause.wordlist)) {
+                ast_string_info &info = pool.string_info[word];
+                literal_words = literal_words && info.literal;
+                if (info.literal && info.value == NO_INDEX)
+                    info.value = literal_value(pool.str(word));
+            }
+            pool.for_loops[i].literal_words = literal_words;
+            pool.for_loops[i].streams = optimization_level >= 2 && for_clause.wordlist.count == 1
+                && is_lone_substitution(pool.str(pool.words[for_clause.wordlist.begin]));
+        }
 
-    if (tilde_prefix.size() == 0) {
-        return getenv("HOME");
+        for (size_t i = 0; i < pool.for_clauses.size(); i++) {
+            const ast_for_clause &for_clause = pool.for_clauses[i];
+            loop_effects effects;
+            effects.assigned.insert(pool.str(for_clause.var_name));
+            collect_list(for_clause.body, effects);
+            optimize_loop(pool.for_loops[i], effects, {}, for_clause.body);
+        }
+
+        for (size_t i = 0; i < pool.while_clauses.size(); i++) {
+            const ast_while_clause &while_clause = pool.while_clauses[i];
+            loop_effects effects;
+            collect_list(while_clause.condition, effects);
+            collect_list(while_clause.body, effects);
+            optimize_loop(pool.while_loops[i], effects, while_clause.condition, while_clause.body);
+        }
     }
-    else {
-        passwd *pass = getpwnam(tilde_prefix.c_str());
+};
 
-        if (!pass)
-            return tilde_prefix;
-        
-        return pass->pw_dir;
+void optimize_program(ast_pool &pool)
+{
+    ast_optimizer(pool).run();
+}
+
+// Script cache
+//
+// Parsed scripts can be kept in a cache directory (POSIX_SHELL_CACHE_DIR),
+// so unchanged scripts skip lexing and parsing on later runs. Entries are
+// named after a hash of the script text, the shell version and the entry
+// format, so editing the script or changing the AST simply leads to a
+// different entry, while rebuilding the same source keeps them. The
+// hash only picks the file: the header holds the whole script text, which
+// must match byte for byte, so a collision can never run another script.
+// The body (the arrays of the ast_pool) ends with a checksum against
+// damage. Any mismatch or corrupt entry falls back to parsing (and
+// rewriting the entry).
+
+const char CACHE_MAGIC[4] = {'P', 'S', 'H', 'C'};
+// Bump whenever the AST structs change
+const uint32_t CACHE_FORMAT_VERSION = 6;
+// Builds that must not share entries with others of the same version can
+// be given their own tag, like -DCACHE_BUILD_TAG='"-debug"'
+#ifndef CACHE_BUILD_TAG
+#define CACHE_BUILD_TAG ""
+#endif
+const char *CACHE_BUILD_ID = SHELL_VERSION CACHE_BUILD_TAG;
+
+uint64_t fnv1a_hash(const char *data, size_t size, uint64_t hash = 0xcbf29ce484222325)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
     }
+    return hash;
 }
 
-int execute_in_subshell(const string &program);
+class cache_writer
+{
+public:
+    string data;
 
-string expand_command(const string &command)
-{   
-    int pipe_fd[2] = {-1, -1};
+    void put_u32(uint32_t value)
+    {
+        data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
 
-    if (pipe(pipe_fd) < 0)
-        panic("pipe failed");
+    void put_u64(uint64_t value)
+    {
+        data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
 
-    pid_t pid = fork();
+    void put_string(const string &str)
+    {
+        put_u32(str.size());
+        data.append(str);
+    }
+};
 
-    if (pid < 0)
-            panic("fork failed");
+class cache_reader
+{
+    const char *data;
+    size_t size;
+    size_t i = 0;
 
-    if (pid == 0) {
-        // Child process
-        dup2(pipe_fd[1], 1);
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        execute_in_subshell(command);
-        exit(0);
+    const char *take(size_t count)
+    {
+        if (count > size - i)
+            panic("corrupt script cache entry");
+        const char *p = data + i;
+        i += count;
+        return p;
     }
 
-    // Parent process
-    close(pipe_fd[1]);
-    string result = read_fd(pipe_fd[0]);
-    waitpid(pid, nullptr, 0);
-    return result;
-}
+public:
 
-string expand_word_no_split(const string &word);
+    cache_reader(const char *data, size_t size)
+        : data{data}, size{size} { }
 
-string expand_param(const string &param)
-{
-    if (param.size() == 0)
-        // Interpreted as regular $
-        return "$";
+    bool eof() { return i == size; }
 
-    if (param.size() >= 2) {
-        if (param[0] == '#') {
-            string var = param.substr(1);
-            string value = xenv.has_var(var) ? xenv.get_var(var) : "";
-            return std::to_string(value.size());
-        }
+    uint32_t get_u32()
+    {
+        uint32_t value;
+        memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
 
-        for (const char c : {'-', '=', '?', '+'}) {
-            for (const char *k : {":", ""}) {
-                string op = string{k} + c;
-                size_t i;
-                if ((i = param.find(op)) == string::npos)
-                    continue;
-                
-                string var = param.substr(0, i);
-                string word = param.substr(i + op.size());
-                bool empty = !xenv.has_var(var) || (k[0] == ':' && xenv.get_var(var) == "");
-
-                if (c == '-') {
-                    if (empty)
-                        return expand_word_no_split(word);
-                    else
-                        return xenv.get_var(var);
-                }
-                else if (c == '=') {
-                    if (empty)
-                        xenv.set_var(var, expand_word_no_split(word));
-                    return xenv.get_var(var);
-                }
-                else if (c == '?') {
-                    if (empty)
-                        panic(var + ": " + expand_word_no_split(word));
-                    return xenv.get_var(var);
-                }
-                else if (c == '+') {
-                    if (empty)
-                        return "";
-                    else
-                        return expand_word_no_split(word);
-                }
-                else {
-                    assert(0);
-                }
-            }
-        }
+    uint64_t get_u64()
+    {
+        uint64_t value;
+        memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
     }
 
-    // TODO: Implement suffix/prefix modification
+    string get_string()
+    {
+        uint32_t count = get_u32();
+        return string(take(count), count);
+    }
 
-    if (!xenv.has_var(param))
-        return "";
-    
-    return xenv.get_var(param);
-}
+    const char *get_raw(size_t count)
+    {
+        return take(count);
+    }
 
-// Field splitting
+    size_t remaining() { return size - i; }
+};
 
-void field_append(vector<string> &fields, char c)
+// The node arrays hold no pointers, so they are written as they are
+template<typename T>
+void cache_write(cache_writer &w, const vector<T> &values)
 {
-    if (fields.size())
-        fields.back().push_back(c);
-    else
-        fields.push_back(string{c});
+    static_assert(std::is_trivially_copyable<T>::value, "AST nodes must be plain data");
+    w.put_u32(values.size());
+    w.data.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
 }
 
-void field_append(vector<string> &fields, const string &str)
+void cache_write(cache_writer &w, const vector<string> &strings)
 {
-    if (fields.size())
-        fields.back().append(str);
-    else
-        fields.push_back(str);
+    w.put_u32(strings.size());
+    for (const string &str : strings)
+        w.put_string(str);
 }
 
-void field_split(vector<string> &fields, const string &str)
+template<typename T>
+void cache_read(cache_reader &r, vector<T> &values)
 {
-    const char *ifs = getenv("IFS");
+    uint32_t count = r.get_u32();
+    // get_raw checks the count against the bytes left before anything is
+    // allocated
+    const char *data = r.get_raw((size_t)count * sizeof(T));
+    values.resize(count);
+    if (count)
+        memcpy(values.data(), data, (size_t)count * sizeof(T));
+}
 
-    if (!ifs)
-        ifs = " \t\n";
-    
-    if (strlen(ifs) == 0) {
-        field_append(fields, str);
-        return;
-    }
+void cache_read(cache_reader &r, vector<string> &strings)
+{
+    uint32_t count = r.get_u32();
+    // Every string has at least its size
+    if (count > r.remaining() / sizeof(uint32_t))
+        panic("corrupt script cache entry");
+    strings.clear();
+    strings.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
+        strings.push_back(r.get_string());
+}
 
-    // IFS is separated into whitespace IFS (what we call soft IFS)
-    // and non-whitespace IFS (what we call hard IFS)
-    string soft_ifs;
-    string hard_ifs;
+// Calls f with every array of a pool, in file order
+template<typename P, typename F>
+void cache_visit_arrays(P &pool, F f)
+{
+    f(pool.strings);
+    f(pool.words);
+    f(pool.redirects);
+    f(pool.lists);
+    f(pool.case_items);
+    f(pool.commands);
+    f(pool.pipelines);
+    f(pool.and_ors);
+    f(pool.simple_commands);
+    f(pool.brace_groups);
+    f(pool.subshells);
+    f(pool.for_clauses);
+    f(pool.case_clauses);
+    f(pool.if_clauses);
+    f(pool.while_clauses);
+    f(pool.function_definitions);
+}
 
-    for (const char *c = ifs; *c; c++) {
-        if (isspace(*c))
-            soft_ifs.push_back(*c);
-        else
-            hard_ifs.push_back(*c);
-    }
+void cache_write(cache_writer &w, const ast_pool &pool)
+{
+    cache_visit_arrays(pool, [&](const auto &array) { cache_write(w, array); });
+    w.put_u32(pool.program.begin);
+    w.put_u32(pool.program.count);
+}
 
-    // Soft IFS spans are merged together into a single delimiter,
-    // and are ignored at the beginning and end of input.
-    // Hard IFS aren't merged together, and can delimit empty fields.
-    // Hard IFS are merged with the soft IFS around them.
-    // Hard IFS at the beginning of the input cause an empty field.
+void cache_check(bool ok)
+{
+    if (!ok)
+        panic("corrupt script cache entry");
+}
 
-    enum class Mode {
-        START,          // We didn't yet start the first field
-        FIELD,          // We are in the middle of the field
+template<typename T>
+void cache_check_range(ast_range range, const vector<T> &array)
+{
+    cache_check(range.begin <= array.size() && range.count <= array.size() - range.begin);
+}
+
+// Every index has to stay inside its array, so an entry that got past the
+// checksum still can't make the executor read out of bounds
+void cache_validate(const ast_pool &pool)
+{
+    size_t strings = pool.strings.size();
+
+    for (ast_index word : pool.words)
+        cache_check(word < strings);
+    for (const ast_redirect &redirect : pool.redirects)
+        cache_check(redirect.lhs < strings && redirect.op < strings && redirect.rhs < strings);
+    for (const ast_compound_list &list : pool.lists)
+        cache_check_range(list, pool.and_ors);
+    for (const ast_case_item &item : pool.case_items) {
+        cache_check_range(item.patterns, pool.words);
+        cache_check_range(item.body, pool.and_ors);
+    }
+    for (const ast_command &command : pool.commands) {
+        switch (command.kind) {
+        case ast_kind::SIMPLE_COMMAND: cache_check(command.index < pool.simple_commands.size()); break;
+        case ast_kind::BRACE_GROUP: cache_check(command.index < pool.brace_groups.size()); break;
+        case ast_kind::SUBSHELL: cache_check(command.index < pool.subshells.size()); break;
+        case ast_kind::FOR_CLAUSE: cache_check(command.index < pool.for_clauses.size()); break;
+        case ast_kind::CASE_CLAUSE: cache_check(command.index < pool.case_clauses.size()); break;
+        case ast_kind::IF_CLAUSE: cache_check(command.index < pool.if_clauses.size()); break;
+        case ast_kind::WHILE_CLAUSE: cache_check(command.index < pool.while_clauses.size()); break;
+        case ast_kind::FUNCTION_DEFINITION: cache_check(command.index < pool.function_definitions.size()); break;
+        default: cache_check(false);
+        }
+    }
+    for (const ast_pipeline &pipeline : pool.pipelines)
+        cache_check_range(pipeline.commands, pool.commands);
+    for (const ast_and_or &and_or : pool.and_ors)
+        cache_check_range(and_or.pipelines, pool.pipelines);
+    for (const ast_simple_command &simple_command : pool.simple_commands) {
+        cache_check_range(simple_command.assignments, pool.words);
+        cache_check_range(simple_command.args, pool.words);
+        cache_check_range(simple_command.redirections, pool.redirects);
+    }
+    for (const ast_brace_group &brace_group : pool.brace_groups) {
+        cache_check_range(brace_group.commands, pool.and_ors);
+        cache_check_range(brace_group.redirections, pool.redirects);
+    }
+    for (const ast_subshell &subshell : pool.subshells) {
+        cache_check_range(subshell.commands, pool.and_ors);
+        cache_check_range(subshell.redirections, pool.redirects);
+    }
+    for (const ast_for_clause &for_clause : pool.for_clauses) {
+        cache_check(for_clause.var_name < strings);
+        cache_check_range(for_clause.wordlist, pool.words);
+        cache_check_range(for_clause.body, pool.and_ors);
+        cache_check_range(for_clause.redirections, pool.redirects);
+    }
+    for (const ast_case_clause &case_clause : pool.case_clauses) {
+        cache_check(case_clause.value < strings);
+        cache_check_range(case_clause.items, pool.case_items);
+        cache_check_range(case_clause.redirections, pool.redirects);
+    }
+    for (const ast_if_clause &if_clause : pool.if_clauses) {
+        cache_check_range(if_clause.conditions, pool.lists);
+        cache_check_range(if_clause.bodies, pool.lists);
+        cache_check(if_clause.bodies.count - if_clause.conditions.count <= 1);
+        cache_check_range(if_clause.redirections, pool.redirects);
+    }
+    for (const ast_while_clause &while_clause : pool.while_clauses) {
+        cache_check_range(while_clause.condition, pool.and_ors);
+        cache_check_range(while_clause.body, pool.and_ors);
+        cache_check_range(while_clause.redirections, pool.redirects);
+    }
+    for (const ast_function_definition &function_definition : pool.function_definitions) {
+        cache_check(function_definition.name < strings);
+        if (function_definition.body == NO_INDEX)
+            cache_check(function_definition.lazy_source < strings);
+        else
+            cache_check(function_definition.body < pool.brace_groups.size());
+    }
+    cache_check_range(pool.program, pool.and_ors);
+}
+
+void cache_read(cache_reader &r, ast_pool &pool)
+{
+    cache_visit_arrays(pool, [&](auto &array) { cache_read(r, array); });
+    pool.program.begin = r.get_u32();
+    pool.program.count = r.get_u32();
+    cache_validate(pool);
+}
+
+// Writes the cache header for a script, also used to validate entries
+void cache_write_header(cache_writer &w, const string &source, uint64_t hash)
+{
+    w.data.append(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    w.put_u32(CACHE_FORMAT_VERSION);
+    w.put_string(CACHE_BUILD_ID);
+    w.put_u64(hash);
+    w.put_u64(source.size());
+    w.data.append(source);
+}
+
+bool cache_load(const string &path, const string &expected_header, shared_program &program)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)(expected_header.size() + sizeof(uint64_t))) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    bool loaded = false;
+
+    // The body ends with its checksum
+    const char *body = static_cast<const char *>(data) + expected_header.size();
+    size_t body_size = st.st_size - expected_header.size() - sizeof(uint64_t);
+    uint64_t checksum;
+    memcpy(&checksum, body + body_size, sizeof(checksum));
+
+    if (memcmp(data, expected_header.data(), expected_header.size()) == 0 && checksum == fnv1a_hash(body, body_size)) {
+        cache_reader r(body, body_size);
+
+        try {
+            auto pool = std::make_shared<ast_pool>();
+            cache_read(r, *pool);
+            loaded = r.eof();
+            if (loaded) {
+                optimize_program(*pool);
+                program = pool;
+            }
+        }
+        catch (const shell_exception &) {
+            loaded = false;
+        }
+    }
+
+    munmap(data, st.st_size);
+    return loaded;
+}
+
+void cache_store(const string &path, const cache_writer &w)
+{
+    // Write to a temporary file first, so readers never see a partial entry
+    string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    bool written = write_full(fd, w.data.data(), w.data.size());
+    close(fd);
+
+    if (!written || rename(tmp_path.c_str(), path.c_str()) < 0)
+        unlink(tmp_path.c_str());
+}
+
+shared_program parse_script(const string &source)
+{
+    shared_program program;
+    const char *cache_dir = getenv("POSIX_SHELL_CACHE_DIR");
+
+    if (!cache_dir || !*cache_dir) {
+        TokenReader r = TokenReader(Reader(source));
+        return parse_program(r);
+    }
+
+    uint64_t build_hash = fnv1a_hash(reinterpret_cast<const char *>(&CACHE_FORMAT_VERSION), sizeof(CACHE_FORMAT_VERSION),
+        fnv1a_hash(CACHE_BUILD_ID, strlen(CACHE_BUILD_ID)));
+    uint64_t hash = fnv1a_hash(source.data(), source.size(), build_hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.psc", (unsigned long long)hash);
+    string path = cache_dir + string(name);
+
+    cache_writer w;
+    cache_write_header(w, source, hash);
+
+    if (cache_load(path, w.data, program))
+        return program;
+
+    TokenReader r = TokenReader(Reader(source));
+    program = parse_program(r);
+
+    size_t header_size = w.data.size();
+    cache_write(w, *program);
+    w.put_u64(fnv1a_hash(w.data.data() + header_size, w.data.size() - header_size));
+    cache_store(path, w);
+
+    return program;
+}
+
+// Shell Execution environment
+
+// Variable values are immutable once set, and shared between the
+// variables, environment copies and expansions that hold them, so
+// passing a large value around doesn't copy it.
+typedef std::shared_ptr<const string> shared_value;
+
+const shared_value EMPTY_VALUE = std::make_shared<const string>();
+
+shared_value make_value(string value)
+{
+    return std::make_shared<string>(std::move(value));
+}
+
+// Parses text that is exactly what std::to_string would make of a number,
+// the only text whose integer means the same to arithmetic and to test
+bool parse_decimal(const string &str, long long &number)
+{
+    size_t digits = str.size() && str[0] == '-' ? 1 : 0;
+
+    if (str.size() == digits || str.size() - digits > 19 || !is_digits(str.substr(digits)))
+        return false;
+    if (str[digits] == '0' && str.size() != 1)
+        return false;
+
+    errno = 0;
+    number = strtoll(str.c_str(), nullptr, 10);
+    return errno == 0;
+}
+
+// Arithmetic results are stored as integers, and only turned into text
+// when something expands them, so a counter doesn't go through the text
+// on every i=$((i+1)). Text that is a plain decimal number gets its
+// integer cached when arithmetic or test first reads it. Both are the
+// same value, so filling them in is fine even in a shared map.
+struct var
+{
+    // Null while only the integer is known
+    mutable shared_value value = EMPTY_VALUE;
+    mutable long long number = 0;
+    mutable bool has_number = false;
+    bool exported = false;
+
+    const shared_value &text() const
+    {
+        if (!value)
+            value = make_value(std::to_string(number));
+        return value;
+    }
+};
+
+// Positional parameters are a window into an argument list that is never
+// modified, so shift only moves the offset, and a function called with
+// "$@" shares the caller's list.
+struct positional_params
+{
+    std::shared_ptr<const vector<string>> storage = std::make_shared<const vector<string>>();
+    size_t offset = 0;
+
+    positional_params() = default;
+
+    positional_params(vector<string> args)
+        : storage{std::make_shared<const vector<string>>(std::move(args))} { }
+
+    size_t size() const
+    {
+        return storage->size() - offset;
+    }
+
+    const string &operator[](size_t i) const
+    {
+        return (*storage)[offset + i];
+    }
+};
+
+// A break, continue or return on its way to the loop or function call it
+// is meant for. It is a plain value that the executors check after every
+// command, so leaving a loop costs no more than finishing it.
+struct control_flow
+{
+    enum { NONE, BREAK, CONTINUE, FUNCTION_RETURN } kind = NONE;
+    // Loops left to unwind for break n and continue n
+    int levels = 0;
+};
+
+// Copying the environment is O(1): variables and functions are shared
+// with the copy until either side changes them, so subshells that don't
+// fork can snapshot the environment and put it back afterwards.
+class ex_env
+{
+    std::shared_ptr<map<string, var>> vars = std::make_shared<map<string, var>>();
+    std::shared_ptr<map<string, std::shared_ptr<const shell_function>>> functions
+        = std::make_shared<map<string, std::shared_ptr<const shell_function>>>();
+    string arg0;
+    pid_t shell_pid;
+    vector<positional_params> args;
+    // Holds the special parameters that get_var computes
+    string special_value;
+    int last_status = 0;
+
+    template<typename T>
+    static T &for_write(std::shared_ptr<T> &shared)
+    {
+        if (shared.use_count() > 1)
+            shared = std::make_shared<T>(*shared);
+        return *shared;
+    }
+
+public:
+
+    bool has_var(const string &name)
+    {
+        if (name.size() && is_digits(name)) {
+            return has_arg(str_to_int(name.c_str()));
+        }
+
+        if (name.size() == 1 && is_special_param(name[0]))
+            return true;
+
+        return vars->find(name) != vars->end();
+    }
+
+    // The reference is valid until the variable changes
+    const string &get_var(const string &name)
+    {
+        if (name.size() == 1 && is_special_param(name[0])) {
+            char c = name[0];
+            if (c == '#') {
+                special_value = std::to_string(params().size());
+                return special_value;
+            }
+            else if (c == '?') {
+                special_value = std::to_string(last_status);
+                return special_value;
+            }
+            else if (c == '@' || c == '*') {
+                // Only without field splitting, expand_word handles the rest
+                special_value = join_params(" ");
+                return special_value;
+            }
+            else if (c == '0') {
+                return arg0;
+            }
+            else if (c == '$') {
+                special_value = std::to_string(shell_pid);
+                return special_value;
+            }
+            else {
+                error_message("warning: special param not implemented");
+                special_value.clear();
+                return special_value;
+            }
+        }
+
+        if (name.size() && is_digits(name)) {
+            return get_arg(str_to_int(name.c_str()));
+        }
+
+        return *vars->at(name).text();
+    }
+
+    // Like get_var, but shares the value of regular variables
+    shared_value get_shared_var(const string &name)
+    {
+        auto it = vars->find(name);
+        if (it != vars->end() && !(name.size() == 1 && is_special_param(name[0])))
+            return it->second.text();
+
+        return make_value(get_var(name));
+    }
+
+    void set_var(const string &name, string value)
+    {
+        set_var(name, make_value(std::move(value)));
+    }
+
+    void set_var(const string &name, const shared_value &value)
+    {
+        var &entry = for_write(vars)[name];
+        entry.value = value;
+        entry.has_number = false;
+    }
+
+    void set_var_number(const string &name, long long number)
+    {
+        var &entry = for_write(vars)[name];
+        entry.value = nullptr;
+        entry.number = number;
+        entry.has_number = true;
+    }
+
+    // False when the variable is unset or its text isn't a plain decimal
+    // number (see parse_decimal)
+    bool get_var_number(const string &name, long long &number)
+    {
+        auto it = vars->find(name);
+        if (it == vars->end())
+            return false;
+
+        const var &entry = it->second;
+        if (!entry.has_number && !parse_decimal(*entry.value, entry.number))
+            return false;
+
+        entry.has_number = true;
+        number = entry.number;
+        return true;
+    }
+
+    // Appends in place when nobody else shares the value. The string
+    // grows geometrically, so repeated appends stay linear overall.
+    void append_var(const string &name, const string &tail)
+    {
+        var &entry = for_write(vars)[name];
+
+        entry.text();
+        entry.has_number = false;
+        if (entry.value.use_count() == 1)
+            // Fine, make_value never creates const strings
+            const_cast<string &>(*entry.value).append(tail);
+        else
+            entry.value = make_value(*entry.value + tail);
+    }
+
+    const var &get_var_entry(const string &name)
+    {
+        return vars->at(name);
+    }
+
+    void set_var_entry(const string &name, const var &entry)
+    {
+        for_write(vars)[name] = entry;
+    }
+
+    void unset_var(const string &name)
+    {
+        for_write(vars).erase(name);
+    }
+
+    void mark_export(const string &name)
+    {
+        for_write(vars)[name].exported = true;
+    }
+
+    // Calls f(name, value) for every variable, sorted by name
+    template<typename F>
+    void each_var(F f)
+    {
+        for (const auto &entry : *vars)
+            f(entry.first, *entry.second.text());
+    }
+
+    // The environment handed to executed commands
+    vector<string> environment()
+    {
+        vector<string> result;
+        for (const auto &entry : *vars)
+            if (entry.second.exported)
+                result.push_back(entry.first + "=" + *entry.second.text());
+        return result;
+    }
+
+    void init_from_environ()
+    {
+        for (char **s = environ; *s; s++) {
+            char *equals = strchr(*s, '=');
+            if (!equals)
+                continue;
+            
+            string name = string(*s, equals - *s);
+            const char *value = equals + 1;
+
+            set_var(name, value);
+            mark_export(name);
+        }
+    }
+
+    void push_args(vector<string> args)
+    {
+        this->args.push_back(positional_params(std::move(args)));
+    }
+
+    void push_args(const positional_params &params)
+    {
+        this->args.push_back(params);
+    }
+
+    void pop_args()
+    {
+        if (this->args.size() == 0)
+            assert(0);
+        
+        this->args.pop_back();
+    }
+
+    const positional_params &params()
+    {
+        static const positional_params no_params;
+        return args.size() ? args.back() : no_params;
+    }
+
+    // For set --
+    void set_params(vector<string> values)
+    {
+        if (args.size())
+            args.back() = positional_params(std::move(values));
+        else
+            push_args(std::move(values));
+    }
+
+    bool shift_params(size_t count)
+    {
+        if (count > params().size())
+            return false;
+
+        if (count)
+            args.back().offset += count;
+        return true;
+    }
+
+    string join_params(const string &separator)
+    {
+        const positional_params &p = params();
+        string result;
+
+        for (size_t i = 0; i < p.size(); i++) {
+            if (i > 0)
+                result += separator;
+            result += p[i];
+        }
+
+        return result;
+    }
+
+    bool has_arg(int i)
+    {
+        if (i == 0)
+            return true;
+
+        return i >= 1 && i - 1 < (int)params().size();
+    }
+
+    const string &get_arg(int i)
+    {
+        assert(has_arg(i));
+
+        if (i == 0)
+            return arg0;
+
+        return params()[i - 1];
+    }
+
+    void set_arg0(const string &value)
+    {
+        arg0 = value;
+    }
+
+    void set_shell_pid(pid_t pid)
+    {
+        shell_pid = pid;
+    }
+
+    void set_last_status(int status)
+    {
+        last_status = status;
+    }
+
+    int get_last_status()
+    {
+        return last_status;
+    }
+
+    void set_func(const string &name, const shell_function &value)
+    {
+        for_write(functions)[name] = std::make_shared<const shell_function>(value);
+    }
+
+    bool has_func(const string &name)
+    {
+        return functions->find(name) != functions->end();
+    }
+
+    // Shared, so a function that redefines itself keeps running
+    std::shared_ptr<const shell_function> get_func(const string &name)
+    {
+        return functions->at(name);
+    }
+
+    // Loops and function calls around the running command. A function
+    // body or subshell starts without loops, like in bash.
+    int loop_depth = 0;
+    int function_depth = 0;
+    // Files being sourced with ., return leaves them too
+    int source_depth = 0;
+    control_flow pending;
+};
+
+ex_env xenv;
+
+// New positional parameters for a function call or a . with arguments.
+// They are popped again when the scope ends, also by an exception.
+class params_scope
+{
+    bool pushed = false;
+
+public:
+
+    template<typename T>
+    void push(T &&args)
+    {
+        xenv.push_args(std::forward<T>(args));
+        pushed = true;
+    }
+
+    ~params_scope()
+    {
+        if (pushed)
+            xenv.pop_args();
+    }
+};
+
+struct source_scope
+{
+    source_scope() { xenv.source_depth++; }
+    ~source_scope() { xenv.source_depth--; }
+};
+
+// Inline pipeline I/O
+//
+// Pipelines made only of builtins and functions run as coroutines inside
+// the shell process (see execute_inline_pipeline). Their stages talk through
+// in-memory ring buffers that stand in for fds 0 and 1, and builtins do
+// their I/O through shell_read and shell_write so they end up there.
+
+const size_t RING_CAPACITY = 1 << 16;
+
+struct ring_pipe
+{
+    vector<char> buff = vector<char>(RING_CAPACITY);
+    size_t start = 0;
+    size_t count = 0;
+    bool writer_closed = false;
+    bool reader_closed = false;
+};
+
+// Thrown in a stage that writes to a ring nobody reads anymore,
+// where a forked stage would get SIGPIPE
+struct ring_broken_pipe { };
+
+// The rings of the running stage, nullptr outside of inline pipelines
+ring_pipe *virtual_stdin = nullptr;
+ring_pipe *virtual_stdout = nullptr;
+
+// Collects fd 1 of a command substitution that runs in the shell process
+string *captured_stdout = nullptr;
+
+ucontext_t inline_scheduler_context;
+ucontext_t *inline_stage_context = nullptr;
+
+// Bumped whenever a stage moves data through a ring or finishes, so the
+// scheduler sees a round that left every stage where it was
+unsigned long inline_progress = 0;
+
+// Fds the running stage waits for besides its rings (see process_bridge)
+vector<pollfd> *inline_wait_fds = nullptr;
+
+// Lets the other stages run until the ring we wait for changed
+void inline_yield()
+{
+    swapcontext(inline_stage_context, &inline_scheduler_context);
+}
+
+bool is_virtual_fd(int fd)
+{
+    return (fd == 0 && virtual_stdin) || (fd == 1 && (virtual_stdout || captured_stdout));
+}
+
+void ring_write(ring_pipe &ring, const char *data, size_t size)
+{
+    while (size > 0) {
+        if (ring.reader_closed)
+            throw ring_broken_pipe{};
+
+        if (ring.count == ring.buff.size()) {
+            inline_yield();
+            continue;
+        }
+
+        size_t end = (ring.start + ring.count) % ring.buff.size();
+        size_t chunk = std::min(size, std::min(ring.buff.size() - ring.count, ring.buff.size() - end));
+        memcpy(&ring.buff[end], data, chunk);
+        ring.count += chunk;
+        inline_progress++;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+// Blocks until there is data, returns 0 on EOF
+size_t ring_read(ring_pipe &ring, char *data, size_t size)
+{
+    while (ring.count == 0) {
+        if (ring.writer_closed)
+            return 0;
+        inline_yield();
+    }
+
+    size_t chunk = std::min(size, std::min(ring.count, ring.buff.size() - ring.start));
+    memcpy(data, &ring.buff[ring.start], chunk);
+    ring.start = (ring.start + chunk) % ring.buff.size();
+    ring.count -= chunk;
+    inline_progress++;
+    return chunk;
+}
+
+bool ring_read_line(ring_pipe &ring, string &line)
+{
+    while (true) {
+        while (ring.count == 0) {
+            if (ring.writer_closed)
+                return false;
+            inline_yield();
+        }
+
+        const char *start = &ring.buff[ring.start];
+        size_t available = std::min(ring.count, ring.buff.size() - ring.start);
+        const char *newline = static_cast<const char *>(memchr(start, '\n', available));
+        size_t used = newline ? newline - start + 1 : available;
+
+        line.append(start, newline ? used - 1 : used);
+        ring.start = (ring.start + used) % ring.buff.size();
+        ring.count -= used;
+        inline_progress++;
+
+        if (newline)
+            return true;
+    }
+}
+
+// Input buffering
+//
+// The read builtin reads ahead in large blocks instead of a byte at a time.
+// Data that was read ahead but not consumed must not be lost to other
+// readers of the same file description:
+// - Regular files are synced by seeking back over the unconsumed data
+//   before anything else could look at the file offset (forks, redirections,
+//   builtins reading the fd directly, and exit).
+// - Pipes can't be rewound, so they are only buffered when the shell owns
+//   them, that is when no other process will read from them.
+
+const size_t INPUT_BLOCK_SIZE = 1 << 16;
+
+struct input_buffer
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    bool seekable;
+    // Kernel file offset at the end of the buffered data
+    off_t offset;
+    // Value of input_fd_generation when the fd was last validated
+    unsigned generation;
+    string data;
+    size_t pos;
+};
+
+vector<input_buffer> input_buffers;
+
+// Bumped when redirections replace file descriptors
+unsigned input_fd_generation = 0;
+
+bool input_has_owned_pipe = false;
+dev_t input_owned_pipe_dev;
+ino_t input_owned_pipe_ino;
+
+void input_sync(input_buffer &b)
+{
+    if (b.seekable && b.pos < b.data.size())
+        lseek(b.fd, b.offset - (off_t)(b.data.size() - b.pos), SEEK_SET);
+}
+
+// Gives back all read-ahead of regular files
+void input_sync_all()
+{
+    vector<input_buffer> kept;
+
+    for (input_buffer &b : input_buffers) {
+        if (b.seekable)
+            input_sync(b);
+        else
+            kept.push_back(std::move(b));
+    }
+
+    input_buffers = std::move(kept);
+}
+
+// Called before fd is replaced or closed
+void input_release(int fd)
+{
+    input_fd_generation++;
+
+    for (size_t i = 0; i < input_buffers.size(); i++) {
+        if (input_buffers[i].fd == fd && input_buffers[i].seekable) {
+            input_sync(input_buffers[i]);
+            input_buffers.erase(input_buffers.begin() + i);
+            return;
+        }
+    }
+    // Pipe buffers are kept, and found again by identity if the pipe returns
+}
+
+// Marks the pipe on fd as read by this process only
+void input_own(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        input_has_owned_pipe = true;
+        input_owned_pipe_dev = st.st_dev;
+        input_owned_pipe_ino = st.st_ino;
+    }
+}
+
+// Returns the buffer to use for fd, or nullptr to read byte by byte
+input_buffer *input_lookup(int fd)
+{
+    for (input_buffer &b : input_buffers)
+        if (b.fd == fd && b.generation == input_fd_generation)
+            return &b;
+
+    // Redirections happened since, so check what fd refers to now
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return nullptr;
+
+    for (size_t i = 0; i < input_buffers.size(); i++) {
+        input_buffer &b = input_buffers[i];
+
+        if (b.seekable && b.fd == fd) {
+            if (b.dev == st.st_dev && b.ino == st.st_ino && lseek(fd, 0, SEEK_CUR) == b.offset) {
+                b.generation = input_fd_generation;
+                return &b;
+            }
+            input_buffers.erase(input_buffers.begin() + i);
+            break;
+        }
+
+        if (!b.seekable && b.dev == st.st_dev && b.ino == st.st_ino) {
+            b.fd = fd;
+            b.generation = input_fd_generation;
+            return &b;
+        }
+    }
+
+    bool seekable = S_ISREG(st.st_mode);
+    bool owned = S_ISFIFO(st.st_mode) && input_has_owned_pipe
+        && st.st_dev == input_owned_pipe_dev && st.st_ino == input_owned_pipe_ino;
+
+    if (!seekable && !owned)
+        return nullptr;
+
+    off_t offset = seekable ? lseek(fd, 0, SEEK_CUR) : 0;
+    if (offset < 0)
+        return nullptr;
+
+    input_buffers.push_back({fd, st.st_dev, st.st_ino, seekable, offset, input_fd_generation, string{}, 0});
+    return &input_buffers.back();
+}
+
+// Hands out the unconsumed read-ahead of fd, for builtins that read the fd
+// directly. Regular files are rewound instead.
+string input_unread(int fd)
+{
+    string pending;
+    input_buffer *b = input_lookup(fd);
+
+    if (!b)
+        return pending;
+
+    input_sync(*b);
+    if (!b->seekable)
+        pending = b->data.substr(b->pos);
+
+    input_buffers.erase(input_buffers.begin() + (b - &input_buffers[0]));
+    return pending;
+}
+
+// Whether fd has read-ahead of a pipe, which no other process could see
+bool input_has_unread_pipe_data(int fd)
+{
+    input_buffer *b = input_lookup(fd);
+    return b && !b->seekable && b->pos < b->data.size();
+}
+
+// Puts data back in front of the read-ahead of an owned pipe
+void input_push_back(int fd, const string &data)
+{
+    input_buffer *b = input_lookup(fd);
+    if (!b || b->seekable)
+        return;
+
+    b->data = data + b->data.substr(b->pos);
+    b->pos = 0;
+}
+
+// Appends a line to line without its newline.
+// Returns false if EOF came before a newline.
+bool input_read_line(int fd, string &line)
+{
+    if (fd == 0 && virtual_stdin)
+        return ring_read_line(*virtual_stdin, line);
+
+    input_buffer *b = input_lookup(fd);
+
+    output_flush();
+
+    if (!b) {
+        char c;
+        while (true) {
+            ssize_t res = read(fd, &c, 1);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                return false;
+            if (c == '\n')
+                return true;
+            line.push_back(c);
+        }
+    }
+
+    while (true) {
+        const char *start = b->data.data() + b->pos;
+        size_t available = b->data.size() - b->pos;
+        const char *newline = static_cast<const char *>(memchr(start, '\n', available));
+
+        if (newline) {
+            line.append(start, newline - start);
+            b->pos += newline - start + 1;
+            return true;
+        }
+
+        line.append(start, available);
+        b->data.resize(INPUT_BLOCK_SIZE);
+        b->pos = 0;
+
+        ssize_t res;
+        do {
+            res = read(fd, &b->data[0], b->data.size());
+        } while (res < 0 && errno == EINTR);
+
+        if (res <= 0) {
+            input_buffers.erase(input_buffers.begin() + (b - &input_buffers[0]));
+            return false;
+        }
+
+        b->data.resize(res);
+        b->offset += res;
+    }
+}
+
+// Accounting
+//
+// Counts what a script costs in processes, pipes and waits, for --stats
+// and the stats builtin. With accounting enabled the counters live in a
+// shared mapping, so forked subshells and pipeline stages add to them too.
+
+struct shell_counters
+{
+    std::atomic<uint64_t> forks{0};
+    std::atomic<uint64_t> execs{0};
+    // PATH directories that didn't have the command
+    std::atomic<uint64_t> path_misses{0};
+    std::atomic<uint64_t> pipes{0};
+    std::atomic<uint64_t> opens{0};
+    std::atomic<uint64_t> waits{0};
+    std::atomic<uint64_t> substitution_bytes{0};
+    // Lookups of eval and . sources in the parse cache
+    std::atomic<uint64_t> parse_cache_hits{0};
+    std::atomic<uint64_t> parse_cache_misses{0};
+    std::atomic<uint64_t> wait_ns{0};
+    // CPU time of the children, from their rusage
+    std::atomic<uint64_t> child_user_ns{0};
+    std::atomic<uint64_t> child_system_ns{0};
+};
+
+shell_counters local_counters;
+shell_counters *counters = &local_counters;
+
+// Where the summary goes on exit, -1 when accounting is off
+int stats_fd = -1;
+pid_t stats_pid = 0;
+
+string format_seconds(uint64_t ns)
+{
+    char seconds[32];
+    snprintf(seconds, sizeof(seconds), "%.6f", ns / 1e9);
+    return seconds;
+}
+
+string format_counters()
+{
+    return "forks " + std::to_string(counters->forks) + "\n"
+        + "execs " + std::to_string(counters->execs) + "\n"
+        + "path_misses " + std::to_string(counters->path_misses) + "\n"
+        + "pipes " + std::to_string(counters->pipes) + "\n"
+        + "opens " + std::to_string(counters->opens) + "\n"
+        + "waits " + std::to_string(counters->waits) + "\n"
+        + "substitution_bytes " + std::to_string(counters->substitution_bytes) + "\n"
+        + "parse_cache_hits " + std::to_string(counters->parse_cache_hits) + "\n"
+        + "parse_cache_misses " + std::to_string(counters->parse_cache_misses) + "\n"
+        + "wait_seconds " + format_seconds(counters->wait_ns) + "\n"
+        + "child_user_seconds " + format_seconds(counters->child_user_ns) + "\n"
+        + "child_system_seconds " + format_seconds(counters->child_system_ns) + "\n"
+#ifdef MEMORY_PROFILE
+        // Unlike the counters above, only the shell process itself
+        + format_memory_usage()
+#endif
+        ;
+}
+
+void stats_at_exit()
+{
+    // Forked children exit through here too
+    if (getpid() != stats_pid)
+        return;
+
+    output_flush();
+
+    string summary = format_counters();
+    if (write(stats_fd, summary.data(), summary.size()) < 0)
+        return;
+}
+
+void stats_enable(int fd)
+{
+    void *shared = mmap(nullptr, sizeof(shell_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        panic("mmap failed");
+
+    counters = new (shared) shell_counters();
+    stats_fd = fd;
+    stats_pid = getpid();
+    atexit(stats_at_exit);
+}
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Internal file descriptors
+//
+// The fds the shell keeps for itself live at 10 and above with FD_CLOEXEC,
+// so children never inherit them and fds 0-9 stay free for scripts. Scripts
+// may use fds above 9 too, so the long-lived ones are registered with the
+// variable that holds them, and a redirection to one of their numbers moves
+// them out of the way (see internal_fd_evict).
+
+const int INTERNAL_FD_BASE = 10;
+
+std::unordered_map<int, int *> internal_fds;
+
+// Moves fd above the fds scripts use
+int move_fd_high(int fd)
+{
+    if (fd < 0)
+        return fd;
+
+    int high_fd = fcntl(fd, F_DUPFD_CLOEXEC, INTERNAL_FD_BASE);
+    close(fd);
+    return high_fd;
+}
+
+void internal_fd_register(int *holder)
+{
+    if (*holder >= 0)
+        internal_fds[*holder] = holder;
+}
+
+void internal_fd_unregister(int *holder)
+{
+    auto it = internal_fds.find(*holder);
+    if (it != internal_fds.end() && it->second == holder)
+        internal_fds.erase(it);
+}
+
+void internal_fd_close(int *holder)
+{
+    if (*holder < 0)
+        return;
+
+    internal_fd_unregister(holder);
+    close(*holder);
+    *holder = -1;
+}
+
+// Child processes
+//
+// All children are reaped by one event loop, so the shell hears about
+// whichever child finishes first, and command substitution reads the
+// output of its child in the same loop. Every child gets a pidfd in an
+// epoll set. Without pidfds (before Linux 5.3, or with
+// POSIX_SHELL_SIGCHLD_WAIT) a SIGCHLD handler writing to a self-pipe
+// wakes the loop instead. Exit statuses are kept until they are collected.
+
+struct child_process
+{
+    int pidfd = -1;
+    bool done = false;
+    int wstatus = 0;
+};
+
+int child_sigchld_pipe[2] = {-1, -1};
+
+void child_sigchld_handler(int)
+{
+    int saved_errno = errno;
+    char c = 0;
+    // If the pipe is full a wakeup is pending anyway
+    if (child_sigchld_pipe[1] >= 0) {
+        ssize_t res = write(child_sigchld_pipe[1], &c, 1);
+        (void)res;
+    }
+    errno = saved_errno;
+}
+
+class child_reaper
+{
+    std::unordered_map<pid_t, child_process> children;
+    int epoll_fd = -1;
+    bool probed = false;
+    bool use_pidfd = true;
+
+    // epoll data of the fds that aren't pidfds, pidfds carry their pid
+    static const uint64_t OUTPUT_EVENT = UINT64_MAX;
+    static const uint64_t SIGCHLD_EVENT = UINT64_MAX - 1;
+
+    void watch(int fd, uint64_t data)
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = data;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            panic("epoll_ctl failed");
+    }
+
+    void collect(pid_t pid, child_process &child, int wstatus, const rusage &usage)
+    {
+        child.done = true;
+        child.wstatus = wstatus;
+
+        if (child.pidfd >= 0) {
+            // Closing removes it from the epoll set
+            close(child.pidfd);
+            child.pidfd = -1;
+        }
+
+        counters->waits++;
+
+        // The rusage of a child includes the children it waited for, so
+        // with shared counters only the shell itself adds it
+        if (counters == &local_counters || getpid() == stats_pid) {
+            counters->child_user_ns += usage.ru_utime.tv_sec * 1000000000ull + usage.ru_utime.tv_usec * 1000ull;
+            counters->child_system_ns += usage.ru_stime.tv_sec * 1000000000ull + usage.ru_stime.tv_usec * 1000ull;
+        }
+    }
+
+    void reap(pid_t pid, child_process &child)
+    {
+        int wstatus = 0;
+        rusage usage{};
+        pid_t res = wait4(pid, &wstatus, WNOHANG, &usage);
+
+        // Somebody else reaped it, e.g. with SIGCHLD ignored
+        if (res < 0 && errno == ECHILD)
+            res = pid;
+
+        if (res == pid)
+            collect(pid, child, wstatus, usage);
+    }
+
+    // Reaps whatever finished, for the SIGCHLD fallback
+    void reap_any()
+    {
+        int wstatus;
+        rusage usage;
+        pid_t pid;
+
+        while ((pid = wait4(-1, &wstatus, WNOHANG, &usage)) > 0) {
+            auto it = children.find(pid);
+            if (it != children.end())
+                collect(pid, it->second, wstatus, usage);
+        }
+    }
+
+    // Blocks until some event, and handles it. Output of the child goes
+    // to out, until the end of output closes output_fd.
+    void run_once(int &output_fd, string *out)
+    {
+        if (!use_pidfd)
+            reap_any();
+
+        epoll_event events[64];
+        uint64_t start = monotonic_ns();
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        counters->wait_ns += monotonic_ns() - start;
+
+        if (count < 0) {
+            if (errno == EINTR)
+                return;
+            panic("epoll_wait failed");
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint64_t data = events[i].data.u64;
+
+            if (data == OUTPUT_EVENT) {
+                static char buff[1 << 16];
+                ssize_t res = read(output_fd, buff, sizeof(buff));
+                if (res > 0) {
+                    out->append(buff, res);
+                }
+                else if (res == 0 || errno != EINTR) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, output_fd, nullptr);
+                    output_fd = -1;
+                }
+            }
+            else if (data == SIGCHLD_EVENT) {
+                char buff[64];
+                while (read(child_sigchld_pipe[0], buff, sizeof(buff)) > 0)
+                    ;
+                reap_any();
+            }
+            else {
+                auto it = children.find(static_cast<pid_t>(data));
+                if (it != children.end() && !it->second.done)
+                    reap(it->first, it->second);
+            }
+        }
+    }
+
+    int take_status(pid_t pid)
+    {
+        auto it = children.find(pid);
+        int wstatus = it->second.wstatus;
+        children.erase(it);
+        return wstatus;
+    }
+
+public:
+
+    // Before fork, so the SIGCHLD of a child that exits right away isn't lost
+    void prepare()
+    {
+        if (epoll_fd >= 0)
+            return;
+
+        epoll_fd = move_fd_high(epoll_create1(EPOLL_CLOEXEC));
+        if (epoll_fd < 0)
+            panic("epoll_create1 failed");
+        internal_fd_register(&epoll_fd);
+
+        if (!probed) {
+            int probe = syscall(SYS_pidfd_open, getpid(), 0);
+            use_pidfd = probe >= 0 && !getenv("POSIX_SHELL_SIGCHLD_WAIT");
+            if (probe >= 0)
+                close(probe);
+            probed = true;
+        }
+
+        if (!use_pidfd) {
+            if (pipe2(child_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+                panic("pipe failed");
+            child_sigchld_pipe[0] = move_fd_high(child_sigchld_pipe[0]);
+            child_sigchld_pipe[1] = move_fd_high(child_sigchld_pipe[1]);
+            internal_fd_register(&child_sigchld_pipe[0]);
+            internal_fd_register(&child_sigchld_pipe[1]);
+            watch(child_sigchld_pipe[0], SIGCHLD_EVENT);
+
+            struct sigaction action{};
+            action.sa_handler = child_sigchld_handler;
+            action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGCHLD, &action, nullptr);
+        }
+    }
+
+    // In the parent, right after fork
+    void track(pid_t pid)
+    {
+        child_process &child = children[pid];
+
+        if (use_pidfd) {
+            child.pidfd = move_fd_high(syscall(SYS_pidfd_open, pid, 0));
+            if (child.pidfd < 0)
+                panic("pidfd_open failed");
+            watch(child.pidfd, pid);
+        }
+    }
+
+    // In the child, right after fork. The children of the parent aren't
+    // ours, and the epoll set and the self-pipe are shared with the parent.
+    // The pidfds are left to close on exec, closing them one by one would
+    // make forking n pipeline stages quadratic.
+    void forget_all()
+    {
+        children.clear();
+
+        internal_fd_close(&epoll_fd);
+
+        if (child_sigchld_pipe[0] >= 0) {
+            signal(SIGCHLD, SIG_DFL);
+            internal_fd_close(&child_sigchld_pipe[0]);
+            internal_fd_close(&child_sigchld_pipe[1]);
+        }
+    }
+
+    // Moves the pidfd on fd elsewhere, if there is one. They aren't in
+    // internal_fds, as forget_all drops them without closing.
+    bool relocate_pidfd(int fd)
+    {
+        for (auto &entry : children) {
+            child_process &child = entry.second;
+            if (child.pidfd != fd)
+                continue;
+
+            int moved = fcntl(fd, F_DUPFD_CLOEXEC, INTERNAL_FD_BASE);
+            if (moved < 0)
+                panic("moving file descriptor failed");
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            child.pidfd = moved;
+            watch(moved, entry.first);
+            return true;
+        }
+
+        return false;
+    }
+
+    void rewatch_sigchld_pipe(int old_fd, int new_fd)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, old_fd, nullptr);
+        watch(new_fd, SIGCHLD_EVENT);
+    }
+
+    bool owns_pidfd(int fd)
+    {
+        for (auto &entry : children)
+            if (entry.second.pidfd == fd)
+                return true;
+
+        return false;
+    }
+
+    // Waits for pid, reaping any other child that finishes meanwhile.
+    // Returns the wait status.
+    int wait(pid_t pid)
+    {
+        int no_output = -1;
+
+        while (!children[pid].done)
+            run_once(no_output, nullptr);
+
+        return take_status(pid);
+    }
+
+    // Reads fd to the end of output and waits for pid, in whichever order
+    // they happen
+    int wait_reading(pid_t pid, int fd, string &out)
+    {
+        watch(fd, OUTPUT_EVENT);
+
+        while (fd >= 0 || !children[pid].done)
+            run_once(fd, &out);
+
+        return take_status(pid);
+    }
+};
+
+child_reaper children;
+
+bool is_internal_fd(int fd)
+{
+    return fd >= INTERNAL_FD_BASE && (internal_fds.count(fd) || children.owns_pidfd(fd));
+}
+
+// Called before a redirection replaces fd, so a script can use the number
+// of an fd the shell holds
+void internal_fd_evict(int fd)
+{
+    if (fd < INTERNAL_FD_BASE)
+        return;
+
+    auto it = internal_fds.find(fd);
+    if (it == internal_fds.end()) {
+        children.relocate_pidfd(fd);
+        return;
+    }
+
+    int *holder = it->second;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, INTERNAL_FD_BASE);
+    if (moved < 0)
+        panic("moving file descriptor failed");
+
+    internal_fds.erase(it);
+    // Switch before closing, the SIGCHLD handler may write any time
+    *holder = moved;
+    // The epoll set knows the read end of the self-pipe by number
+    if (holder == &child_sigchld_pipe[0])
+        children.rewatch_sigchld_pipe(fd, moved);
+    close(fd);
+    internal_fd_register(holder);
+}
+
+int shell_pipe(int pipe_fd[2])
+{
+    counters->pipes++;
+    // dup2 to fd 0 or 1 in the child makes an end inheritable
+    return pipe2(pipe_fd, O_CLOEXEC);
+}
+
+// All forks go through here, so children never see a file offset that
+// is ahead of what the shell consumed.
+pid_t shell_fork()
+{
+    input_sync_all();
+    output_flush();
+    children.prepare();
+
+    counters->forks++;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // The child can't share the parent's read-ahead of pipes
+        input_buffers.clear();
+        input_has_owned_pipe = false;
+        // Pipeline stages and substitutions move fd 1 right away
+        output.fd = -1;
+        children.forget_all();
+    }
+    else if (pid > 0) {
+        children.track(pid);
+    }
+
+    return pid;
+}
+
+// Expansion
+
+string expand_tilde_prefix(const string &tilde_prefix)
+{
+    string expand_value;
+
+    if (tilde_prefix.size() == 0) {
+        return getenv("HOME");
+    }
+    else {
+        passwd *pass = getpwnam(tilde_prefix.c_str());
+
+        if (!pass)
+            return tilde_prefix;
+        
+        return pass->pw_dir;
+    }
+}
+
+int execute_compound_list(const ast_pool &pool, ast_compound_list compound_list);
+int execute_virtual_subshell(const ast_pool &pool, ast_compound_list commands, ast_range redirections, string *capture);
+bool subshell_runs_in_process(const ast_pool &pool, ast_compound_list commands, bool allow_redirections);
+
+// Exit status of the last command substitution, which is also the exit
+// status of a command that has no command name
+int last_substitution_status = 0;
+
+// Forks a child that runs the substitution with its output going to a
+// pipe, and returns the read end in read_fd
+pid_t start_substitution(const ast_pool &pool, ast_compound_list commands, int &read_fd)
+{
+    int pipe_fd[2] = {-1, -1};
+
+    if (shell_pipe(pipe_fd) < 0)
+        panic("pipe failed");
+
+    pid_t pid = shell_fork();
+
+    if (pid < 0)
+            panic("fork failed");
+
+    if (pid == 0) {
+        // Child process
+        dup2(pipe_fd[1], 1);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        try {
+            exit(execute_compound_list(pool, commands));
+        }
+        catch (const shell_exception &e) {
+            error_message(e.what());
+            exit(1);
+        }
+    }
+
+    // Parent process
+    close(pipe_fd[1]);
+    read_fd = pipe_fd[0];
+    return pid;
+}
+
+string expand_command(const string &command)
+{   
+    TokenReader r = TokenReader(Reader(command));
+    shared_program program = parse_program(r);
+    string result;
+
+    // Redirections would act on the real fd 1 instead of the captured output
+    if (subshell_runs_in_process(*program, program->program, false)) {
+        last_substitution_status = execute_virtual_subshell(*program, program->program, {}, &result);
+    }
+    else {
+        int read_fd;
+        pid_t pid = start_substitution(*program, program->program, read_fd);
+        int wstatus = children.wait_reading(pid, read_fd, result);
+        close(read_fd);
+        last_substitution_status = WEXITSTATUS(wstatus);
+    }
+
+    counters->substitution_bytes += result.size();
+
+    // Trailing newlines are removed
+    result.erase(result.find_last_not_of('\n') + 1);
+    return result;
+}
+
+// Pattern matching
+//
+// Patterns are compiled into runs of literal characters, ?, * and bracket
+// expressions. Compiled patterns are cached by their text, as loops keep
+// matching the same few patterns. The common shapes (a literal, *literal
+// and literal*) take a memcmp or find instead of the general matcher.
+
+struct pattern_element
+{
+    enum { LITERAL, ANY, STAR, SET } type;
+    string literal;
+    std::bitset<256> set;
+};
+
+struct compiled_pattern
+{
+    enum { LITERAL, STAR_LITERAL, LITERAL_STAR, GENERAL } shape;
+    vector<pattern_element> elements;
+    // The literal part of the shapes other than GENERAL
+    string literal;
+};
+
+bool pattern_class_matches(const string &name, unsigned char c)
+{
+    static const std::pair<const char *, int (*)(int)> classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+
+    for (auto &entry : classes)
+        if (name == entry.first)
+            return entry.second(c);
+
+    return false;
+}
+
+// Parses the bracket expression at pattern[i], returns false if it isn't
+// one (then the [ is a literal character)
+bool compile_bracket(const string &pattern, size_t &i, std::bitset<256> &set)
+{
+    size_t k = i + 1;
+    bool negate = k < pattern.size() && (pattern[k] == '!' || pattern[k] == '^');
+    if (negate)
+        k++;
+
+    bool first = true;
+    set.reset();
+
+    while (k < pattern.size() && (first || pattern[k] != ']')) {
+        first = false;
+
+        if (pattern.compare(k, 2, "[:") == 0) {
+            size_t close = pattern.find(":]", k + 2);
+            if (close != string::npos) {
+                string name = pattern.substr(k + 2, close - k - 2);
+                for (int c = 0; c < 256; c++)
+                    if (pattern_class_matches(name, c))
+                        set.set(c);
+                k = close + 2;
+                continue;
+            }
+        }
+
+        if (pattern[k] == '\\' && k + 1 < pattern.size())
+            k++;
+        unsigned char low = pattern[k++];
+        unsigned char high = low;
+
+        if (k + 1 < pattern.size() && pattern[k] == '-' && pattern[k + 1] != ']') {
+            k++;
+            if (pattern[k] == '\\' && k + 1 < pattern.size())
+                k++;
+            high = pattern[k++];
+        }
+
+        for (int c = low; c <= high; c++)
+            set.set(c);
+    }
+
+    if (k >= pattern.size())
+        return false;
+
+    if (negate)
+        set.flip();
+    i = k + 1;
+    return true;
+}
+
+compiled_pattern compile_pattern(const string &pattern)
+{
+    compiled_pattern compiled;
+    vector<pattern_element> &elements = compiled.elements;
+
+    auto add_literal = [&](char c) {
+        if (elements.empty() || elements.back().type != pattern_element::LITERAL)
+            elements.push_back({pattern_element::LITERAL, "", {}});
+        elements.back().literal.push_back(c);
+    };
+
+    for (size_t i = 0; i < pattern.size(); ) {
+        char c = pattern[i];
+
+        if (c == '\\' && i + 1 < pattern.size()) {
+            add_literal(pattern[i + 1]);
+            i += 2;
+        }
+        else if (c == '*') {
+            // Consecutive stars are one
+            if (elements.empty() || elements.back().type != pattern_element::STAR)
+                elements.push_back({pattern_element::STAR, "", {}});
+            i++;
+        }
+        else if (c == '?') {
+            elements.push_back({pattern_element::ANY, "", {}});
+            i++;
+        }
+        else if (c == '[') {
+            pattern_element element{pattern_element::SET, "", {}};
+            if (compile_bracket(pattern, i, element.set)) {
+                elements.push_back(element);
+            }
+            else {
+                add_literal(c);
+                i++;
+            }
+        }
+        else {
+            add_literal(c);
+            i++;
+        }
+    }
+
+    auto is = [&](size_t k, int type) { return k < elements.size() && elements[k].type == type; };
+
+    compiled.shape = compiled_pattern::GENERAL;
+    if (elements.empty()) {
+        compiled.shape = compiled_pattern::LITERAL;
+    }
+    else if (elements.size() == 1 && is(0, pattern_element::LITERAL)) {
+        compiled.shape = compiled_pattern::LITERAL;
+        compiled.literal = elements[0].literal;
+    }
+    else if (elements.size() == 1 && is(0, pattern_element::STAR)) {
+        compiled.shape = compiled_pattern::STAR_LITERAL;
+    }
+    else if (elements.size() == 2 && is(0, pattern_element::STAR) && is(1, pattern_element::LITERAL)) {
+        compiled.shape = compiled_pattern::STAR_LITERAL;
+        compiled.literal = elements[1].literal;
+    }
+    else if (elements.size() == 2 && is(0, pattern_element::LITERAL) && is(1, pattern_element::STAR)) {
+        compiled.shape = compiled_pattern::LITERAL_STAR;
+        compiled.literal = elements[0].literal;
+    }
+
+    return compiled;
+}
+
+std::shared_ptr<const compiled_pattern> find_pattern(const string &pattern)
+{
+    static std::unordered_map<string, std::shared_ptr<const compiled_pattern>> cache;
+
+    auto it = cache.find(pattern);
+    if (it != cache.end())
+        return it->second;
+
+    // Generated patterns shouldn't grow the cache forever
+    if (cache.size() >= 1024)
+        cache.clear();
+
+    auto compiled = std::make_shared<const compiled_pattern>(compile_pattern(pattern));
+    cache.emplace(pattern, compiled);
+    return compiled;
+}
+
+// Matches all of str, backtracking only to the last star
+bool pattern_match(const compiled_pattern &pattern, const char *str, size_t size)
+{
+    const vector<pattern_element> &elements = pattern.elements;
+    size_t e = 0;
+    size_t i = 0;
+    size_t star_e = string::npos;
+    size_t star_i = 0;
+
+    while (true) {
+        if (e < elements.size()) {
+            const pattern_element &element = elements[e];
+
+            if (element.type == pattern_element::STAR) {
+                if (++e == elements.size())
+                    return true;
+                star_e = e;
+                star_i = i;
+                continue;
+            }
+            else if (element.type == pattern_element::LITERAL) {
+                size_t length = element.literal.size();
+                if (size - i >= length && memcmp(str + i, element.literal.data(), length) == 0) {
+                    i += length;
+                    e++;
+                    continue;
+                }
+            }
+            else if (i < size && (element.type == pattern_element::ANY || element.set[(unsigned char)str[i]])) {
+                i++;
+                e++;
+                continue;
+            }
+        }
+        else if (i == size) {
+            return true;
+        }
+
+        if (star_e == string::npos || star_i >= size)
+            return false;
+
+        i = ++star_i;
+        e = star_e;
+    }
+}
+
+bool pattern_match(const compiled_pattern &pattern, const string &str)
+{
+    if (pattern.shape == compiled_pattern::LITERAL)
+        return str == pattern.literal;
+
+    return pattern_match(pattern, str.data(), str.size());
+}
+
+bool starts_with(const string &str, const string &prefix)
+{
+    return str.size() >= prefix.size() && memcmp(str.data(), prefix.data(), prefix.size()) == 0;
+}
+
+bool ends_with(const string &str, const string &suffix)
+{
+    return str.size() >= suffix.size()
+        && memcmp(str.data() + str.size() - suffix.size(), suffix.data(), suffix.size()) == 0;
+}
+
+// Length of the shortest or longest prefix of str that matches,
+// string::npos if none does
+size_t match_prefix(const compiled_pattern &pattern, const string &str, bool longest)
+{
+    const string &literal = pattern.literal;
+
+    switch (pattern.shape) {
+    case compiled_pattern::LITERAL:
+        return starts_with(str, literal) ? literal.size() : string::npos;
+
+    case compiled_pattern::STAR_LITERAL: {
+        size_t at = longest ? str.rfind(literal) : str.find(literal);
+        return at == string::npos ? at : at + literal.size();
+    }
+
+    case compiled_pattern::LITERAL_STAR:
+        if (!starts_with(str, literal))
+            return string::npos;
+        return longest ? str.size() : literal.size();
+
+    case compiled_pattern::GENERAL:
+        for (size_t k = 0; k <= str.size(); k++) {
+            size_t length = longest ? str.size() - k : k;
+            if (pattern_match(pattern, str.data(), length))
+                return length;
+        }
+        return string::npos;
+    }
+
+    assert(0);
+}
+
+// Start of the shortest or longest suffix of str that matches,
+// string::npos if none does
+size_t match_suffix(const compiled_pattern &pattern, const string &str, bool longest)
+{
+    const string &literal = pattern.literal;
+
+    switch (pattern.shape) {
+    case compiled_pattern::LITERAL:
+        return ends_with(str, literal) ? str.size() - literal.size() : string::npos;
+
+    case compiled_pattern::STAR_LITERAL:
+        if (!ends_with(str, literal))
+            return string::npos;
+        return longest ? 0 : str.size() - literal.size();
+
+    case compiled_pattern::LITERAL_STAR:
+        return longest ? str.find(literal) : str.rfind(literal);
+
+    case compiled_pattern::GENERAL:
+        for (size_t k = 0; k <= str.size(); k++) {
+            size_t start = longest ? k : str.size() - k;
+            if (pattern_match(pattern, str.data() + start, str.size() - start))
+                return start;
+        }
+        return string::npos;
+    }
+
+    assert(0);
+}
+
+string expand_word_no_split(const string &word);
+string expand_pattern(const string &word);
+
+// Length of the parameter name at the start of a ${...} expression
+size_t param_name_length(const string &param)
+{
+    if (param.empty())
+        return 0;
+    if (isdigit(param[0]))
+        return std::min(param.find_first_not_of("0123456789"), param.size());
+    if (is_special_param(param[0]))
+        return 1;
+
+    size_t i = 0;
+    while (i < param.size() && (isalnum(param[i]) || param[i] == '_'))
+        i++;
+    return i;
+}
+
+string expand_param(const string &param)
+{
+    if (param.size() == 0)
+        // Interpreted as regular $
+        return "$";
+
+    if (param.size() >= 2 && param[0] == '#') {
+        string var = param.substr(1);
+        return std::to_string(xenv.has_var(var) ? xenv.get_var(var).size() : 0);
+    }
+
+    size_t name_length = param_name_length(param);
+    string var = param.substr(0, name_length);
+    string op = param.substr(name_length);
+
+    if (op.empty()) {
+        if (!xenv.has_var(var))
+            return "";
+
+        return xenv.get_var(var);
+    }
+
+    bool colon = op[0] == ':';
+    char c = op[colon ? 1 : 0];
+
+    if (var.empty() || (colon && op.size() < 2))
+        panic("${" + param + "}: bad substitution");
+
+    if (c == '-' || c == '=' || c == '?' || c == '+') {
+        string word = op.substr(colon ? 2 : 1);
+        bool empty = !xenv.has_var(var) || (colon && xenv.get_var(var) == "");
+
+        if (c == '-') {
+            if (empty)
+                return expand_word_no_split(word);
+            else
+                return xenv.get_var(var);
+        }
+        else if (c == '=') {
+            if (empty)
+                xenv.set_var(var, expand_word_no_split(word));
+            return xenv.get_var(var);
+        }
+        else if (c == '?') {
+            if (empty)
+                panic(var + ": " + expand_word_no_split(word));
+            return xenv.get_var(var);
+        }
+        else {
+            if (empty)
+                return "";
+            else
+                return expand_word_no_split(word);
+        }
+    }
+    else if (!colon && (c == '%' || c == '#')) {
+        // Suffix and prefix removal, doubled for the longest match
+        bool longest = op.size() >= 2 && op[1] == c;
+        auto pattern = find_pattern(expand_pattern(op.substr(longest ? 2 : 1)));
+        const string &value = xenv.has_var(var) ? xenv.get_var(var) : "";
+
+        if (c == '%') {
+            size_t start = match_suffix(*pattern, value, longest);
+            return start == string::npos ? value : value.substr(0, start);
+        }
+        else {
+            size_t length = match_prefix(*pattern, value, longest);
+            return length == string::npos ? value : value.substr(length);
+        }
+    }
+
+    panic("${" + param + "}: bad substitution");
+}
+
+// Arithmetic expansion
+//
+// $((...)) is evaluated straight from its text by recursive descent, with
+// the C operators and precedence that POSIX asks for, in 64-bit integers.
+// Variables are read and written as integers (see var), so a counter
+// never goes through its text. Assignments in the branch of && || or ?:
+// that isn't taken are parsed but not done.
+
+class arithmetic
+{
+    const string &expr;
+    size_t pos = 0;
+    // Above zero inside a branch that isn't taken
+    int skipping = 0;
+
+    [[noreturn]] void fail(const string &message)
+    {
+        panic(expr + ": " + message);
+    }
+
+    void skip_blanks()
+    {
+        while (pos < expr.size() && isspace(expr[pos]))
+            pos++;
+    }
+
+    // The operator at pos, longest match first
+    const char *peek_op()
+    {
+        static const char *const ops[] = {
+            "<<=", ">>=",
+            "<=", ">=", "==", "!=", "&&", "||", "<<", ">>",
+            "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+            "<", ">", "+", "-", "*", "/", "%", "&", "^", "|", "!", "~", "?", ":", "=", "(", ")",
+        };
+
+        skip_blanks();
+        for (const char *op : ops)
+            if (expr.compare(pos, strlen(op), op) == 0)
+                return op;
+        return "";
+    }
+
+    bool eat_op(const char *op)
+    {
+        if (strcmp(peek_op(), op) != 0)
+            return false;
+        pos += strlen(op);
+        return true;
+    }
+
+    long long variable(const string &name)
+    {
+        long long value;
+        if (xenv.get_var_number(name, value))
+            return value;
+        if (!xenv.has_var(name))
+            return 0;
+
+        // Octal, hex and blanks around the number
+        const string &text = xenv.get_var(name);
+        const char *start = text.c_str();
+        char *end;
+        errno = 0;
+        value = strtoll(start, &end, 0);
+        while (isspace(*end))
+            end++;
+        if (*end || errno)
+            fail(name + ": invalid number");
+        return value;
+    }
+
+    long long primary()
+    {
+        skip_blanks();
+
+        if (eat_op("(")) {
+            long long value = assignment();
+            if (!eat_op(")"))
+                fail("missing `)'");
+            return value;
+        }
+
+        if (pos < expr.size() && isdigit(expr[pos])) {
+            const char *start = expr.c_str() + pos;
+            char *end;
+            errno = 0;
+            long long value = strtoll(start, &end, 0);
+            pos += end - start;
+            if (errno || (pos < expr.size() && (isalnum(expr[pos]) || expr[pos] == '_')))
+                fail("invalid number");
+            return value;
+        }
+
+        if (pos < expr.size() && (isalpha(expr[pos]) || expr[pos] == '_'))
+            return variable(name());
+
+        fail(pos < expr.size() ? "syntax error" : "operand expected");
+    }
+
+    string name()
+    {
+        size_t start = pos;
+        while (pos < expr.size() && (isalnum(expr[pos]) || expr[pos] == '_'))
+            pos++;
+        return expr.substr(start, pos - start);
+    }
+
+    long long unary()
+    {
+        if (eat_op("+"))
+            return unary();
+        if (eat_op("-"))
+            return -(unsigned long long)unary();
+        if (eat_op("!"))
+            return !unary();
+        if (eat_op("~"))
+            return ~unary();
+        return primary();
+    }
+
+    // Wraps around like the unsigned operations, and doesn't trap on
+    // division by zero or LLONG_MIN / -1
+    long long apply(const string &op, long long a, long long b)
+    {
+        unsigned long long ua = a;
+        unsigned long long ub = b;
+
+        if (op == "*") return ua * ub;
+        if (op == "+") return ua + ub;
+        if (op == "-") return ua - ub;
+        if (op == "<<") return ua << (b & 63);
+        if (op == ">>") return a >> (b & 63);
+        if (op == "&") return a & b;
+        if (op == "^") return a ^ b;
+        if (op == "|") return a | b;
+
+        if (b == 0) {
+            // Parsed, but never computed
+            if (skipping)
+                return 0;
+            fail("division by zero");
+        }
+        if (b == -1)
+            return op == "/" ? -ua : 0;
+        return op == "/" ? a / b : a % b;
+    }
+
+    // Levels of left associative binary operators, loosest first
+    long long binary(int level)
+    {
+        static const vector<vector<string>> levels = {
+            {"|"}, {"^"}, {"&"}, {"==", "!="}, {"<", "<=", ">", ">="}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"},
+        };
+
+        if (level == (int)levels.size())
+            return unary();
+
+        long long value = binary(level + 1);
+
+        while (true) {
+            string op = peek_op();
+            const vector<string> &ops = levels[level];
+            if (std::find(ops.begin(), ops.end(), op) == ops.end())
+                return value;
+
+            pos += op.size();
+            long long right = binary(level + 1);
+
+            if (op == "==") value = value == right;
+            else if (op == "!=") value = value != right;
+            else if (op == "<") value = value < right;
+            else if (op == "<=") value = value <= right;
+            else if (op == ">") value = value > right;
+            else if (op == ">=") value = value >= right;
+            else value = apply(op, value, right);
+        }
+    }
+
+    long long logical_and()
+    {
+        long long value = binary(0);
+
+        while (eat_op("&&")) {
+            skipping += !value;
+            long long right = binary(0);
+            skipping -= !value;
+            value = value && right;
+        }
+
+        return value;
+    }
+
+    long long logical_or()
+    {
+        long long value = logical_and();
+
+        while (eat_op("||")) {
+            skipping += !!value;
+            long long right = logical_and();
+            skipping -= !!value;
+            value = value || right;
+        }
+
+        return value;
+    }
+
+    long long conditional()
+    {
+        long long condition = logical_or();
+
+        if (!eat_op("?"))
+            return condition;
+
+        skipping += !condition;
+        long long if_true = assignment();
+        skipping -= !condition;
+
+        if (!eat_op(":"))
+            fail("missing `:'");
+
+        skipping += !!condition;
+        long long if_false = conditional();
+        skipping -= !!condition;
+
+        return condition ? if_true : if_false;
+    }
+
+    long long assignment()
+    {
+        static const vector<string> assignment_ops = {"=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|="};
+
+        skip_blanks();
+        size_t start = pos;
+
+        if (pos < expr.size() && (isalpha(expr[pos]) || expr[pos] == '_')) {
+            string var = name();
+            string op = peek_op();
+
+            if (std::find(assignment_ops.begin(), assignment_ops.end(), op) != assignment_ops.end()) {
+                pos += op.size();
+                long long value = assignment();
+                if (op != "=")
+                    value = apply(op.substr(0, op.size() - 1), variable(var), value);
+                if (!skipping)
+                    xenv.set_var_number(var, value);
+                return value;
+            }
+
+            pos = start;
+        }
+
+        return conditional();
+    }
+
+public:
+
+    arithmetic(const string &expr) : expr{expr} { }
+
+    long long evaluate()
+    {
+        long long value = assignment();
+        skip_blanks();
+        if (pos < expr.size())
+            fail("syntax error");
+        return value;
+    }
+};
+
+// expr is what is between $(( and )). It gets parameter expansion, command
+// substitution and quote removal first, like in double quotes.
+long long expand_arithmetic(const string &expr)
+{
+    if (expr.find_first_of("$`'\"\\") == string::npos)
+        return arithmetic(expr).evaluate();
+
+    string expanded = expand_word_no_split(expr);
+    return arithmetic(expanded).evaluate();
+}
+
+// Field splitting
+
+void field_append(vector<string> &fields, char c)
+{
+    if (fields.size())
+        fields.back().push_back(c);
+    else
+        fields.push_back(string{c});
+}
+
+void field_append(vector<string> &fields, const string &str)
+{
+    if (fields.size())
+        fields.back().append(str);
+    else
+        fields.push_back(str);
+}
+
+// Takes over str instead of copying it when it starts the field
+void field_append(vector<string> &fields, string &&str)
+{
+    if (fields.size() && fields.back().size())
+        fields.back().append(str);
+    else if (fields.size())
+        fields.back() = std::move(str);
+    else
+        fields.push_back(std::move(str));
+}
+
+string current_ifs()
+{
+    return xenv.has_var("IFS") ? xenv.get_var("IFS") : " \t\n";
+}
+
+// Splits by a non-empty IFS. The input may come in pieces, which are split
+// as if they were one string.
+class field_splitter
+{
+    // IFS is separated into whitespace IFS (what we call soft IFS)
+    // and non-whitespace IFS (what we call hard IFS)
+    string soft_ifs;
+    string hard_ifs;
+
+    // Soft IFS spans are merged together into a single delimiter,
+    // and are ignored at the beginning and end of input.
+    // Hard IFS aren't merged together, and can delimit empty fields.
+    // Hard IFS are merged with the soft IFS around them.
+    // Hard IFS at the beginning of the input cause an empty field.
+
+    enum class Mode {
+        START,          // We didn't yet start the first field
+        FIELD,          // We are in the middle of the field
         SOFT_DELIMIT,   // In a soft IFS span
         HARD_DELIMIT,   // In a span of soft IFS + one hard IFS char
     };
 
-    Mode mode = fields.size() == 0 ? Mode::START : Mode::FIELD;
+    Mode mode;
+
+public:
+
+    // With start false, the input continues the last field
+    field_splitter(const string &ifs, bool start)
+        : mode{start ? Mode::START : Mode::FIELD}
+    {
+        for (char c : ifs) {
+            if (isspace(c))
+                soft_ifs.push_back(c);
+            else
+                hard_ifs.push_back(c);
+        }
+    }
+
+    // Whether more input may still extend the last field
+    bool in_field() const { return mode == Mode::FIELD; }
+
+    void split(vector<string> &fields, const char *str, size_t size);
+};
+
+void field_splitter::split(vector<string> &fields, const char *str, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        char c = str[i];
+
+        if (soft_ifs.find(c) != string::npos) {
+            if (mode == Mode::START)
+                ; // Ignore soft IFS at the beginning of input
+            if (mode == Mode::FIELD)
+                mode = Mode::SOFT_DELIMIT;
+        }
+        else if (hard_ifs.find(c) != string::npos) {
+            if (mode == Mode::START || mode == Mode::HARD_DELIMIT)
+                // Add an empty field
+                fields.push_back(string{});
+
+            mode = Mode::HARD_DELIMIT;
+        }
+        else {
+            if (mode != Mode::FIELD) {
+                // Begin new field
+                fields.push_back(string{});
+                mode = Mode::FIELD;
+            }
+
+            fields.back().push_back(c);
+        }
+    }
+}
+
+// With join false, str starts a new field instead of continuing the last one
+void field_split(vector<string> &fields, const string &str, bool join = true)
+{
+    string ifs = current_ifs();
+
+    if (ifs.size() == 0) {
+        field_append(fields, str);
+        return;
+    }
+
+    field_splitter splitter(ifs, fields.size() == 0 || !join);
+    splitter.split(fields, str.data(), str.size());
+}
+
+string expand_dollar_or_backquote(Reader &r)
+{
+    if (r.at("$(("))
+        return std::to_string(expand_arithmetic(r.read_arithmetic_expand(false)));
+    else if (r.at("$("))
+        return expand_command(r.read_subshell(false));
+    else if (r.at("${"))
+        return expand_param(r.read_param_expand_in_braces(false));
+    else if (r.at('$'))
+        return expand_param(r.read_param_expand(false));
+    else if (r.at('`'))
+        return expand_command(r.read_subshell_backquote(false));
+    else
+        assert(0);
+}
+
+// $@ and $* (also ${@} and ${*}) can expand to several fields, so
+// expand_word takes care of them instead of expand_param
+bool read_positional_list(Reader &r, char &which)
+{
+    for (const char *ref : {"$@", "$*", "${@}", "${*}"}) {
+        if (r.at(ref)) {
+            which = strchr(ref, '@') ? '@' : '*';
+            r.eat(ref);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+vector<string> expand_word(const string &word, bool field_splitting=true)
+{
+    phase_scope phase(PHASE_EXPAND);
+    Reader r(word);
+    vector<string> fields;
+    char which;
+
+    // TODO: deal with variable assignments that support multiple tilde-prefixes
+    if (r.at('~')) {
+        string first_part = r.read_regular_part();
+        size_t slash = first_part.find('/');
+        // This works nicely when slash is string::npos
+        string tilde_prefix = first_part.substr(1, slash - 1);
+
+        field_append(fields, expand_tilde_prefix(tilde_prefix));
+
+        if (slash != string::npos)
+            field_append(fields, first_part.substr(slash));
+    }
+
+    while (!r.eof()) {
+        if (r.at('\\')) {
+            field_append(fields, r.read_slash_quote(false));
+        }
+        else if (r.at('\'')) {
+            // Empty Quotes create empty field
+            if (fields.size() == 0)
+                fields.push_back(string{});
+
+            field_append(fields, r.read_single_quote(false));
+        }
+        else if (r.at('\"')) {
+            string inner_data = r.read_double_quote(false);
+            Reader r(inner_data);
+            char which;
+
+            // Empty Quotes create empty field
+            bool created_field = fields.size() == 0;
+            if (created_field)
+                fields.push_back(string{});
+
+            // But "$@" without positional parameters is no field at all
+            if (created_field && (inner_data == "$@" || inner_data == "${@}") && xenv.params().size() == 0)
+                fields.pop_back();
+
+            while (!r.eof()) {
+                if (r.at("\\$") || r.at("\\`") || r.at("\\\\"))
+                    field_append(fields,  r.read_slash_quote(false));
+                else if (read_positional_list(r, which)) {
+                    const positional_params &params = xenv.params();
+
+                    if (which == '*') {
+                        string ifs = current_ifs();
+                        field_append(fields, xenv.join_params(ifs.size() ? ifs.substr(0, 1) : ""));
+                    }
+                    else {
+                        // Every parameter is a field of its own
+                        for (size_t i = 0; i < params.size(); i++) {
+                            if (i > 0)
+                                fields.push_back(string{});
+                            field_append(fields, params[i]);
+                        }
+                    }
+                }
+                else if (r.at('$') || r.at('`'))
+                    field_append(fields, expand_dollar_or_backquote(r));
+                else
+                    field_append(fields, r.pop());
+            }
+        }
+        else if (read_positional_list(r, which)) {
+            const positional_params &params = xenv.params();
+
+            if (field_splitting) {
+                for (size_t i = 0; i < params.size(); i++)
+                    field_split(fields, params[i], i == 0);
+            }
+            else {
+                field_append(fields, xenv.join_params(" "));
+            }
+        }
+        else if (r.at('$') || r.at('`')) {
+            string result = expand_dollar_or_backquote(r);
+            if (field_splitting)
+                field_split(fields, result);
+            else
+                field_append(fields, std::move(result));
+        }
+        else
+            field_append(fields, r.read_regular_part());
+    }
+
+    return fields;
+}
+
+string expand_word_no_split(const string &word)
+{
+    vector<string> result =  expand_word(word, false);
+
+    if (result.size() == 0)
+        return "";
+    else if (result.size() == 1)
+        return std::move(result[0]);
+    else
+        assert(0);
+}
+
+// Recognizes words that only reference a variable: $A, ${A}, "$A" or "${A}".
+// Without field splitting their expansion is the value itself, which can
+// then be shared instead of copied.
+bool is_lone_variable(const string &word, string &name)
+{
+    size_t start = 0;
+    size_t end = word.size();
+
+    if (end >= 2 && word[0] == '"' && word[end - 1] == '"') {
+        start++;
+        end--;
+    }
+
+    if (end - start < 2 || word[start] != '$')
+        return false;
+    start++;
+
+    if (word[start] == '{') {
+        if (word[end - 1] != '}')
+            return false;
+        start++;
+        end--;
+    }
+
+    if (start >= end)
+        return false;
+
+    name = word.substr(start, end - start);
+    return is_name(name);
+}
+
+// Recognizes words that are one arithmetic expansion, like $((i + 1)),
+// whose value can be stored as an integer. expr gets what is inside.
+bool is_lone_arithmetic(const string &word, string &expr)
+{
+    if (word.compare(0, 3, "$((") != 0 || word.compare(word.size() - 2, 2, "))") != 0)
+        return false;
+
+    Reader r(word);
+    expr = r.read_arithmetic_expand(false);
+    return r.eof();
+}
+
+// Recognizes assignment values that start with the assigned variable, like
+// "$s$x" or ${s}x, and gives the rest of the word to expand in suffix
+bool is_self_append(const string &name, const string &word, string &suffix)
+{
+    bool quoted = word.size() && word[0] == '"';
+    size_t i = quoted ? 1 : 0;
+
+    string plain_ref = "$" + name;
+    string braced_ref = "${" + name + "}";
+
+    if (word.compare(i, plain_ref.size(), plain_ref) == 0
+            && (i + plain_ref.size() == word.size()
+                || !(isalnum(word[i + plain_ref.size()]) || word[i + plain_ref.size()] == '_')))
+        i += plain_ref.size();
+    else if (word.compare(i, braced_ref.size(), braced_ref) == 0)
+        i += braced_ref.size();
+    else
+        return false;
+
+    suffix = (quoted ? "\"" : "") + word.substr(i);
+
+    // A tilde would become a tilde prefix, and ${s=...} or $((s = ...))
+    // could change the variable we are about to append to
+    return !(suffix.size() && suffix[0] == '~') && suffix.find("${" + name) == string::npos
+        && suffix.find("$((") == string::npos;
+}
+
+// expand_word_no_split that shares the value of a lone variable
+shared_value expand_word_shared(const string &word)
+{
+    string name;
+
+    if (is_lone_variable(word, name))
+        return xenv.has_var(name) ? xenv.get_shared_var(name) : EMPTY_VALUE;
+
+    return make_value(expand_word_no_split(word));
+}
+
+// Quoted characters in a pattern match themselves, so they are escaped
+string escape_pattern(const string &str)
+{
+    string result;
+
+    for (char c : str) {
+        if (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\')
+            result.push_back('\\');
+        result.push_back(c);
+    }
+
+    return result;
+}
+
+// Expands a word that is used as a pattern, for case and ${x%pattern}
+string expand_pattern(const string &word)
+{
+    Reader r(word);
+    string pattern;
+
+    while (!r.eof()) {
+        if (r.at('\\'))
+            pattern += escape_pattern(r.read_slash_quote(false));
+        else if (r.at('\''))
+            pattern += escape_pattern(r.read_single_quote(false));
+        else if (r.at('"'))
+            pattern += escape_pattern(expand_word_no_split(r.read_double_quote(true)));
+        else if (r.at('$') || r.at('`'))
+            pattern += expand_dollar_or_backquote(r);
+        else
+            pattern += r.read_regular_part();
+    }
+
+    return pattern;
+}
+
+// Fields that are a lone variable holding an integer, like $i, by index
+typedef vector<std::pair<size_t, long long>> integer_fields;
+
+// The fields of the loop invariant words (see optimize_program) of the
+// innermost running loop, by word index. Loops that can't use them, when
+// one of their command names is a function, still get a disabled frame,
+// as their words must not land in the frame of an outer loop.
+struct loop_invariants
+{
+    const ast_pool *pool;
+    bool enabled;
+    std::unordered_map<uint32_t, vector<string>> fields;
+};
+
+loop_invariants *invariant_frame = nullptr;
+
+// Pushes a frame for a loop with invariant words, for the time it runs
+class invariant_scope
+{
+    loop_invariants frame;
+    loop_invariants *outer;
+    bool pushed;
+
+public:
+
+    invariant_scope(const ast_pool &pool, const ast_loop_info &info)
+        : outer{invariant_frame}, pushed{info.invariants}
+    {
+        if (!pushed)
+            return;
+
+        frame.pool = &pool;
+        frame.enabled = true;
+        for (ast_index name : ast_pool::slice(pool.guard_names, info.guard))
+            if (xenv.has_func(pool.str(name)))
+                frame.enabled = false;
+        invariant_frame = &frame;
+    }
+
+    ~invariant_scope()
+    {
+        if (pushed)
+            invariant_frame = outer;
+    }
+};
+
+// With integers, notes the fields that are a lone integer variable. Unless
+// IFS would split its digits, such a variable is one field of its own.
+vector<string> expand_words(const ast_pool &pool, ast_range words, integer_fields *integers = nullptr)
+{
+    vector<string> expanded;
+    string name;
+    long long number;
+
+    if (integers && current_ifs().find_first_of("-0123456789") != string::npos)
+        integers = nullptr;
+
+    loop_invariants *frame = invariant_frame && invariant_frame->pool == &pool && invariant_frame->enabled ? invariant_frame : nullptr;
+
+    for (uint32_t i = words.begin; i < words.begin + words.count; i++) {
+        ast_index str = pool.words[i];
+        const string &word = pool.str(str);
+
+        if (integers && is_lone_variable(word, name) && xenv.get_var_number(name, number)) {
+            integers->push_back({expanded.size(), number});
+            expanded.push_back(xenv.get_var(name));
+            continue;
+        }
+
+        if (pool.string_info[str].literal) {
+            expanded.push_back(word);
+            continue;
+        }
+
+        if (frame && (pool.word_flags[i] & WORD_INVARIANT)) {
+            auto found = frame->fields.find(i);
+            if (found == frame->fields.end())
+                found = frame->fields.emplace(i, expand_word(word)).first;
+            expanded.insert(expanded.end(), found->second.begin(), found->second.end());
+            continue;
+        }
+
+        vector<string> fields = expand_word(word);
+        expanded.insert(expanded.end(), std::make_move_iterator(fields.begin()), std::make_move_iterator(fields.end()));
+    }
+
+    return expanded;
+}
+
+// Streaming command substitution
+//
+// At -O2, a for loop over a lone $(...), like for f in $(find . -type f),
+// takes the fields as the command writes them. The loop starts with the
+// first field instead of waiting for all of the output, and only a read
+// buffer and the fields of one read are held at a time. Unless IFS splits
+// at newlines, trailing newlines are held back until more output follows
+// them, as they are removed at the end. The fields are split by the IFS
+// at the start of the loop, which is when they would be expanded
+// otherwise.
+//
+// The list is no longer a snapshot: the command runs alongside the body,
+// so it sees what the body did, like lines the body appends to the file
+// the command reads. That is why it takes -O2.
+//
+// Substitutions that would run in the shell process are expanded as usual,
+// they can't run alongside the loop body.
+
+const size_t COMMAND_STREAM_BUFFER_SIZE = 4096;
+
+class command_stream
+{
+    shared_program program;
+    int fd = -1;
+    pid_t pid = -1;
+    field_splitter splitter;
+    bool newline_splits;
+    vector<string> fields;
+    size_t next_field = 0;
+    size_t pending_newlines = 0;
+    string buffer;
+
+    // Reads the next piece of output, false at the end
+    bool fill()
+    {
+        ssize_t n;
+        do {
+            n = read(fd, &buffer[0], buffer.size());
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+            return false;
+
+        counters->substitution_bytes += n;
+
+        // Newlines at the end are IFS whitespace, which is ignored there
+        if (newline_splits) {
+            splitter.split(fields, buffer.data(), n);
+            return true;
+        }
+
+        size_t end = n;
+        while (end > 0 && buffer[end - 1] == '\n')
+            end--;
+        if (end == 0) {
+            pending_newlines += n;
+            return true;
+        }
+
+        // The newlines held back are not trailing after all
+        if (pending_newlines) {
+            string newlines(pending_newlines, '\n');
+            splitter.split(fields, newlines.data(), newlines.size());
+        }
+        splitter.split(fields, buffer.data(), end);
+        pending_newlines = n - end;
+        return true;
+    }
+
+public:
+
+    command_stream(const shared_program &program, const string &ifs)
+        : program{program}, splitter(ifs, true), newline_splits{ifs.find('\n') != string::npos}, buffer(COMMAND_STREAM_BUFFER_SIZE, '\0')
+    {
+        pid = start_substitution(*program, program->program, fd);
+        fd = move_fd_high(fd);
+        internal_fd_register(&fd);
+    }
+
+    // The rest of the output is read as if the loop had run to the end
+    ~command_stream()
+    {
+        while (fill())
+            fields.clear();
+        internal_fd_close(&fd);
+        last_substitution_status = WEXITSTATUS(children.wait(pid));
+    }
+
+    bool next(string &field)
+    {
+        while (true) {
+            // The last field is done when the splitter has moved past it
+            size_t done = fields.size() - (fields.size() && splitter.in_field());
+            if (next_field < done) {
+                field = std::move(fields[next_field++]);
+                return true;
+            }
+
+            fields.erase(fields.begin(), fields.begin() + next_field);
+            next_field = 0;
+
+            if (!fill()) {
+                if (fields.empty())
+                    return false;
+                field = std::move(fields.back());
+                fields.clear();
+                return true;
+            }
+        }
+    }
+};
+
+// The stream for a for loop marked by optimize_program, or null when the
+// substitution runs in process or IFS doesn't split
+std::unique_ptr<command_stream> stream_command(const string &word)
+{
+    string ifs = current_ifs();
+    if (ifs.empty())
+        return nullptr;
+
+    Reader reader(word);
+    string command = reader.at('`') ? reader.read_subshell_backquote(false) : reader.read_subshell(false);
+
+    TokenReader r = TokenReader(Reader(command));
+    shared_program program = parse_program(r);
+    if (subshell_runs_in_process(*program, program->program, false))
+        return nullptr;
+
+    return std::make_unique<command_stream>(program, ifs);
+}
+
+// Command search
+
+bool is_executable_file(const string &path)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) < 0)
+        return false;
+
+    return S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+vector<string> path_directories(const string &path)
+{
+    vector<string> dirs;
+    size_t start = 0;
+
+    while (true) {
+        size_t colon = path.find(':', start);
+        string dir = path.substr(start, colon - start);
+        // An empty entry means the current directory
+        dirs.push_back(dir.size() ? dir : ".");
+        if (colon == string::npos)
+            break;
+        start = colon + 1;
+    }
+
+    return dirs;
+}
+
+// Remembers where commands were found in PATH, so repeated commands
+// don't probe every PATH directory again. The table is dropped whenever
+// PATH changes.
+class command_hash
+{
+    string path;
+    map<string, string> table;
+
+    void sync_path(const string &current_path)
+    {
+        if (current_path != path) {
+            table.clear();
+            path = current_path;
+        }
+    }
+
+public:
+
+    string lookup(const string &current_path, const string &name)
+    {
+        sync_path(current_path);
+
+        auto it = table.find(name);
+        if (it != table.end())
+            return it->second;
+
+        for (const string &dir : path_directories(path)) {
+            string candidate = dir + "/" + name;
+            if (is_executable_file(candidate)) {
+                table[name] = candidate;
+                return candidate;
+            }
+            counters->path_misses++;
+        }
+
+        return "";
+    }
+
+    void forget(const string &name)
+    {
+        table.erase(name);
+    }
+
+    // Hash every executable in PATH up front
+    void prewarm(const string &current_path)
+    {
+        sync_path(current_path);
+
+        for (const string &dir : path_directories(path)) {
+            DIR *d = opendir(dir.c_str());
+            if (!d)
+                continue;
+
+            while (dirent *entry = readdir(d)) {
+                string name = entry->d_name;
+                // Earlier PATH directories take precedence
+                if (name == "." || name == ".." || table.count(name))
+                    continue;
+
+                string candidate = dir + "/" + name;
+                if (is_executable_file(candidate))
+                    table[name] = candidate;
+            }
+
+            closedir(d);
+        }
+    }
+};
+
+command_hash hashed_commands;
+
+string current_path_value()
+{
+    return xenv.has_var("PATH") ? xenv.get_var("PATH") : "/usr/local/bin:/usr/bin:/bin";
+}
+
+string find_command(const string &name)
+{
+    if (name.find('/') != string::npos)
+        return name;
+
+    return hashed_commands.lookup(current_path_value(), name);
+}
+
+[[noreturn]] void exec_command(const string &path, const vector<string> &args)
+{
+    vector<const char*> argv;
+    for (auto& arg : args)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+
+    vector<string> environment = xenv.environment();
+    vector<const char*> envp;
+    for (auto& entry : environment)
+        envp.push_back(entry.c_str());
+    envp.push_back(nullptr);
+
+    // execve doesn't modify its arguments, so it should be safe
+    char ** argv_ptr = const_cast<char **>(&argv[0]);
+    char ** envp_ptr = const_cast<char **>(&envp[0]);
+
+    if (path.empty()) {
+        error_message(args[0] + ": command not found");
+        exit(127);
+    }
+
+    output_flush();
+
+    counters->execs++;
+    execve(path.c_str(), argv_ptr, envp_ptr);
+
+    if (errno == ENOENT && args[0].find('/') == string::npos) {
+        // The hashed location went stale, search PATH again
+        hashed_commands.forget(args[0]);
+        string fresh_path = find_command(args[0]);
+        if (fresh_path.size() && fresh_path != path) {
+            counters->execs++;
+            execve(fresh_path.c_str(), argv_ptr, envp_ptr);
+        }
+    }
+
+    if (errno == ENOEXEC) {
+        // Not a binary, run it as a shell script like execvp does
+        argv.insert(argv.begin(), "/bin/sh");
+        argv[1] = path.c_str();
+        counters->execs++;
+        execve("/bin/sh", const_cast<char **>(&argv[0]), envp_ptr);
+    }
+
+    // execve failed
+    error_message(string("error executing ") + args[0]);
+    exit(126);
+}
+
+// Parse cache
+//
+// eval and . would parse their source again on every call. Parsed programs
+// are kept by key instead: the text for eval, and path, inode, mtime and
+// size for ., so an edited file is parsed again. When the cache is full the
+// least recently used program goes. Programs are shared, so one that is
+// still running survives its eviction.
+
+// Set by POSIX_SHELL_PARSE_CACHE_SIZE, 0 turns the cache off
+size_t parse_cache_capacity = 64;
+
+class parse_cache
+{
+    typedef std::pair<string, shared_program> entry;
+
+    // Most recently used first. The index points into the keys of the
+    // list, list nodes don't move.
+    std::list<entry> entries;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+
+public:
+
+    // Without keep, a miss isn't added to the cache
+    template<typename F>
+    shared_program get(string key, F parse, bool keep = true)
+    {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            counters->parse_cache_hits++;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+
+        counters->parse_cache_misses++;
+        shared_program program = parse();
+
+        if (!keep || parse_cache_capacity == 0)
+            return program;
+
+        if (entries.size() >= parse_cache_capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+
+        entries.emplace_front(std::move(key), program);
+        index[entries.front().first] = entries.begin();
+        return program;
+    }
+};
+
+parse_cache parsed_programs;
+
+// Builtin I/O
+
+bool shell_write(int fd, const char *data, size_t size)
+{
+    if (fd == 1 && virtual_stdout) {
+        ring_write(*virtual_stdout, data, size);
+        return true;
+    }
+
+    if (fd == 1 && captured_stdout) {
+        captured_stdout->append(data, size);
+        return true;
+    }
+
+    return output_write(fd, data, size);
+}
+
+bool shell_write(int fd, const string &data)
+{
+    return shell_write(fd, data.data(), data.size());
+}
+
+ssize_t shell_read(int fd, char *data, size_t size)
+{
+    if (fd == 0 && virtual_stdin)
+        return ring_read(*virtual_stdin, data, size);
+
+    output_flush();
+
+    ssize_t res;
+    do {
+        res = read(fd, data, size);
+    } while (res < 0 && errno == EINTR);
+
+    return res;
+}
+
+// External commands with virtual fds
+//
+// runs_in_process decides before an inline pipeline or a substitution
+// starts, but the commands may still reach an external command, like a
+// function that a stage redefines. The command then gets a socket for a
+// virtual fd 0 and a pipe for a virtual fd 1, and the shell copies between
+// them and the rings or the capture until it is done. A socket, as writes
+// to a reader that is gone fail with EPIPE instead of raising SIGPIPE.
+//
+// The same goes for the read-ahead of a pipe the shell owns (see input_own):
+// the command gets it first and then the rest of the pipe, and what it
+// didn't take is put back.
+
+class process_bridge
+{
+    int to_child = -1;
+    int from_child = -1;
+    int child_stdin = -1;
+    int child_stdout = -1;
+    // Input for the command without a ring
+    string pending;
+    size_t pending_pos = 0;
+    bool stdin_eof = false;
+
+    // Gets more of fd 0 without blocking, false when there is none yet
+    bool refill_pending()
+    {
+        pollfd fd = {0, POLLIN, 0};
+        if (stdin_eof || poll(&fd, 1, 0) <= 0)
+            return false;
+
+        pending.resize(INPUT_BLOCK_SIZE);
+        ssize_t n = read(0, &pending[0], pending.size());
+        pending.resize(std::max(n, (ssize_t)0));
+        pending_pos = 0;
+        if (n <= 0)
+            stdin_eof = true;
+        return n > 0;
+    }
+
+    void close_fd(int &fd)
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+
+    // The next input for the command, empty when there is none yet
+    std::pair<const char *, size_t> input_chunk()
+    {
+        if (virtual_stdin) {
+            ring_pipe &ring = *virtual_stdin;
+            return {&ring.buff[ring.start], std::min(ring.count, ring.buff.size() - ring.start)};
+        }
+
+        if (pending_pos == pending.size())
+            refill_pending();
+        return {pending.data() + pending_pos, pending.size() - pending_pos};
+    }
+
+    void input_consumed(size_t n)
+    {
+        if (virtual_stdin) {
+            ring_pipe &ring = *virtual_stdin;
+            ring.start = (ring.start + n) % ring.buff.size();
+            ring.count -= n;
+            inline_progress++;
+        }
+        else {
+            pending_pos += n;
+        }
+    }
+
+    bool input_ended()
+    {
+        return virtual_stdin ? virtual_stdin->writer_closed : stdin_eof;
+    }
+
+    void close_input()
+    {
+        close_fd(to_child);
+        if (!virtual_stdin && pending_pos < pending.size())
+            input_push_back(0, pending.substr(pending_pos));
+        pending.clear();
+        pending_pos = 0;
+    }
+
+    // Returns true when something moved or an end closed
+    bool pump_input()
+    {
+        std::pair<const char *, size_t> chunk = input_chunk();
+
+        if (chunk.second == 0) {
+            char c;
+            if (input_ended() || recv(to_child, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+                // Out of input, or the command doesn't read anymore
+                close_input();
+                return true;
+            }
+            return false;
+        }
+
+        ssize_t n = send(to_child, chunk.first, chunk.second, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return false;
+        if (n < 0) {
+            close_input();
+            return true;
+        }
+
+        input_consumed(n);
+        return true;
+    }
+
+    bool pump_output()
+    {
+        char buffer[4096];
+        ssize_t n = read(from_child, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return false;
+        if (n <= 0) {
+            close_fd(from_child);
+            return true;
+        }
+
+        shell_write(1, buffer, n);
+        return true;
+    }
+
+    // Waits for one of the fds. Inside a stage the other stages run
+    // meanwhile, and the scheduler polls the fds once none of them can.
+    void wait_for_progress()
+    {
+        pollfd fds[3];
+        nfds_t count = 0;
+
+        if (to_child >= 0) {
+            bool has_input = virtual_stdin ? virtual_stdin->count > 0 : pending_pos < pending.size();
+            fds[count++] = {to_child, (short)(has_input ? POLLOUT : POLLIN), 0};
+            if (!virtual_stdin && !has_input)
+                fds[count++] = {0, POLLIN, 0};
+        }
+        if (from_child >= 0)
+            fds[count++] = {from_child, POLLIN, 0};
+
+        if (inline_stage_context) {
+            inline_wait_fds->assign(fds, fds + count);
+            inline_yield();
+            inline_wait_fds->clear();
+            return;
+        }
+
+        poll(fds, count, -1);
+    }
+
+public:
+
+    static bool needed()
+    {
+        return is_virtual_fd(0) || is_virtual_fd(1) || input_has_unread_pipe_data(0);
+    }
+
+    process_bridge()
+    {
+        if (!is_virtual_fd(0) && input_has_unread_pipe_data(0))
+            pending = input_unread(0);
+
+        if (is_virtual_fd(0) || pending.size()) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+                panic("socketpair failed");
+            to_child = sv[0];
+            child_stdin = sv[1];
+        }
+        if (is_virtual_fd(1)) {
+            int pipe_fd[2];
+            if (shell_pipe(pipe_fd) < 0)
+                panic("pipe failed");
+            from_child = pipe_fd[0];
+            child_stdout = pipe_fd[1];
+        }
+    }
+
+    ~process_bridge()
+    {
+        close_fd(to_child);
+        close_fd(from_child);
+        close_fd(child_stdin);
+        close_fd(child_stdout);
+    }
+
+    // In the child, before its redirections
+    void connect_child()
+    {
+        if (child_stdin >= 0)
+            dup2(child_stdin, 0);
+        if (child_stdout >= 0)
+            dup2(child_stdout, 1);
+        close_fd(to_child);
+        close_fd(from_child);
+        close_fd(child_stdin);
+        close_fd(child_stdout);
+        virtual_stdin = nullptr;
+        virtual_stdout = nullptr;
+        captured_stdout = nullptr;
+    }
+
+    // In the parent, returns the wait status of the child
+    int run(pid_t pid)
+    {
+        close_fd(child_stdin);
+        close_fd(child_stdout);
+        for (int fd : {to_child, from_child})
+            if (fd >= 0)
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        try {
+            while (to_child >= 0 || from_child >= 0) {
+                bool progress = false;
+                if (from_child >= 0)
+                    progress |= pump_output();
+                if (to_child >= 0)
+                    progress |= pump_input();
+                if (!progress)
+                    wait_for_progress();
+            }
+        }
+        catch (const ring_broken_pipe &) {
+            // Like a forked stage, the command gets SIGPIPE
+            close_input();
+            close_fd(from_child);
+            children.wait(pid);
+            throw;
+        }
+
+        return children.wait(pid);
+    }
+};
+
+// Builtins
+
+typedef int (*builtin_function)(const vector<string> &args);
+
+enum class copy_result
+{
+    DONE,
+    UNSUPPORTED,
+    FAILED,
+};
+
+// Repeats a kernel side copy until EOF. It is unsupported when it fails
+// before moving anything, so the caller can try the next method.
+template<typename F>
+copy_result kernel_copy(F move_chunk)
+{
+    bool moved_any = false;
+
+    while (true) {
+        ssize_t res = move_chunk();
+
+        if (res > 0) {
+            moved_any = true;
+        }
+        else if (res == 0) {
+            return copy_result::DONE;
+        }
+        else if (errno != EINTR) {
+            bool unsupported = errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                || errno == EBADF || errno == EOPNOTSUPP;
+            return !moved_any && unsupported ? copy_result::UNSUPPORTED : copy_result::FAILED;
+        }
+    }
+}
+
+// Copies everything from in_fd to out_fd. The data stays in the kernel
+// with copy_file_range, splice or sendfile when the file types allow it,
+// otherwise it goes through a large buffer.
+// Returns false and leaves errno set on failure.
+bool copy_fd(int in_fd, int out_fd)
+{
+    copy_result res = copy_result::UNSUPPORTED;
+
+    if (is_virtual_fd(in_fd) || is_virtual_fd(out_fd)) {
+        // Inline pipeline rings only take the copy through a buffer.
+        // Not static, other stages copy while this one waits.
+        vector<char> buff(1 << 16);
+
+        res = kernel_copy([&] {
+            ssize_t count = shell_read(in_fd, buff.data(), buff.size());
+            if (count > 0 && !shell_write(out_fd, buff.data(), count))
+                return (ssize_t)-1;
+            return count;
+        });
+
+        return res == copy_result::DONE;
+    }
+
+    struct stat in_st, out_st;
+
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0)
+        return false;
+
+    // The copy writes to out_fd directly
+    if (!output_flush())
+        return false;
+
+    // Whatever the read builtin buffered comes first
+    string pending = input_unread(in_fd);
+    if (pending.size() && !write_full(out_fd, pending.data(), pending.size()))
+        return false;
+
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        res = kernel_copy([&] {
+            return copy_file_range(in_fd, nullptr, out_fd, nullptr, 1 << 30, 0);
+        });
+    }
+
+    if (res == copy_result::UNSUPPORTED && (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+        res = kernel_copy([&] {
+            return splice(in_fd, nullptr, out_fd, nullptr, 1 << 20, SPLICE_F_MOVE);
+        });
+    }
+
+    if (res == copy_result::UNSUPPORTED && S_ISREG(in_st.st_mode)) {
+        res = kernel_copy([&] {
+            return sendfile(out_fd, in_fd, nullptr, 1 << 30);
+        });
+    }
+
+    if (res == copy_result::UNSUPPORTED) {
+        static char buff[1 << 17];
+
+        res = kernel_copy([&] {
+            ssize_t count = read(in_fd, buff, sizeof(buff));
+            if (count > 0 && !write_full(out_fd, buff, count))
+                return (ssize_t)-1;
+            return count;
+        });
+    }
+
+    return res == copy_result::DONE;
+}
+
+int builtin_cat(const vector<string> &args)
+{
+    int exit_status = 0;
+
+    vector<string> files(args.begin() + 1, args.end());
+
+    // We never buffer, so -u has nothing to change
+    if (files.size() && files[0] == "-u")
+        files.erase(files.begin());
+
+    if (files.empty())
+        files.push_back("-");
+
+    struct stat out_st;
+    bool out_is_file = !is_virtual_fd(1) && fstat(1, &out_st) == 0 && S_ISREG(out_st.st_mode);
+
+    for (const string &file : files) {
+        if (file != "-")
+            counters->opens++;
+        int fd = file == "-" ? 0 : open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+        struct stat in_st;
+        if (fd >= 0 && out_is_file && fstat(fd, &in_st) == 0
+                && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+            // Copying a file into itself would never end
+            error_message("cat: " + file + ": input file is output file");
+            exit_status = 1;
+        }
+        else if (fd < 0 || !copy_fd(fd, 1)) {
+            error_message("cat: " + file + ": " + strerror(errno));
+            exit_status = 1;
+        }
+
+        if (fd > 0)
+            close(fd);
+    }
+
+    return exit_status;
+}
+
+// Where the innermost virtual subshell keeps the directory to go back to,
+// nullptr when nobody has to undo a cd (see cwd_snapshot)
+int *subshell_cwd = nullptr;
+
+// Bumped whenever the shell changes its working directory, so inline
+// pipelines know when a stage took the process somewhere else
+unsigned cwd_generation = 0;
+
+// Keeps the current directory in *holder, above the fds scripts use,
+// unless it already has one
+bool cwd_remember(int *holder)
+{
+    if (*holder < 0) {
+        int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            *holder = move_fd_high(fd);
+            internal_fd_register(holder);
+        }
+    }
+    return *holder >= 0;
+}
+
+int builtin_cd(const vector<string> &args)
+{
+    if (args.size() > 2) {
+        error_message("cd: too many arguments");
+        return 1;
+    }
+
+    string dir;
+    bool print_dir = false;
+
+    if (args.size() == 1) {
+        if (!xenv.has_var("HOME")) {
+            error_message("cd: HOME not set");
+            return 1;
+        }
+        dir = xenv.get_var("HOME");
+    }
+    else if (args[1] == "-") {
+        if (!xenv.has_var("OLDPWD")) {
+            error_message("cd: OLDPWD not set");
+            return 1;
+        }
+        dir = xenv.get_var("OLDPWD");
+        print_dir = true;
+    }
+    else {
+        dir = args[1];
+    }
+
+    // Remember where the subshell started
+    if (subshell_cwd && !cwd_remember(subshell_cwd)) {
+        error_message("cd: can't remember the current directory");
+        return 1;
+    }
+
+    if (chdir(dir.c_str()) < 0) {
+        error_message("cd: " + dir + ": " + strerror(errno));
+        return 1;
+    }
+    cwd_generation++;
+
+    xenv.set_var("OLDPWD", xenv.has_var("PWD") ? xenv.get_var("PWD") : "");
+    if (char *cwd = getcwd(nullptr, 0)) {
+        xenv.set_var("PWD", cwd);
+        free(cwd);
+    }
+
+    if (print_dir)
+        shell_write(1, xenv.get_var("PWD") + "\n");
+
+    return 0;
+}
+
+// Quotes a value so the shell reads it back as it is, leaving
+// harmless text alone like bash does
+string quote_for_input(const string &value)
+{
+    bool plain = true;
+    for (char c : value)
+        if (!isalnum((unsigned char)c) && !strchr("_./:,+-=@%", c))
+            plain = false;
+
+    if (plain)
+        return value;
+
+    string result = "'";
+    for (char c : value) {
+        if (c == '\'')
+            result += "'\\''";
+        else
+            result += c;
+    }
+    return result + "'";
+}
+
+int builtin_set(const vector<string> &args)
+{
+    size_t i = 1;
+
+    if (i < args.size() && args[i] == "--") {
+        i++;
+    }
+    else if (i < args.size() && args[i].size() > 1 && (args[i][0] == '-' || args[i][0] == '+')) {
+        error_message("set: " + args[i] + ": invalid option");
+        return 2;
+    }
+    else if (i == args.size()) {
+        string listing;
+        xenv.each_var([&](const string &name, const string &value) {
+            listing += name + "=" + quote_for_input(value) + "\n";
+        });
+        shell_write(1, listing);
+        return 0;
+    }
+
+    xenv.set_params(vector<string>(args.begin() + i, args.end()));
+    return 0;
+}
+
+int builtin_shift(const vector<string> &args)
+{
+    size_t count = 1;
+
+    if (args.size() > 2) {
+        error_message("shift: too many arguments");
+        return 1;
+    }
+
+    if (args.size() == 2) {
+        if (args[1].empty() || !is_digits(args[1])) {
+            error_message("shift: " + args[1] + ": numeric argument required");
+            return 1;
+        }
+        count = strtoull(args[1].c_str(), nullptr, 10);
+    }
+
+    return xenv.shift_params(count) ? 0 : 1;
+}
+
+// test and [
+
+bool is_test_unary(const string &op)
+{
+    return op.size() == 2 && op[0] == '-' && strchr("bcdefghknprstuwxzLS", op[1]);
+}
+
+bool is_test_binary(const string &op)
+{
+    for (const char *binary : {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"})
+        if (op == binary)
+            return true;
+
+    return false;
+}
+
+// The arguments of the running test and their integer fields (see
+// expand_words), so comparing $i with $n doesn't parse their text back
+struct integer_args
+{
+    const vector<string> *args = nullptr;
+    integer_fields fields;
+};
+
+integer_args test_integer_args;
+
+long long test_integer(const string &str)
+{
+    if (test_integer_args.args)
+        for (const auto &field : test_integer_args.fields)
+            if (&(*test_integer_args.args)[field.first] == &str)
+                return field.second;
+
+    const char *start = str.c_str();
+    char *end;
+
+    errno = 0;
+    long long value = strtoll(start, &end, 10);
+    while (isspace(*end))
+        end++;
+
+    if (end == start || *end || errno)
+        panic("test: " + str + ": integer expression expected");
+
+    return value;
+}
+
+bool test_unary(const string &op, const string &operand)
+{
+    struct stat st;
+
+    if (op == "-n")
+        return operand.size() > 0;
+    if (op == "-z")
+        return operand.empty();
+    if (op == "-t")
+        return isatty(test_integer(operand));
+    if (op == "-L" || op == "-h")
+        return lstat(operand.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+
+    if (stat(operand.c_str(), &st) < 0)
+        return false;
+
+    switch (op[1]) {
+    case 'e': return true;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return st.st_mode & S_ISGID;
+    case 'u': return st.st_mode & S_ISUID;
+    case 'k': return st.st_mode & S_ISVTX;
+    case 'r': return access(operand.c_str(), R_OK) == 0;
+    case 'w': return access(operand.c_str(), W_OK) == 0;
+    case 'x': return access(operand.c_str(), X_OK) == 0;
+    default: assert(0);
+    }
+}
+
+bool test_binary(const string &left, const string &op, const string &right)
+{
+    if (op == "=" || op == "==")
+        return left == right;
+    if (op == "!=")
+        return left != right;
+    if (op == "<")
+        return left < right;
+    if (op == ">")
+        return left > right;
+
+    if (op == "-nt" || op == "-ot" || op == "-ef") {
+        struct stat left_st, right_st;
+        bool has_left = stat(left.c_str(), &left_st) == 0;
+        bool has_right = stat(right.c_str(), &right_st) == 0;
+
+        if (op == "-ef")
+            return has_left && has_right && left_st.st_dev == right_st.st_dev && left_st.st_ino == right_st.st_ino;
+
+        // A missing file is older than any other
+        auto newer = [](bool has_a, const struct stat &a, bool has_b, const struct stat &b) {
+            if (!has_a || !has_b)
+                return has_a;
+            return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec
+                : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+        };
+
+        return op == "-nt" ? newer(has_left, left_st, has_right, right_st)
+            : newer(has_right, right_st, has_left, left_st);
+    }
+
+    long long a = test_integer(left);
+    long long b = test_integer(right);
+
+    if (op == "-eq") return a == b;
+    if (op == "-ne") return a != b;
+    if (op == "-lt") return a < b;
+    if (op == "-le") return a <= b;
+    if (op == "-gt") return a > b;
+    if (op == "-ge") return a >= b;
+    assert(0);
+}
+
+// Expressions longer than 4 arguments, with ! ( ) -a -o and the usual
+// precedence. Shorter ones follow the POSIX rules by argument count.
+class test_parser
+{
+    const vector<string> &args;
+    size_t pos;
+    size_t end;
+
+    bool at(const char *op)
+    {
+        return pos < end && args[pos] == op;
+    }
+
+    const string &next()
+    {
+        if (pos >= end)
+            panic("test: argument expected");
+        return args[pos++];
+    }
+
+public:
+
+    test_parser(const vector<string> &args, size_t begin, size_t end)
+        : args{args}, pos{begin}, end{end} { }
+
+    bool parse()
+    {
+        bool result = parse_or();
+        if (pos < end)
+            panic("test: " + args[pos] + ": unexpected argument");
+        return result;
+    }
+
+    bool parse_or()
+    {
+        bool result = parse_and();
+        while (at("-o")) {
+            pos++;
+            // Both sides are parsed, evaluation can't short-circuit parsing
+            bool right = parse_and();
+            result = result || right;
+        }
+        return result;
+    }
+
+    bool parse_and()
+    {
+        bool result = parse_not();
+        while (at("-a")) {
+            pos++;
+            bool right = parse_not();
+            result = result && right;
+        }
+        return result;
+    }
+
+    bool parse_not()
+    {
+        if (at("!") && pos + 1 < end) {
+            pos++;
+            return !parse_not();
+        }
+        return parse_primary();
+    }
+
+    bool parse_primary()
+    {
+        if (at("(") && pos + 1 < end) {
+            pos++;
+            bool result = parse_or();
+            if (!at(")"))
+                panic("test: `)' expected");
+            pos++;
+            return result;
+        }
+
+        if (pos + 1 < end && is_test_unary(args[pos])) {
+            const string &op = next();
+            return test_unary(op, next());
+        }
+
+        const string &left = next();
+        if (pos < end && is_test_binary(args[pos])) {
+            const string &op = next();
+            return test_binary(left, op, next());
+        }
+
+        return left.size() > 0;
+    }
+};
+
+bool test_evaluate(const vector<string> &args, size_t begin, size_t end)
+{
+    switch (end - begin) {
+    case 0:
+        return false;
+    case 1:
+        return args[begin].size() > 0;
+    case 2:
+        if (args[begin] == "!")
+            return !test_evaluate(args, begin + 1, end);
+        if (is_test_unary(args[begin]))
+            return test_unary(args[begin], args[begin + 1]);
+        panic("test: " + args[begin] + ": unary operator expected");
+    case 3:
+        if (is_test_binary(args[begin + 1]))
+            return test_binary(args[begin], args[begin + 1], args[begin + 2]);
+        if (args[begin] == "!")
+            return !test_evaluate(args, begin + 1, end);
+        if (args[begin] == "(" && args[end - 1] == ")")
+            return test_evaluate(args, begin + 1, end - 1);
+        break;
+    case 4:
+        if (args[begin] == "!")
+            return !test_evaluate(args, begin + 1, end);
+        if (args[begin] == "(" && args[end - 1] == ")")
+            return test_evaluate(args, begin + 1, end - 1);
+        break;
+    }
+
+    return test_parser(args, begin, end).parse();
+}
+
+int builtin_test(const vector<string> &args)
+{
+    size_t end = args.size();
+
+    if (args[0] == "[") {
+        if (args.back() != "]") {
+            error_message("[: missing `]'");
+            return 2;
+        }
+        end--;
+    }
+
+    try {
+        return test_evaluate(args, 1, end) ? 0 : 1;
+    }
+    catch (const shell_exception &e) {
+        error_message(e.what());
+        return 2;
+    }
+}
+
+int builtin_true(const vector<string> &)
+{
+    return 0;
+}
+
+int builtin_false(const vector<string> &)
+{
+    return 1;
+}
+
+// break and continue
+int builtin_break(const vector<string> &args)
+{
+    const string &name = args[0];
+    int levels = 1;
+
+    if (args.size() > 2) {
+        error_message(name + ": too many arguments");
+        return 1;
+    }
+
+    if (args.size() == 2) {
+        if (args[1].empty() || !is_digits(args[1])) {
+            error_message(name + ": " + args[1] + ": numeric argument required");
+            return 1;
+        }
+        levels = std::min(strtol(args[1].c_str(), nullptr, 10), (long)INT_MAX);
+        if (levels < 1) {
+            error_message(name + ": " + args[1] + ": loop count out of range");
+            return 1;
+        }
+    }
+
+    if (xenv.loop_depth == 0) {
+        error_message(name + ": only meaningful in a `for', `while', or `until' loop");
+        return 0;
+    }
+
+    xenv.pending.kind = name == "break" ? control_flow::BREAK : control_flow::CONTINUE;
+    xenv.pending.levels = std::min(levels, xenv.loop_depth);
+    return 0;
+}
 
-    for (size_t i = 0; i < str.size(); i++) {
-        char c = str[i];
+int builtin_return(const vector<string> &args)
+{
+    int status = xenv.get_last_status();
 
-        if (soft_ifs.find(c) != string::npos) {
-            if (mode == Mode::START)
-                ; // Ignore soft IFS at the beginning of input
-            if (mode == Mode::FIELD)
-                mode = Mode::SOFT_DELIMIT;
+    if (args.size() > 2) {
+        error_message("return: too many arguments");
+        return 1;
+    }
+
+    if (args.size() == 2) {
+        const char *start = args[1].c_str();
+        char *end;
+        long value = strtol(start, &end, 10);
+        if (end == start || *end) {
+            error_message("return: " + args[1] + ": numeric argument required");
+            value = 2;
         }
-        else if (hard_ifs.find(c) != string::npos) {
-            if (mode == Mode::START || mode == Mode::HARD_DELIMIT)
-                // Add an empty field
-                fields.push_back(string{});
+        status = value & 0xff;
+    }
 
-            mode = Mode::HARD_DELIMIT;
+    if (xenv.function_depth == 0 && xenv.source_depth == 0) {
+        error_message("return: can only `return' from a function or sourced script");
+        return 1;
+    }
+
+    // The status travels back as the exit status of this command
+    xenv.pending.kind = control_flow::FUNCTION_RETURN;
+    return status;
+}
+
+int builtin_eval(const vector<string> &args)
+{
+    string source;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (i > 1)
+            source += ' ';
+        source += args[i];
+    }
+
+    shared_program program;
+    try {
+        program = parsed_programs.get("eval " + source, [&] {
+            TokenReader r = TokenReader(Reader(source));
+            return parse_program(r);
+        });
+    }
+    catch (const shell_exception &e) {
+        error_message("eval: " + string(e.what()));
+        return 2;
+    }
+
+    return execute_compound_list(*program, program->program);
+}
+
+// Names without a slash are searched in PATH, then in the current
+// directory like bash does
+string find_dot_file(const string &name)
+{
+    if (name.find('/') == string::npos) {
+        for (const string &dir : path_directories(current_path_value())) {
+            string candidate = dir + "/" + name;
+            struct stat st;
+            if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), R_OK) == 0)
+                return candidate;
+        }
+    }
+
+    return name;
+}
+
+int builtin_dot(const vector<string> &args)
+{
+    if (args.size() < 2) {
+        error_message(".: filename argument required");
+        return 2;
+    }
+
+    string path = find_dot_file(args[1]);
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || access(path.c_str(), R_OK) < 0) {
+        error_message(args[1] + ": " + strerror(errno));
+        return 1;
+    }
+
+    string key = ". " + std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino)
+        + " " + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec)
+        + " " + std::to_string(st.st_size) + " " + path;
+
+    // A file changed again within the same timestamp tick would look
+    // unchanged, so files changed in the last second aren't kept
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool settled = st.st_mtim.tv_sec < now.tv_sec - 1;
+
+    shared_program program;
+    try {
+        program = parsed_programs.get(key, [&] { return parse_script(read_file(path.c_str())); }, settled);
+    }
+    catch (const shell_exception &e) {
+        error_message(args[1] + ": " + e.what());
+        return 2;
+    }
+
+    int exit_status;
+    {
+        // Arguments after the file replace the parameters while it runs
+        params_scope params;
+        if (args.size() > 2)
+            params.push(vector<string>(args.begin() + 2, args.end()));
+
+        source_scope source;
+        exit_status = execute_compound_list(*program, program->program);
+    }
+
+    if (xenv.pending.kind == control_flow::FUNCTION_RETURN)
+        xenv.pending = control_flow();
+
+    return exit_status;
+}
+
+int builtin_read(const vector<string> &args)
+{
+    bool raw = false;
+    size_t i = 1;
+
+    for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; i++) {
+        if (args[i] == "--") {
+            i++;
+            break;
+        }
+        else if (args[i] == "-r") {
+            raw = true;
         }
         else {
-            if (mode != Mode::FIELD) {
-                // Begin new field
-                fields.push_back(string{});
-                mode = Mode::FIELD;
+            error_message("read: " + args[i] + ": invalid option");
+            return 2;
+        }
+    }
+
+    vector<string> names(args.begin() + i, args.end());
+    if (names.empty())
+        names.push_back("REPLY");
+
+    // Characters escaped by a backslash are never treated as IFS
+    string line;
+    vector<bool> escaped;
+    bool complete;
+
+    while (true) {
+        string raw_line;
+        complete = input_read_line(0, raw_line);
+
+        if (raw) {
+            line.append(raw_line);
+            escaped.resize(line.size(), false);
+            break;
+        }
+
+        bool continued = false;
+        for (size_t k = 0; k < raw_line.size(); k++) {
+            if (raw_line[k] != '\\') {
+                line.push_back(raw_line[k]);
+                escaped.push_back(false);
+            }
+            else if (k + 1 < raw_line.size()) {
+                line.push_back(raw_line[++k]);
+                escaped.push_back(true);
             }
+            else {
+                // A backslash before the newline joins the next line
+                continued = complete;
+            }
+        }
 
-            fields.back().push_back(c);
+        if (!continued)
+            break;
+    }
+
+    string ifs = current_ifs();
+    auto is_ifs = [&](size_t k) { return !escaped[k] && ifs.find(line[k]) != string::npos; };
+    auto is_ifs_space = [&](size_t k) { return is_ifs(k) && isspace(line[k]); };
+
+    size_t k = 0;
+    while (k < line.size() && is_ifs_space(k))
+        k++;
+
+    for (size_t n = 0; n < names.size(); n++) {
+        string value;
+
+        if (n + 1 == names.size()) {
+            // The last name gets the rest of the line
+            size_t end = line.size();
+            while (end > k && is_ifs_space(end - 1))
+                end--;
+            value = line.substr(k, end - k);
+        }
+        else {
+            size_t start = k;
+            while (k < line.size() && !is_ifs(k))
+                k++;
+            value = line.substr(start, k - start);
+
+            // Skip the delimiter, which is IFS white space around
+            // at most one other IFS character
+            while (k < line.size() && is_ifs_space(k))
+                k++;
+            if (k < line.size() && is_ifs(k) && !isspace(line[k]))
+                k++;
+            while (k < line.size() && is_ifs_space(k))
+                k++;
         }
+
+        xenv.set_var(names[n], std::move(value));
     }
+
+    return complete ? 0 : 1;
 }
 
-string expand_dollar_or_backquote(Reader &r)
+enum class escape_mode
 {
-    if (r.at("$(("))
-        //return r.read_arithmetic_expand(false);
-        panic("arithmetic expansion not implemented");
-    else if (r.at("$("))
-        return expand_command(r.read_subshell(false));
-    else if (r.at("${"))
-        return expand_param(r.read_param_expand_in_braces(false));
-    else if (r.at('$'))
-        return expand_param(r.read_param_expand(false));
-    else if (r.at('`'))
-        return expand_command(r.read_subshell_backquote(false));
-    else
-        assert(0);
+    ECHO,       // echo -e
+    FORMAT,     // printf format strings
+    ARGUMENT,   // printf %b arguments
+};
+
+bool is_octal_digit(char c)
+{
+    return c >= '0' && c <= '7';
 }
 
-vector<string> expand_word(const string &word, bool field_splitting=true)
+// Appends str to out with its backslash escapes interpreted.
+// Returns false when \c asked to stop all output.
+bool expand_escapes(const string &str, string &out, escape_mode mode)
 {
-    Reader r(word);
-    vector<string> fields;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] != '\\' || i + 1 == str.size()) {
+            out.push_back(str[i]);
+            continue;
+        }
 
-    // TODO: deal with variable assignments that support multiple tilde-prefixes
-    if (r.at('~')) {
-        string first_part = r.read_regular_part();
-        size_t slash = first_part.find('/');
-        // This works nicely when slash is string::npos
-        string tilde_prefix = first_part.substr(1, slash - 1);
+        char c = str[++i];
+
+        if (c == 'a') out.push_back('\a');
+        else if (c == 'b') out.push_back('\b');
+        else if (c == 'e' || c == 'E') out.push_back('\033');
+        else if (c == 'f') out.push_back('\f');
+        else if (c == 'n') out.push_back('\n');
+        else if (c == 'r') out.push_back('\r');
+        else if (c == 't') out.push_back('\t');
+        else if (c == 'v') out.push_back('\v');
+        else if (c == '\\') out.push_back('\\');
+        else if (c == '"' && mode == escape_mode::FORMAT) out.push_back('"');
+        else if (c == 'c' && mode != escape_mode::FORMAT) return false;
+        else if (c == 'x' && i + 1 < str.size() && isxdigit(str[i + 1])) {
+            int value = 0;
+            for (int k = 0; k < 2 && i + 1 < str.size() && isxdigit(str[i + 1]); k++)
+                value = value * 16 + std::stoi(string{str[++i]}, nullptr, 16);
+            out.push_back(value);
+        }
+        else if (is_octal_digit(c) && (c == '0' || mode != escape_mode::ECHO)) {
+            // echo and %b take \0nnn, printf formats take \nnn
+            bool zero_prefix = c == '0' && mode != escape_mode::FORMAT;
+            int value = zero_prefix ? 0 : c - '0';
+            int digits = zero_prefix ? 3 : 2;
+            for (int k = 0; k < digits && i + 1 < str.size() && is_octal_digit(str[i + 1]); k++)
+                value = value * 8 + (str[++i] - '0');
+            out.push_back(value);
+        }
+        else {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+    }
 
-        field_append(fields, expand_tilde_prefix(tilde_prefix));
+    return true;
+}
 
-        if (slash != string::npos)
-            field_append(fields, first_part.substr(slash));
-    }
+int builtin_echo(const vector<string> &args)
+{
+    bool newline = true;
+    bool escapes = false;
+    size_t i = 1;
+
+    // Options like bash: any mix of -n, -e and -E
+    for (; i < args.size(); i++) {
+        const string &arg = args[i];
+        if (arg.size() < 2 || arg[0] != '-' || arg.find_first_not_of("neE", 1) != string::npos)
+            break;
 
-    while (!r.eof()) {
-        if (r.at('\\')) {
-            field_append(fields, r.read_slash_quote(false));
+        for (char c : arg.substr(1)) {
+            if (c == 'n')
+                newline = false;
+            else
+                escapes = c == 'e';
         }
-        else if (r.at('\'')) {
-            // Empty Quotes create empty field
-            if (fields.size() == 0)
-                fields.push_back(string{});
+    }
 
-            field_append(fields, r.read_single_quote(false));
+    string out;
+
+    for (size_t k = i; k < args.size(); k++) {
+        if (k > i)
+            out.push_back(' ');
+
+        if (!escapes)
+            out.append(args[k]);
+        else if (!expand_escapes(args[k], out, escape_mode::ECHO))
+            return shell_write(1, out) ? 0 : 1;
+    }
+
+    if (newline)
+        out.push_back('\n');
+
+    return shell_write(1, out) ? 0 : 1;
+}
+
+template<typename T>
+string format_value(const string &spec, T value)
+{
+    int size = snprintf(nullptr, 0, spec.c_str(), value);
+    string result(size, '\0');
+    snprintf(&result[0], size + 1, spec.c_str(), value);
+    return result;
+}
+
+// Numeric printf arguments, 'c gives the character code
+bool parse_printf_number(const string &arg, long long &value)
+{
+    if (arg.size() && (arg[0] == '\'' || arg[0] == '"')) {
+        value = arg.size() > 1 ? (unsigned char)arg[1] : 0;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    value = strtoll(arg.c_str(), &end, 0);
+
+    return *end == '\0' && errno == 0;
+}
+
+int builtin_printf(const vector<string> &args)
+{
+    if (args.size() < 2) {
+        error_message("printf: usage: printf format [arguments]");
+        return 2;
+    }
+
+    const string &format = args[1];
+    size_t next_arg = 2;
+    int exit_status = 0;
+    bool stop = false;
+    string out;
+
+    auto take_arg = [&]() -> string {
+        return next_arg < args.size() ? args[next_arg++] : "";
+    };
+
+    auto take_number = [&]() -> long long {
+        string arg = take_arg();
+        long long value = 0;
+        if (!parse_printf_number(arg, value)) {
+            error_message("printf: " + arg + ": invalid number");
+            exit_status = 1;
         }
-        else if (r.at('\"')) {
-            string inner_data = r.read_double_quote(false);
-            Reader r(inner_data);
+        return value;
+    };
 
-            // Empty Quotes create empty field
-            if (fields.size() == 0)
-                fields.push_back(string{});
+    // The format is reused as long as it consumes arguments
+    do {
+        size_t first_arg = next_arg;
+
+        for (size_t i = 0; i < format.size() && !stop; i++) {
+            if (format[i] == '\\') {
+                size_t end = i + 1;
+                if (end < format.size() && is_octal_digit(format[end])) {
+                    while (end < format.size() && end < i + 4 && is_octal_digit(format[end]))
+                        end++;
+                }
+                else if (end < format.size() && format[end] == 'x') {
+                    end++;
+                    while (end < format.size() && end < i + 4 && isxdigit(format[end]))
+                        end++;
+                }
+                else {
+                    end = std::min(end + 1, format.size());
+                }
+                expand_escapes(format.substr(i, end - i), out, escape_mode::FORMAT);
+                i = end - 1;
+                continue;
+            }
 
-            while (!r.eof()) {
-                if (r.at("\\$") || r.at("\\`") || r.at("\\\\"))
-                    field_append(fields,  r.read_slash_quote(false));
-                else if (r.at('$') || r.at('`'))
-                    field_append(fields, expand_dollar_or_backquote(r));
-                else
-                    field_append(fields, r.pop());
+            if (format[i] != '%') {
+                out.push_back(format[i]);
+                continue;
+            }
+
+            if (i + 1 < format.size() && format[i + 1] == '%') {
+                out.push_back('%');
+                i++;
+                continue;
+            }
+
+            // Rebuild the conversion for snprintf, filling in * from the arguments
+            string spec = "%";
+            i++;
+            while (i < format.size() && strchr("-+ #0", format[i]))
+                spec.push_back(format[i++]);
+            if (i < format.size() && format[i] == '*') {
+                spec += std::to_string(take_number());
+                i++;
+            }
+            while (i < format.size() && isdigit(format[i]))
+                spec.push_back(format[i++]);
+            if (i < format.size() && format[i] == '.') {
+                spec.push_back(format[i++]);
+                if (i < format.size() && format[i] == '*') {
+                    spec += std::to_string(take_number());
+                    i++;
+                }
+                while (i < format.size() && isdigit(format[i]))
+                    spec.push_back(format[i++]);
+            }
+
+            if (i >= format.size()) {
+                error_message("printf: " + spec + ": missing format character");
+                return 1;
+            }
+
+            char conversion = format[i];
+
+            if (conversion == 's') {
+                out += format_value(spec + "s", take_arg().c_str());
+            }
+            else if (conversion == 'b') {
+                string expanded;
+                stop = !expand_escapes(take_arg(), expanded, escape_mode::ARGUMENT);
+                out += format_value(spec + "s", expanded.c_str());
+            }
+            else if (conversion == 'c') {
+                string arg = take_arg();
+                out += format_value(spec + "c", arg.size() ? arg[0] : '\0');
+                if (arg.empty())
+                    out.pop_back();
+            }
+            else if (strchr("di", conversion)) {
+                out += format_value(spec + "ll" + conversion, take_number());
+            }
+            else if (strchr("ouxX", conversion)) {
+                out += format_value(spec + "ll" + conversion, (unsigned long long)take_number());
+            }
+            else if (strchr("eEfFgG", conversion)) {
+                string arg = take_arg();
+                char *end;
+                double value = strtod(arg.c_str(), &end);
+                if (*end) {
+                    error_message("printf: " + arg + ": invalid number");
+                    exit_status = 1;
+                }
+                out += format_value(spec + conversion, value);
+            }
+            else {
+                error_message(string("printf: %") + conversion + ": invalid format character");
+                return 1;
             }
         }
-        else if (r.at('$') || r.at('`')) {
-            string result = expand_dollar_or_backquote(r);
-            if (field_splitting)
-                field_split(fields, result);
-            else
-                field_append(fields, result);
-        }
-        else
-            field_append(fields, r.read_regular_part());
-    }
 
-    return fields;
+        if (next_arg == first_arg)
+            break;
+    } while (!stop && next_arg < args.size());
+
+    if (!shell_write(1, out))
+        return 1;
+
+    return exit_status;
 }
 
-string expand_word_no_split(const string &word)
+// Only exec without a command gets here, its redirections are kept by
+// execute_simple_command. exec with a command never returns from there.
+int builtin_exec(const vector<string> &)
 {
-    vector<string> result =  expand_word(word, false);
+    return 0;
+}
 
-    if (result.size() == 0)
-        return "";
-    else if (result.size() == 1)
-        return result[0];
-    else
-        assert(0);
+// Dumps the accounting counters, so scripts can diff them around a region
+int builtin_stats(const vector<string> &)
+{
+    return shell_write(1, format_counters()) ? 0 : 1;
+}
+
+const map<string, builtin_function> builtins
+{
+    {".", builtin_dot},
+    {":", builtin_true},
+    {"break", builtin_break},
+    {"cat", builtin_cat},
+    {"cd", builtin_cd},
+    {"continue", builtin_break},
+    {"echo", builtin_echo},
+    {"eval", builtin_eval},
+    {"exec", builtin_exec},
+    {"false", builtin_false},
+    {"printf", builtin_printf},
+    {"read", builtin_read},
+    {"return", builtin_return},
+    {"set", builtin_set},
+    {"shift", builtin_shift},
+    {"stats", builtin_stats},
+    {"test", builtin_test},
+    {"true", builtin_true},
+    {"[", builtin_test},
+};
+
+builtin_function find_builtin(const string &name)
+{
+    auto it = builtins.find(name);
+    return it == builtins.end() ? nullptr : it->second;
+}
+
+// Whether the builtin covers these arguments. cat only knows -u, so
+// anything like cat -n goes to the system cat instead.
+bool builtin_handles(const vector<string> &args)
+{
+    if (args[0] != "cat")
+        return true;
+
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i].size() > 1 && args[i][0] == '-' && !(i == 1 && args[i] == "-u"))
+            return false;
+    }
+    return true;
 }
 
-vector<string> expand_words(const vector<string> &words)
-{
-    vector<string> expanded;
+// Execution
+
+// Remembers the file descriptors replaced by redirections, so commands
+// running inside the shell process can put them back afterwards.
+class redirect_frame
+{
+    // Pairs of (fd, saved copy), the copy is -1 if the fd was closed.
+    // A deque keeps the copies in place for internal_fds.
+    std::deque<std::pair<int, int>> saved;
+
+public:
+
+    redirect_frame() = default;
+    redirect_frame(const redirect_frame &) = delete;
+    redirect_frame &operator=(const redirect_frame &) = delete;
+
+    ~redirect_frame()
+    {
+        restore();
+    }
+
+    void save(int fd)
+    {
+        for (auto &entry : saved)
+            if (entry.first == fd)
+                return;
 
-    for (const string &word : words) {
-        vector<string> fields = expand_word(word);
-        expanded.insert(expanded.end(), fields.begin(), fields.end());
+        int copy = fcntl(fd, F_DUPFD_CLOEXEC, INTERNAL_FD_BASE);
+        if (copy < 0 && errno != EBADF)
+            panic("saving file descriptor failed");
+
+        saved.push_back({fd, copy});
+        internal_fd_register(&saved.back().second);
     }
 
-    return expanded;
-}
+    void restore()
+    {
+        if (!saved.empty())
+            output_forget_fds();
+
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            input_release(it->first);
+            if (it->second >= 0) {
+                internal_fd_evict(it->first);
+                dup2(it->second, it->first);
+                internal_fd_close(&it->second);
+            }
+            else {
+                close(it->first);
+            }
+        }
 
-// Execution
+        saved.clear();
+    }
+};
 
-bool execute_redirect(const ast_redirect &redirect)
+// Where exec saves the fds it replaces: the frame of the innermost virtual
+// subshell, as they would have gone away with a forked subshell. At the
+// top it is nullptr and they last.
+redirect_frame *exec_frame = nullptr;
+
+bool execute_redirect(const ast_pool &pool, const ast_redirect &redirect, redirect_frame *frame = nullptr)
 {
+    const string &lhs = pool.str(redirect.lhs);
+    const string &op = pool.str(redirect.op);
+    const string &rhs = pool.str(redirect.rhs);
     int left_fd;
 
-    if (redirect.lhs.size()) {
-        left_fd = str_to_int(redirect.lhs.c_str());
+    if (lhs.size()) {
+        left_fd = str_to_int(lhs.c_str());
     }
-    else if (redirect.op == "<" || redirect.op == "<&" || redirect.op == "<>") {
+    else if (op == "<" || op == "<&" || op == "<>") {
         left_fd = 0;
     }
-    else if (redirect.op == ">" || redirect.op == ">&" || redirect.op == ">>" || redirect.op == ">|") {
+    else if (op == ">" || op == ">&" || op == ">>" || op == ">|") {
         left_fd = 1;
     }
     else {
         assert(0);
     }
 
-    if (redirect.op == "<&" || redirect.op == ">&") {
-        if (redirect.rhs == "-") {
-            close(left_fd);
+    bool duplicates = op == "<&" || op == ">&";
+    string target;
+    int right_fd = -1;
+
+    if (duplicates) {
+        target = expand_word_no_split(rhs);
+        // Only an open fd of the script can be duplicated
+        if (target != "-") {
+            right_fd = !target.empty() && is_digits(target) ? str_to_int(target.c_str()) : -1;
+            if (right_fd < 0 || is_internal_fd(right_fd) || fcntl(right_fd, F_GETFD) < 0) {
+                error_message(target + ": bad file descriptor");
+                return false;
+            }
         }
-        else {
-            int right_fd = str_to_int(redirect.rhs.c_str());
+    }
+
+    // Moving an internal fd away first, the frame then sees it as closed
+    internal_fd_evict(left_fd);
+    if (frame)
+        frame->save(left_fd);
+    input_release(left_fd);
+    output_forget_fds();
+
+    if (duplicates) {
+        if (target == "-")
+            close(left_fd);
+        else
             dup2(right_fd, left_fd);
-        }
     }
     else {
         int flags = 0;
 
-        if (redirect.op == "<")
+        if (op == "<")
             flags = O_RDONLY;
-        else if (redirect.op == ">" || redirect.op == ">|")
+        else if (op == ">" || op == ">|")
             flags = O_WRONLY | O_CREAT | O_TRUNC;
-        else if (redirect.op == ">>")
+        else if (op == ">>")
             flags = O_WRONLY | O_CREAT | O_APPEND;
-        else if (redirect.op == "<>")
+        else if (op == "<>")
             flags = O_RDWR | O_CREAT;
         else
             assert(0);
         
-        vector<string> results = expand_word(redirect.rhs);
+        vector<string> results = expand_word(rhs);
         if (results.size() != 1)
             panic("ambiguous redirect");
 
+        counters->opens++;
         int right_fd = open(results[0].c_str(), flags, 0666);
         if (right_fd < 0) {
             error_message(results[0] + ": file open failed");
             return false;
         }
-        dup2(right_fd, left_fd);
-        close(right_fd);
+        if (right_fd != left_fd) {
+            dup2(right_fd, left_fd);
+            close(right_fd);
+        }
     }
 
     return true;
 }
 
-void execute_assignment(const string &assignment_word, bool export_var)
+// Applies the redirections of a command that runs in the shell process
+bool execute_redirects(const ast_pool &pool, ast_range redirections, redirect_frame &frame)
+{
+    for (const ast_redirect &redirect : pool.redirects_of(redirections))
+        if (!execute_redirect(pool, redirect, &frame))
+            return false;
+
+    return true;
+}
+
+void execute_assignment(const ast_pool &pool, ast_index assignment, bool export_var)
 {
     // TODO: Handle exporting of variables when assigning before simple command
+    const string &assignment_word = pool.str(assignment);
     size_t equals = assignment_word.find_first_of('=');
     assert(equals != string::npos);
 
     string name = assignment_word.substr(0, equals);
-    string value = expand_word_no_split(assignment_word.substr(equals + 1));
+    ast_index literal_value = pool.string_info[assignment].assigned_value;
+
+    if (literal_value != NO_INDEX) {
+        xenv.set_var(name, pool.literal_values[literal_value]);
+        if (export_var)
+            xenv.mark_export(name);
+        return;
+    }
 
-    xenv.set_var(name, value);
+    string value_word = assignment_word.substr(equals + 1);
+    string suffix;
+    string expr;
+
+    if (is_name(name) && is_lone_arithmetic(value_word, expr))
+        xenv.set_var_number(name, expand_arithmetic(expr));
+    else if (is_name(name) && is_self_append(name, value_word, suffix) && xenv.has_var(name))
+        xenv.append_var(name, expand_word_no_split(suffix));
+    else
+        xenv.set_var(name, expand_word_shared(value_word));
     if (export_var)
         xenv.mark_export(name);
 }
 
-int execute_compound_list(const ast_compound_list &compound_list);
+int execute_brace_group(const ast_pool &pool, const ast_brace_group &brace_group)
+{
+    redirect_frame frame;
+    if (!execute_redirects(pool, brace_group.redirections, frame))
+        return 1;
+
+    return execute_compound_list(pool, brace_group.commands);
+}
+
+// True while a break, continue or return makes the commands around it stop
+bool control_flow_pending()
+{
+    return xenv.pending.kind != control_flow::NONE;
+}
+
+// Loops check this after running their condition or body. Returns true
+// when the loop has to stop, and consumes the break or continue that was
+// meant for this loop.
+bool loop_interrupted()
+{
+    control_flow &pending = xenv.pending;
+
+    if (pending.kind == control_flow::NONE)
+        return false;
+    if (pending.kind == control_flow::FUNCTION_RETURN)
+        return true;
+
+    if (pending.levels > 1) {
+        // Meant for an outer loop
+        pending.levels--;
+        return true;
+    }
+
+    bool stop = pending.kind == control_flow::BREAK;
+    pending = control_flow();
+    return stop;
+}
+
+struct loop_scope
+{
+    loop_scope() { xenv.loop_depth++; }
+    ~loop_scope() { xenv.loop_depth--; }
+};
 
-int execute_function_call(const ast_function_definition &function_definition)
+int execute_function_call(const shell_function &function)
 {
-    return execute_compound_list(function_definition.body.commands);
+    int outer_loop_depth = xenv.loop_depth;
+    xenv.loop_depth = 0;
+    xenv.function_depth++;
+
+    function_code code = function_body(function);
+    int exit_status = execute_brace_group(code.pool, code.body);
+
+    xenv.function_depth--;
+    xenv.loop_depth = outer_loop_depth;
+
+    if (xenv.pending.kind == control_flow::FUNCTION_RETURN)
+        xenv.pending = control_flow();
+
+    return exit_status;
 }
 
-int execute_simple_command(const ast_simple_command &simple_command)
+int execute_simple_command(const ast_pool &pool, const ast_simple_command &simple_command)
 {
     enum class CmdType
     {
@@ -1603,18 +7038,62 @@ int execute_simple_command(const ast_simple_command &simple_command)
 
     CmdType type;
 
-    vector<string> expanded_args = expand_words(simple_command.args);
+    // A function called as f "$@" gets the caller's parameters as they are,
+    // without expanding them into words first
+    last_substitution_status = 0;
+
+    ast_words words = pool.words_of(simple_command.args);
+    bool passes_params = words.size() == 2 && (words[1] == "\"$@\"" || words[1] == "\"${@}\"");
+    // test and [ get the integers of their integer variables
+    bool tests = words.size() && (words[0] == "[" || words[0] == "test");
+    integer_fields integers;
+    vector<string> expanded_args = passes_params ? expand_word(words[0]) : expand_words(pool, simple_command.args, tests ? &integers : nullptr);
+
+    if (passes_params && !(expanded_args.size() == 1 && xenv.has_func(expanded_args[0]))) {
+        passes_params = false;
+        vector<string> params = expand_word(words[1]);
+        expanded_args.insert(expanded_args.end(), std::make_move_iterator(params.begin()), std::make_move_iterator(params.end()));
+    }
 
     if (expanded_args.size() == 0)
         type = CmdType::EMPTY;
     else if (xenv.has_func(expanded_args[0]))
         type = CmdType::FUNCTION;
+    else if (find_builtin(expanded_args[0]) && builtin_handles(expanded_args))
+        type = CmdType::BUILTIN;
     else
         type = CmdType::EXEC;
 
-    if (type == CmdType::EXEC) {
+    // exec with a command becomes that command without forking, there is
+    // nothing to come back to
+    bool replaces_shell = type == CmdType::BUILTIN && expanded_args[0] == "exec" && expanded_args.size() > 1;
+    if (replaces_shell) {
+        expanded_args.erase(expanded_args.begin());
+        type = CmdType::EXEC;
+    }
+
+    // exec alone applies its redirections to the shell itself
+    bool keeps_redirections = type == CmdType::BUILTIN && expanded_args[0] == "exec";
+
+    string command_path;
+
+    if (type == CmdType::EXEC && replaces_shell) {
+        if (simple_command.assignments.empty())
+            command_path = find_command(expanded_args[0]);
+    }
+    else if (type == CmdType::EXEC) {
+        // Search in the parent, so the command hash outlives the child.
+        // Assignments may change PATH, so then we search in the child.
+        if (simple_command.assignments.empty()) {
+            command_path = find_command(expanded_args[0]);
+        }
+
         // Fork, so the assignments and redirections are local
-        pid_t pid = fork();
+        std::unique_ptr<process_bridge> bridge;
+        if (process_bridge::needed())
+            bridge = std::make_unique<process_bridge>();
+
+        pid_t pid = shell_fork();
 
         if (pid < 0) {
             panic("fork failed");
@@ -1622,19 +7101,26 @@ int execute_simple_command(const ast_simple_command &simple_command)
 
         if (pid > 0) {
             // Parent
-            int wstatus;
-            waitpid(pid, &wstatus, 0);
-            return WEXITSTATUS(wstatus);
+            return WEXITSTATUS(bridge ? bridge->run(pid) : children.wait(pid));
         }
+
+        if (bridge)
+            bridge->connect_child();
     }
     else {
         // When there is no command to execute, we don't fork so the assignments
         // will change the current execution environment.
     }
 
-    // TODO: For empty commands, redirect in subshell
-    for (const ast_redirect &redirect : simple_command.redirections) {
-        if (!execute_redirect(redirect)) {
+    // Everything but external commands runs in the shell process,
+    // so the redirections have to be undone afterwards
+    redirect_frame frame;
+    bool in_process = type != CmdType::EXEC;
+
+    redirect_frame *target_frame = keeps_redirections ? exec_frame : in_process ? &frame : nullptr;
+
+    for (const ast_redirect &redirect : pool.redirects_of(simple_command.redirections)) {
+        if (!execute_redirect(pool, redirect, target_frame)) {
             if (type == CmdType::EXEC)
                 exit(1);
             else
@@ -1642,42 +7128,140 @@ int execute_simple_command(const ast_simple_command &simple_command)
         }
     }
 
-    for (const string &assignment : simple_command.assignments)
-        execute_assignment(assignment, type == CmdType::EXEC);
+    // Assignments before a builtin only last for the builtin
+    vector<std::pair<string, var>> saved_vars;
+    vector<string> unset_vars;
+
+    if (type == CmdType::BUILTIN) {
+        for (const string &assignment : pool.words_of(simple_command.assignments)) {
+            string name = assignment.substr(0, assignment.find('='));
+            if (xenv.has_var(name))
+                saved_vars.push_back({name, xenv.get_var_entry(name)});
+            else
+                unset_vars.push_back(name);
+        }
+    }
+
+    for (ast_index assignment : ast_pool::slice(pool.words, simple_command.assignments))
+        execute_assignment(pool, assignment, type == CmdType::EXEC);
     
     if (type == CmdType::EXEC) {
         // Child
-        vector<const char*> argv;
-        for (auto& arg : expanded_args)
-            argv.push_back(arg.c_str());
-        argv.push_back(nullptr);
+        if (!simple_command.assignments.empty())
+            command_path = find_command(expanded_args[0]);
 
-        // execve doesn't modify its arguments, so it should be safe
-        char ** argv_ptr = const_cast<char **>(&argv[0]);
+        exec_command(command_path, expanded_args);
+    }
+    else if (type == CmdType::BUILTIN) {
+        if (tests)
+            test_integer_args = {&expanded_args, std::move(integers)};
+        int exit_status = find_builtin(expanded_args[0])(expanded_args);
+        test_integer_args = integer_args();
+
+        // Write errors of redirected output still reach the exit status
+        if (!simple_command.redirections.empty() && !output_flush())
+            exit_status = 1;
 
-        execvp(argv[0], argv_ptr);
-        // execve failed
-        error_message(string("error executing ") + argv[0]);
-        exit(1);
+        for (auto it = saved_vars.rbegin(); it != saved_vars.rend(); ++it)
+            xenv.set_var_entry(it->first, it->second);
+        for (const string &name : unset_vars)
+            xenv.unset_var(name);
+
+        return exit_status;
     }
     else if (type == CmdType::FUNCTION) {
-        vector<string> args{expanded_args.begin() + 1, expanded_args.end()};
-        xenv.push_args(args);
-        int exit_status = execute_function_call(xenv.get_func(expanded_args[0]));
-        xenv.pop_args();
-        return exit_status;
+        params_scope params;
+        if (passes_params) {
+            params.push(positional_params(xenv.params()));
+        }
+        else {
+            params.push(vector<string>(std::make_move_iterator(expanded_args.begin() + 1),
+                std::make_move_iterator(expanded_args.end())));
+        }
+        auto function = xenv.get_func(expanded_args[0]);
+        return execute_function_call(*function);
     }
     else if (type == CmdType::EMPTY) {
-        return 0;
+        return last_substitution_status;
     }
     else {
         assert(0);
     }
 }
 
-int execute_subshell(const ast_subshell &subshell)
+// Puts the working directory back when a virtual subshell ends,
+// if a cd changed it in between
+class cwd_snapshot
 {
-    pid_t pid = fork();
+    int fd = -1;
+    int *outer;
+
+public:
+
+    cwd_snapshot() : outer(subshell_cwd)
+    {
+        subshell_cwd = &fd;
+    }
+
+    ~cwd_snapshot()
+    {
+        if (fd >= 0) {
+            if (fchdir(fd) < 0)
+                error_message("can't restore the working directory");
+            cwd_generation++;
+            internal_fd_close(&fd);
+        }
+        subshell_cwd = outer;
+    }
+};
+
+bool runs_in_process(const ast_pool &pool, ast_compound_list compound_list, int depth, bool allow_redirections);
+
+// Subshells only fork when their body might start another process
+bool subshell_runs_in_process(const ast_pool &pool, ast_compound_list commands, bool allow_redirections)
+{
+    return !getenv("POSIX_SHELL_FORK_SUBSHELLS") && runs_in_process(pool, commands, 0, allow_redirections);
+}
+
+// Runs a subshell body in the shell process, and rolls back what a forked
+// subshell would have kept to itself: the environment (a cheap copy, see
+// ex_env), the working directory and the file descriptors. With capture,
+// the output goes there, like the pipe of a command substitution.
+int execute_virtual_subshell(const ast_pool &pool, ast_compound_list commands, ast_range redirections, string *capture)
+{
+    ex_env saved_env = xenv;
+    xenv.loop_depth = 0;
+    cwd_snapshot cwd;
+    string *outer_capture = captured_stdout;
+    if (capture)
+        captured_stdout = capture;
+
+    redirect_frame *outer_exec_frame = exec_frame;
+    int exit_status;
+
+    try {
+        redirect_frame frame;
+        exec_frame = &frame;
+        exit_status = execute_redirects(pool, redirections, frame) ? execute_compound_list(pool, commands) : 1;
+    }
+    catch (const shell_exception &e) {
+        // A forked subshell would have died here, not the whole shell
+        error_message(e.what());
+        exit_status = 1;
+    }
+
+    exec_frame = outer_exec_frame;
+    captured_stdout = outer_capture;
+    xenv = std::move(saved_env);
+    return exit_status;
+}
+
+int execute_subshell(const ast_pool &pool, const ast_subshell &subshell)
+{
+    if (subshell_runs_in_process(pool, subshell.commands, true))
+        return execute_virtual_subshell(pool, subshell.commands, subshell.redirections, nullptr);
+
+    pid_t pid = shell_fork();
 
     if (pid < 0) {
         panic("fork failed");
@@ -1685,124 +7269,545 @@ int execute_subshell(const ast_subshell &subshell)
 
     if (pid > 0) {
         // Parent
-        int wstatus;
-        waitpid(pid, &wstatus, 0);
-        return WEXITSTATUS(wstatus);
+        return WEXITSTATUS(children.wait(pid));
+    }
+
+    for (const ast_redirect &redirect : pool.redirects_of(subshell.redirections))
+        if (!execute_redirect(pool, redirect))
+            exit(1);
+
+    exit(execute_compound_list(pool, subshell.commands));
+}
+
+int execute_for_clause(const ast_pool &pool, const ast_for_clause &for_clause)
+{
+    redirect_frame frame;
+    if (!execute_redirects(pool, for_clause.redirections, frame))
+        return 1;
+
+    int exit_status = 0;
+    const string &var_name = pool.str(for_clause.var_name);
+    ast_words wordlist = pool.words_of(for_clause.wordlist);
+
+    if (wordlist.size() == 1 && wordlist[0] == "\"$@\"") {
+        // Loops over the parameters without copying them, the body
+        // can't change them under us
+        positional_params params = xenv.params();
+        loop_scope loop;
+        for (size_t i = 0; i < params.size(); i++) {
+            xenv.set_var(var_name, params[i]);
+            exit_status = execute_compound_list(pool, for_clause.body);
+            if (loop_interrupted())
+                break;
+        }
+        return exit_status;
+    }
+
+    const ast_loop_info &info = pool.for_loops[&for_clause - pool.for_clauses.data()];
+
+    if (info.literal_words) {
+        // The values are shared with the pool, no copies per iteration
+        loop_scope loop;
+        invariant_scope invariants(pool, info);
+        for (ast_index word : ast_pool::slice(pool.words, for_clause.wordlist)) {
+            xenv.set_var(var_name, pool.literal_values[pool.string_info[word].value]);
+            exit_status = execute_compound_list(pool, for_clause.body);
+            if (loop_interrupted())
+                break;
+        }
+        return exit_status;
+    }
+
+    std::unique_ptr<command_stream> stream;
+    if (info.streams)
+        stream = stream_command(pool.str(pool.words[for_clause.wordlist.begin]));
+
+    if (stream) {
+        loop_scope loop;
+        invariant_scope invariants(pool, info);
+        string field;
+        while (stream->next(field)) {
+            xenv.set_var(var_name, std::move(field));
+            exit_status = execute_compound_list(pool, for_clause.body);
+            if (loop_interrupted())
+                break;
+        }
+        return exit_status;
+    }
+
+    vector<string> words = expand_words(pool, for_clause.wordlist);
+    loop_scope loop;
+    invariant_scope invariants(pool, info);
+    for (string &word : words) {
+        xenv.set_var(var_name, std::move(word));
+        exit_status = execute_compound_list(pool, for_clause.body);
+        if (loop_interrupted())
+            break;
+    }
+
+    return exit_status;
+}
+
+int execute_case_clause(const ast_pool &pool, const ast_case_clause &case_clause)
+{
+    redirect_frame frame;
+    if (!execute_redirects(pool, case_clause.redirections, frame))
+        return 1;
+
+    int exit_status = 0;
+    
+    const string &value = pool.str(case_clause.value);
+    string expanded_value = pool.string_info[case_clause.value].literal ? value : expand_word_no_split(value);
+
+    for (const ast_case_item &item : pool.case_items_of(case_clause.items)) {
+        bool matched = false;
+
+        for (ast_index pattern : ast_pool::slice(pool.words, item.patterns)) {
+            const string &pattern_word = pool.str(pattern);
+            const string &expanded_pattern = pool.string_info[pattern].literal ? pattern_word : expand_pattern(pattern_word);
+            if (pattern_match(*find_pattern(expanded_pattern), expanded_value)) {
+                matched = true;
+                break;
+            }
+        }
+
+        if (matched) {
+            exit_status = execute_compound_list(pool, item.body);
+            break;
+        }
     }
 
-    exit(execute_compound_list(subshell.commands));
+    return exit_status;
+}
+
+int execute_if_clause(const ast_pool &pool, const ast_if_clause &if_clause)
+{
+    redirect_frame frame;
+    if (!execute_redirects(pool, if_clause.redirections, frame))
+        return 1;
+
+    ast_slice<ast_compound_list> conditions = pool.lists_of(if_clause.conditions);
+    ast_slice<ast_compound_list> bodies = pool.lists_of(if_clause.bodies);
+
+    for (size_t i = 0; i < conditions.size(); i++) {
+        int condition_status = execute_compound_list(pool, conditions[i]);
+        if (control_flow_pending())
+            return condition_status;
+        if (condition_status == 0)
+            return execute_compound_list(pool, bodies[i]);
+    }
+    
+    // Else
+    if (bodies.size() > conditions.size()) {
+        assert(bodies.size() == conditions.size() + 1);
+        return execute_compound_list(pool, bodies[conditions.size()]);
+    }
+    else {
+        return 0;
+    }
 }
 
-int execute_for_clause(const ast_for_clause &for_clause)
+int execute_while_clause(const ast_pool &pool, const ast_while_clause &while_clause)
 {
+    redirect_frame frame;
+    if (!execute_redirects(pool, while_clause.redirections, frame))
+        return 1;
+
     int exit_status = 0;
+    loop_scope loop;
+    invariant_scope invariants(pool, pool.while_loops[&while_clause - pool.while_clauses.data()]);
+
+    while (true) {
+        int condition_status = execute_compound_list(pool, while_clause.condition);
+        if (control_flow_pending()) {
+            if (loop_interrupted())
+                break;
+            continue;
+        }
+
+        if ((condition_status == 0) != !while_clause.until)
+            break;
+
+        exit_status = execute_compound_list(pool, while_clause.body);
+        if (loop_interrupted())
+            break;
+    }
+
+    return exit_status;
+}
+
+// The function keeps the whole pool of its definition alive
+int execute_function_definition(const ast_pool &pool, const ast_function_definition &function_definition)
+{
+    shell_function function;
+    function.pool = pool.shared_from_this();
+    function.body = function_definition.body;
+
+    if (function_definition.body == NO_INDEX) {
+        function.lazy = std::make_shared<lazy_function_body>();
+        function.lazy->source = pool.str(function_definition.lazy_source);
+    }
+
+    xenv.set_func(pool.str(function_definition.name), function);
+
+    return 0;
+}
+
+int execute_command(const ast_pool &pool, const ast_command &command)
+{
+    phase_scope phase(PHASE_EXEC);
+    switch (command.kind) {
+    case ast_kind::SIMPLE_COMMAND:
+        return execute_simple_command(pool, pool.simple_commands[command.index]);
+    case ast_kind::BRACE_GROUP:
+        return execute_brace_group(pool, pool.brace_groups[command.index]);
+    case ast_kind::SUBSHELL:
+        return execute_subshell(pool, pool.subshells[command.index]);
+    case ast_kind::FOR_CLAUSE:
+        return execute_for_clause(pool, pool.for_clauses[command.index]);
+    case ast_kind::CASE_CLAUSE:
+        return execute_case_clause(pool, pool.case_clauses[command.index]);
+    case ast_kind::IF_CLAUSE:
+        return execute_if_clause(pool, pool.if_clauses[command.index]);
+    case ast_kind::WHILE_CLAUSE:
+        return execute_while_clause(pool, pool.while_clauses[command.index]);
+    case ast_kind::FUNCTION_DEFINITION:
+        return execute_function_definition(pool, pool.function_definitions[command.index]);
+    default:
+        panic("command type execution not implemented");
+    }
+}
+
+// Static check that running a command can't start another process, so any
+// file descriptor it reads is private to the shell. Function calls are
+// checked against the functions defined right now. When in doubt, say no.
+// Without allow_redirections, the command also can't touch the real fds.
+
+bool word_has_substitution(const string &word)
+{
+    return word.find("$(") != string::npos || word.find('`') != string::npos;
+}
+
+bool words_have_substitution(const ast_words &words)
+{
+    for (const string &word : words)
+        if (word_has_substitution(word))
+            return true;
+
+    return false;
+}
+
+bool redirections_allowed(const ast_pool &pool, ast_range redirections, bool allow_redirections)
+{
+    if (!allow_redirections)
+        return redirections.empty();
+
+    for (const ast_redirect &redirect : pool.redirects_of(redirections))
+        if (word_has_substitution(pool.str(redirect.rhs)))
+            return false;
+
+    return true;
+}
+
+bool runs_in_process(const ast_pool &pool, ast_compound_list compound_list, int depth, bool allow_redirections);
+
+bool runs_in_process(const ast_pool &pool, const ast_command &command, int depth, bool allow_redirections)
+{
+    if (depth > 8)
+        return false;
+
+    switch (command.kind) {
+    case ast_kind::SIMPLE_COMMAND: {
+        const ast_simple_command &simple_command = pool.simple_commands[command.index];
+        ast_words args = pool.words_of(simple_command.args);
 
-    if (for_clause.wordlist.size() == 0)
-        panic("for with no wordlist not implemented");
+        if (words_have_substitution(pool.words_of(simple_command.assignments)) || words_have_substitution(args)
+                || !redirections_allowed(pool, simple_command.redirections, allow_redirections))
+            return false;
+
+        if (args.empty())
+            return true;
+
+        const string &name = args[0];
+        if (name.find_first_of("$\\'\"~") != string::npos)
+            return false;
+
+        // exec with a command would replace the shell
+        if (name == "exec")
+            return args.size() == 1;
+
+        // What these run is only known when they run
+        if (name == "eval" || name == ".")
+            return false;
+
+        if (xenv.has_func(name)) {
+            auto function = xenv.get_func(name);
+            function_code code = function_body(*function);
+            return redirections_allowed(code.pool, code.body.redirections, allow_redirections)
+                && runs_in_process(code.pool, code.body.commands, depth + 1, allow_redirections);
+        }
+
+        return find_builtin(name) != nullptr;
+    }
+    case ast_kind::BRACE_GROUP: {
+        const ast_brace_group &brace_group = pool.brace_groups[command.index];
+        return redirections_allowed(pool, brace_group.redirections, allow_redirections)
+            && runs_in_process(pool, brace_group.commands, depth, allow_redirections);
+    }
+    case ast_kind::FOR_CLAUSE: {
+        const ast_for_clause &for_clause = pool.for_clauses[command.index];
+        return !words_have_substitution(pool.words_of(for_clause.wordlist))
+            && redirections_allowed(pool, for_clause.redirections, allow_redirections)
+            && runs_in_process(pool, for_clause.body, depth, allow_redirections);
+    }
+    case ast_kind::CASE_CLAUSE: {
+        const ast_case_clause &case_clause = pool.case_clauses[command.index];
+        if (word_has_substitution(pool.str(case_clause.value)) || !redirections_allowed(pool, case_clause.redirections, allow_redirections))
+            return false;
+        for (const ast_case_item &item : pool.case_items_of(case_clause.items))
+            if (words_have_substitution(pool.words_of(item.patterns)) || !runs_in_process(pool, item.body, depth, allow_redirections))
+                return false;
+        return true;
+    }
+    case ast_kind::IF_CLAUSE: {
+        const ast_if_clause &if_clause = pool.if_clauses[command.index];
+        if (!redirections_allowed(pool, if_clause.redirections, allow_redirections))
+            return false;
+        for (ast_compound_list condition : pool.lists_of(if_clause.conditions))
+            if (!runs_in_process(pool, condition, depth, allow_redirections))
+                return false;
+        for (ast_compound_list body : pool.lists_of(if_clause.bodies))
+            if (!runs_in_process(pool, body, depth, allow_redirections))
+                return false;
+        return true;
+    }
+    case ast_kind::WHILE_CLAUSE: {
+        const ast_while_clause &while_clause = pool.while_clauses[command.index];
+        return redirections_allowed(pool, while_clause.redirections, allow_redirections)
+            && runs_in_process(pool, while_clause.condition, depth, allow_redirections)
+            && runs_in_process(pool, while_clause.body, depth, allow_redirections);
+    }
+    case ast_kind::FUNCTION_DEFINITION:
+        return true;
+    default:
+        // Subshells fork
+        return false;
+    }
+}
 
-    for (const string &word : expand_words(for_clause.wordlist)) {
-        xenv.set_var(for_clause.var_name, word);
-        exit_status = execute_compound_list(for_clause.body);
+bool runs_in_process(const ast_pool &pool, ast_compound_list compound_list, int depth, bool allow_redirections)
+{
+    for (const ast_and_or &and_or : pool.and_ors_of(compound_list)) {
+        if (and_or.async)
+            return false;
+
+        for (const ast_pipeline &pipeline : pool.pipelines_of(and_or)) {
+            ast_slice<ast_command> commands = pool.commands_of(pipeline);
+            if (commands.size() != 1 || !runs_in_process(pool, commands[0], depth, allow_redirections))
+                return false;
+        }
     }
 
-    return exit_status;
+    return true;
 }
 
-int execute_case_clause(const ast_case_clause &case_clause)
-{
-    int exit_status = 0;
-    
-    string expanded_value = expand_word_no_split(case_clause.value);
-
-    for (size_t i = 0; i < case_clause.patterns.size(); i++) {
-        const vector<string> &patterns = case_clause.patterns[i];
-
-        bool matched = false;
+// Inline pipelines
+//
+// Pipelines whose stages are all builtins and functions run as coroutines
+// in the shell process instead of forking. A stage runs until it blocks on
+// a ring, then the next one gets a turn. Every stage works on its own copy
+// of the execution environment, like the subshell it would be with fork.
+// Stages can't have redirections, as these would change the real fds under
+// the other stages. A stage may cd though: the scheduler notes where a
+// stage went and takes the process there whenever that stage runs.
 
-        for (const string &pattern : patterns) {
-            string expanded_pattern = expand_word_no_split(pattern);
-            // TODO: Implement pattern matching
-            if (expanded_pattern == expanded_value) {
-                matched = true;
-                break;
-            }
-        }
+const size_t INLINE_STAGE_STACK_SIZE = 1 << 20;
+const size_t INLINE_STAGE_GUARD_SIZE = 1 << 12;
 
-        if (matched) {
-            exit_status = execute_compound_list(case_clause.bodies[i]);
-            break;
-        }
-    }
+struct inline_stage
+{
+    const ast_pool *pool;
+    const ast_command *command;
+    ex_env env;
+    redirect_frame *exec_frame;
+    loop_invariants *invariant_frame;
+    int *subshell_cwd;
+    // The directory of the stage after a cd, -1 while it is where the
+    // pipeline started
+    int cwd;
+    ring_pipe *in;
+    ring_pipe *out;
+    // What the stage waits for when it yields outside of a ring
+    vector<pollfd> wait_fds;
+    ucontext_t context;
+    void *stack;
+    bool done;
+    int exit_status;
+};
 
-    return exit_status;
-}
+vector<inline_stage> *inline_stages = nullptr;
 
-int execute_if_clause(const ast_if_clause &if_clause)
+void inline_stage_main(int index)
 {
-    for (size_t i = 0; i < if_clause.conditions.size(); i++)
-        if (execute_compound_list(if_clause.conditions[i]) == 0)
-            return execute_compound_list(if_clause.bodies[i]);
-    
-    // Else
-    if (if_clause.bodies.size() > if_clause.conditions.size()) {
-        assert(if_clause.bodies.size() == if_clause.conditions.size() + 1);
-        return execute_compound_list(if_clause.bodies.back());
+    inline_stage &stage = (*inline_stages)[index];
+
+    // Nothing may be thrown across the coroutine boundary
+    try {
+        stage.exit_status = execute_command(*stage.pool, *stage.command);
     }
-    else {
-        return 0;
+    catch (const ring_broken_pipe &) {
+        stage.exit_status = 128 + SIGPIPE;
     }
+    catch (const std::exception &e) {
+        error_message(e.what());
+        stage.exit_status = 1;
+    }
+
+    stage.done = true;
+    inline_progress++;
+    if (stage.out)
+        stage.out->writer_closed = true;
+    if (stage.in)
+        stage.in->reader_closed = true;
+
+    // Returning resumes the scheduler through uc_link
 }
 
-int execute_while_clause(const ast_while_clause &while_clause)
+// Called after a round in which no stage moved anything: only an fd can
+// change that, so sleep until one of the fds the stages wait for is ready
+void inline_wait(vector<inline_stage> &stages)
 {
-    int exit_status = 0;
-
-    while ((execute_compound_list(while_clause.condition) == 0) == !while_clause.until) {
-        exit_status = execute_compound_list(while_clause.body);
-    }
+    vector<pollfd> fds;
+    for (const inline_stage &stage : stages)
+        if (!stage.done)
+            fds.insert(fds.end(), stage.wait_fds.begin(), stage.wait_fds.end());
 
-    return exit_status;
+    if (fds.size() && poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+        panic("poll failed");
 }
 
-int execute_function_definition(const ast_function_definition &function_definition)
+bool pipeline_runs_inline(const ast_pool &pool, const ast_pipeline &pipeline)
 {
-    xenv.set_func(function_definition.name, function_definition);
+    if (getenv("POSIX_SHELL_FORK_PIPELINES"))
+        return false;
 
-    return 0;
+    for (const ast_command &command : pool.commands_of(pipeline))
+        if (!runs_in_process(pool, command, 0, false))
+            return false;
+
+    return true;
 }
 
-int execute_command(const ast_command &command)
+int execute_inline_pipeline(const ast_pool &pool, ast_slice<ast_command> commands)
 {
-    if (std::holds_alternative<ast_simple_command>(command.cmd)) {
-        return execute_simple_command(std::get<ast_simple_command>(command.cmd));
-    }
-    else if (std::holds_alternative<ast_brace_group>(command.cmd)) {
-        return execute_compound_list(std::get<ast_brace_group>(command.cmd).commands);
-    }
-    else if (std::holds_alternative<ast_subshell>(command.cmd)) {
-        return execute_subshell(std::get<ast_subshell>(command.cmd));
+    size_t count = commands.size();
+    vector<ring_pipe> rings(count - 1);
+    // A cd in a stage must not outlive the pipeline
+    cwd_snapshot cwd;
+    vector<inline_stage> stages(count);
+
+    for (size_t i = 0; i < count; i++) {
+        inline_stage &stage = stages[i];
+
+        stage.pool = &pool;
+        stage.command = &commands[i];
+        stage.env = xenv;
+        stage.env.loop_depth = 0;
+        stage.exec_frame = exec_frame;
+        stage.invariant_frame = invariant_frame;
+        stage.subshell_cwd = subshell_cwd;
+        stage.cwd = -1;
+        stage.in = i > 0 ? &rings[i - 1] : nullptr;
+        stage.out = i + 1 < count ? &rings[i] : nullptr;
+        stage.done = false;
+        stage.exit_status = 0;
+
+        // A guard page under the stack, so running past its end faults
+        stage.stack = mmap(nullptr, INLINE_STAGE_GUARD_SIZE + INLINE_STAGE_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (stage.stack == MAP_FAILED)
+            panic("mmap failed");
+        if (mprotect(stage.stack, INLINE_STAGE_GUARD_SIZE, PROT_NONE) < 0)
+            panic("mprotect failed");
+
+        getcontext(&stage.context);
+        stage.context.uc_stack.ss_sp = static_cast<char *>(stage.stack) + INLINE_STAGE_GUARD_SIZE;
+        stage.context.uc_stack.ss_size = INLINE_STAGE_STACK_SIZE;
+        stage.context.uc_link = &inline_scheduler_context;
+        makecontext(&stage.context, (void (*)())inline_stage_main, 1, (int)i);
     }
-    else if (std::holds_alternative<ast_for_clause>(command.cmd)) {
-        return execute_for_clause(std::get<ast_for_clause>(command.cmd));
-    }
-    else if (std::holds_alternative<ast_case_clause>(command.cmd)) {
-        return execute_case_clause(std::get<ast_case_clause>(command.cmd));
-    }
-    else if (std::holds_alternative<ast_if_clause>(command.cmd)) {
-        return execute_if_clause(std::get<ast_if_clause>(command.cmd));
-    }
-    else if (std::holds_alternative<ast_while_clause>(command.cmd)) {
-        return execute_while_clause(std::get<ast_while_clause>(command.cmd));
-    }
-    else if (std::holds_alternative<ast_function_definition>(command.cmd)) {
-        return execute_function_definition(std::get<ast_function_definition>(command.cmd));
+
+    inline_stages = &stages;
+    size_t running = count;
+    // Where the pipeline started. The first cd of a stage may happen in
+    // a subshell of its own, which would remember its own start only.
+    int *start_cwd = subshell_cwd;
+    if (!cwd_remember(start_cwd))
+        panic("can't remember the current directory");
+    // The stage whose directory the process is in, nullptr for the start
+    inline_stage *cwd_owner = nullptr;
+
+    while (running > 0) {
+        unsigned long progress = inline_progress;
+
+        for (inline_stage &stage : stages) {
+            if (stage.done)
+                continue;
+
+            inline_stage *owner = stage.cwd >= 0 ? &stage : nullptr;
+            if (owner != cwd_owner) {
+                if (fchdir(owner ? stage.cwd : *start_cwd) < 0)
+                    error_message("can't change to the working directory of a pipeline stage");
+                cwd_owner = owner;
+            }
+            unsigned generation = cwd_generation;
+
+            std::swap(xenv, stage.env);
+            std::swap(exec_frame, stage.exec_frame);
+            std::swap(invariant_frame, stage.invariant_frame);
+            std::swap(subshell_cwd, stage.subshell_cwd);
+            virtual_stdin = stage.in;
+            virtual_stdout = stage.out;
+            inline_stage_context = &stage.context;
+            inline_wait_fds = &stage.wait_fds;
+
+            swapcontext(&inline_scheduler_context, &stage.context);
+
+            inline_wait_fds = nullptr;
+            inline_stage_context = nullptr;
+            virtual_stdin = nullptr;
+            virtual_stdout = nullptr;
+            std::swap(subshell_cwd, stage.subshell_cwd);
+            std::swap(invariant_frame, stage.invariant_frame);
+            std::swap(exec_frame, stage.exec_frame);
+            std::swap(xenv, stage.env);
+
+            if (cwd_generation != generation) {
+                internal_fd_close(&stage.cwd);
+                stage.cwd = move_fd_high(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+                internal_fd_register(&stage.cwd);
+                cwd_owner = &stage;
+            }
+
+            if (stage.done)
+                running--;
+        }
+
+        if (running > 0 && inline_progress == progress)
+            inline_wait(stages);
     }
-    else {
-        panic("command type execution not implemented");
+
+    inline_stages = nullptr;
+
+    for (inline_stage &stage : stages) {
+        munmap(stage.stack, INLINE_STAGE_GUARD_SIZE + INLINE_STAGE_STACK_SIZE);
+        internal_fd_close(&stage.cwd);
     }
+
+    return stages.back().exit_status;
 }
 
-int execute_pipeline(const ast_pipeline &pipeline)
+int execute_pipeline(const ast_pool &pool, const ast_pipeline &pipeline)
 {
     int exit_status = 0;
     
@@ -1811,12 +7816,17 @@ int execute_pipeline(const ast_pipeline &pipeline)
 
     vector<pid_t> pids;
 
-    const vector<ast_command> &commands = pipeline.commands;
+    ast_slice<ast_command> commands = pool.commands_of(pipeline);
 
     if (commands.size() == 1) {
         // This is both an optimization, and it is required for variable
         // assignments to modify the current execution environment.
-        exit_status = execute_command(commands[0]);
+        exit_status = execute_command(pool, commands[0]);
+        goto ret;
+    }
+
+    if (pipeline_runs_inline(pool, pipeline)) {
+        exit_status = execute_inline_pipeline(pool, commands);
         goto ret;
     }
     
@@ -1825,11 +7835,11 @@ int execute_pipeline(const ast_pipeline &pipeline)
         rpipe[1] = wpipe[1];
 
         if (i + 1 < commands.size()) {
-            if (pipe(wpipe) < 0)
+            if (shell_pipe(wpipe) < 0)
                 panic("pipe failed");
         }
 
-        pid_t pid = fork();
+        pid_t pid = shell_fork();
 
         if (pid > 0) {
             // Parent process
@@ -1847,6 +7857,10 @@ int execute_pipeline(const ast_pipeline &pipeline)
             dup2(rpipe[0], 0);
             close(rpipe[0]);
             close(rpipe[1]);
+
+            // Nobody else reads this pipe, so read can buffer it
+            if (runs_in_process(pool, commands[i], 0, true))
+                input_own(0);
         }
 
         if (wpipe[1] >= 0) {
@@ -1858,7 +7872,7 @@ int execute_pipeline(const ast_pipeline &pipeline)
         // TODO: When executing a simple command, we don't really need to have
         // both the forked process waiting, and the command process running.
         // Maybe we can do some kind of tail-execv optimization?
-        exit(execute_command(commands[i]));
+        exit(execute_command(pool, commands[i]));
     }
 
     if (wpipe[0] >= 0) {
@@ -1867,9 +7881,7 @@ int execute_pipeline(const ast_pipeline &pipeline)
     }
 
     for (auto pid : pids) {
-        int wstatus;
-        waitpid(pid, &wstatus, 0);
-        exit_status = WEXITSTATUS(wstatus);
+        exit_status = WEXITSTATUS(children.wait(pid));
     }
 
 ret:
@@ -1880,51 +7892,70 @@ ret:
         return exit_status;
 }
 
-int execute_and_or(const ast_and_or &and_or)
+int execute_and_or(const ast_pool &pool, const ast_and_or &and_or)
 {
     int exit_status = 0;
 
     if (and_or.async)
         panic("not implemented");
     
-    for (size_t i = 0; i < and_or.pipelines.size(); i++) {
+    ast_slice<ast_pipeline> pipelines = pool.pipelines_of(and_or);
+
+    for (size_t i = 0; i < pipelines.size(); i++) {
+        const ast_pipeline &pipeline = pipelines[i];
+
         if (i > 0) {
-            if (and_or.is_and[i - 1] && exit_status != 0) {
+            if (pipeline.is_and && exit_status != 0) {
                 // short-circuit AND
                 continue;
             }
-            else if (!and_or.is_and[i - 1] && exit_status == 0) {
+            else if (!pipeline.is_and && exit_status == 0) {
                 // short-circuit OR
                 continue;
             }
         }
 
-        exit_status = execute_pipeline(and_or.pipelines[i]);
+        exit_status = execute_pipeline(pool, pipeline);
+        xenv.set_last_status(exit_status);
+
+        if (control_flow_pending())
+            break;
     }
 
     return exit_status;
 }
 
-int execute_compound_list(const ast_compound_list &compound_list)
+int execute_compound_list(const ast_pool &pool, ast_compound_list compound_list)
 {
     int exit_status = 0;
 
-    for (const ast_and_or& and_or : compound_list.and_ors) {
-        exit_status = execute_and_or(and_or);
+    for (const ast_and_or& and_or : pool.and_ors_of(compound_list)) {
+        const ast_constant &constant = pool.constants[&and_or - pool.and_ors.data()];
+
+        if (constant.name != NO_INDEX && !xenv.has_func(pool.str(constant.name))) {
+            exit_status = constant.status;
+            xenv.set_last_status(exit_status);
+            continue;
+        }
+
+        exit_status = execute_and_or(pool, and_or);
+
+        if (control_flow_pending())
+            break;
     }
 
     return exit_status;
 }
 
-int execute_program(const ast_program &program)
+int execute_program(const shared_program &program)
 {
-    return execute_compound_list(program.commands);
+    return execute_compound_list(*program, program->program);
 }
 
 int execute(const string &program)
 {
     TokenReader r = TokenReader(Reader(program));
-    ast_program p = parse_program(r);
+    shared_program p = parse_program(r);
     return execute_program(p);
 }
 
@@ -1938,37 +7969,80 @@ int execute(const string &program, const string &arg0, const vector<string> &arg
     return exit_status;
 }
 
-int execute_in_subshell(const string &program)
+int execute_script(const string &source, const string &arg0, const vector<string> &args)
 {
-    pid_t pid = fork();
+    shared_program p = parse_script(source);
+    xenv.set_arg0(arg0);
+    xenv.push_args(args);
+    int exit_status = execute_program(p);
+    xenv.pop_args();
+    return exit_status;
+}
 
-    if (pid < 0) {
-        panic("fork failed");
-    }
+// Line editing
+//
+// Only the interactive shell needs readline, so it is loaded with dlopen
+// when the repl starts reading from a terminal. Scripts, -c and commands
+// piped into the shell never pay for loading it and the terminal libraries
+// behind it. Without readline, lines are read as typed.
 
-    if (pid > 0) {
-        // Parent
-        int wstatus;
-        waitpid(pid, &wstatus, 0);
-        return WEXITSTATUS(wstatus);
+struct line_editor
+{
+    char *(*readline)(const char *) = nullptr;
+    void (*add_history)(const char *) = nullptr;
+    // Lines are allocated by the libc readline was linked with
+    void (*free)(void *) = nullptr;
+    string last_history;
+};
+
+line_editor load_line_editor()
+{
+    line_editor editor;
+
+    for (const char *library : {"libreadline.so.8", "libreadline.so"}) {
+        void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+            continue;
+
+        editor.readline = reinterpret_cast<char *(*)(const char *)>(dlsym(handle, "readline"));
+        editor.add_history = reinterpret_cast<void (*)(const char *)>(dlsym(handle, "add_history"));
+        editor.free = reinterpret_cast<void (*)(void *)>(dlsym(handle, "rl_free"));
+
+        if (editor.readline && editor.add_history && editor.free)
+            break;
+
+        editor = line_editor();
+        dlclose(handle);
     }
 
-    exit(execute(program));
+    return editor;
 }
 
-static string readline_last_history;
-
-bool readline_getline(const char *prompt, string &str)
+bool editor_getline(line_editor &editor, const char *prompt, string &str)
 {
-    std::unique_ptr<char, decltype(free)*> ptr{readline(prompt), free};
+    output_flush();
+
+    if (!editor.readline) {
+        ssize_t res = write(2, prompt, strlen(prompt));
+        (void)res;
+
+        // Byte by byte, the commands may read the rest of stdin
+        str.clear();
+        char c;
+        while ((res = read(0, &c, 1)) > 0 && c != '\n')
+            str.push_back(c);
+        return res > 0 || !str.empty();
+    }
+
+    std::unique_ptr<char, void (*)(void *)> ptr{editor.readline(prompt), editor.free};
 
     if (!ptr)
         return false;
     
     str.assign(ptr.get());
-    if (str.find_first_not_of(' ') != string::npos && str != readline_last_history) {
-        add_history(ptr.get());
-        readline_last_history = str;
+    if (str.find_first_not_of(' ') != string::npos && str != editor.last_history) {
+        editor.add_history(ptr.get());
+        editor.last_history = str;
     }
     
     return true;
@@ -1976,16 +8050,390 @@ bool readline_getline(const char *prompt, string &str)
 
 int repl()
 {
+    line_editor editor = isatty(0) ? load_line_editor() : line_editor();
     string line;
     int exit_status = 0;
 
-    while (readline_getline("$ ", line)) {
+    while (editor_getline(editor, "$ ", line)) {
         try {
             exit_status = execute(line);
         }
         catch (const shell_exception &e) {
             error_message(e.what());
+            xenv.loop_depth = 0;
+            xenv.function_depth = 0;
+            xenv.pending = control_flow();
+        }
+    }
+
+    return exit_status;
+}
+
+// Server mode
+//
+// A pre-warmed shell listens on a unix socket and runs every request in a
+// forked child, so clients don't pay for process startup, environment
+// import and PATH searches. The client passes its stdin, stdout and stderr
+// with SCM_RIGHTS alongside a request header, then sends a payload of NUL
+// terminated strings: cwd, script, arg0, the arguments and the environment.
+// The server answers with the exit status once the request finished.
+
+const uint32_t SERVER_MAGIC = 0x70736831;
+
+// The header comes from whoever connects, so the payload size is capped
+// before anything is allocated. Bigger requests run in the client.
+const uint32_t SERVER_MAX_PAYLOAD = 64 << 20;
+
+// A client that stops sending only holds up its own request: the server
+// gives up on receiving it after this long
+const timeval SERVER_RECEIVE_TIMEOUT = {5, 0};
+
+// How long the client waits to connect and hand over the request before
+// running the script itself
+const timeval SERVER_SEND_TIMEOUT = {1, 0};
+
+struct server_request_header
+{
+    uint32_t magic;
+    uint32_t nargs;
+    uint32_t nenv;
+    uint32_t payload_size;
+};
+
+sockaddr_un server_address(const char *socket_path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        panic(string(socket_path) + ": socket path too long");
+
+    strcpy(addr.sun_path, socket_path);
+    return addr;
+}
+
+struct server_request
+{
+    int fds[3] = {-1, -1, -1};
+    string cwd;
+    string script;
+    string arg0;
+    vector<string> args;
+    vector<string> env;
+};
+
+bool receive_request(int conn, server_request &request)
+{
+    server_request_header header;
+    char control[CMSG_SPACE(sizeof(request.fds))];
+
+    iovec iov{&header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t res = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (res != sizeof(header) || header.magic != SERVER_MAGIC)
+        return false;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(request.fds)))
+        return false;
+    memcpy(request.fds, CMSG_DATA(cmsg), sizeof(request.fds));
+
+    if (header.payload_size > SERVER_MAX_PAYLOAD)
+        return false;
+
+    string payload(header.payload_size, '\0');
+    if (!read_full(conn, &payload[0], payload.size()))
+        return false;
+
+    vector<string> strings;
+    for (size_t start = 0; start < payload.size(); ) {
+        size_t end = payload.find('\0', start);
+        if (end == string::npos)
+            return false;
+        strings.push_back(payload.substr(start, end - start));
+        start = end + 1;
+    }
+
+    if (strings.size() != 3 + header.nargs + header.nenv)
+        return false;
+
+    request.cwd = strings[0];
+    request.script = strings[1];
+    request.arg0 = strings[2];
+    request.args.assign(strings.begin() + 3, strings.begin() + 3 + header.nargs);
+    request.env.assign(strings.begin() + 3 + header.nargs, strings.end());
+
+    return true;
+}
+
+[[noreturn]] void run_request(const server_request &request)
+{
+    for (int i = 0; i < 3; i++) {
+        dup2(request.fds[i], i);
+        close(request.fds[i]);
+    }
+
+    if (chdir(request.cwd.c_str()) < 0)
+        error_message(request.cwd + ": chdir failed");
+
+    clearenv();
+    for (const string &entry : request.env) {
+        size_t equals = entry.find('=');
+        if (equals != string::npos)
+            setenv(entry.substr(0, equals).c_str(), entry.c_str() + equals + 1, 1);
+    }
+
+    // Keep the command hash, it is dropped by itself if PATH differs
+    xenv = ex_env();
+    xenv.init_from_environ();
+    xenv.set_shell_pid(getpid());
+
+    int exit_status;
+
+    try {
+        exit_status = execute(request.script, request.arg0, request.args, false);
+    }
+    catch (const shell_exception &e) {
+        error_message(e.what());
+        exit_status = 2;
+    }
+
+    exit(exit_status);
+}
+
+// Runs in the child forked for a connection, so the accept loop never
+// waits for a client
+[[noreturn]] void serve_connection(int conn)
+{
+    server_request request;
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &SERVER_RECEIVE_TIMEOUT, sizeof(SERVER_RECEIVE_TIMEOUT));
+    if (!receive_request(conn, request))
+        _exit(2);
+
+    close(conn);
+    run_request(request);
+}
+
+int server_sigchld_pipe[2] = {-1, -1};
+
+void server_sigchld_handler(int)
+{
+    int saved_errno = errno;
+    char c = 0;
+    // If the pipe is full a wakeup is pending anyway
+    ssize_t res = write(server_sigchld_pipe[1], &c, 1);
+    (void)res;
+    errno = saved_errno;
+}
+
+// Removes the socket a server left behind when it died. Anything else at
+// the path, including the socket of a running server, is left alone.
+void remove_stale_socket(const char *socket_path, const sockaddr_un &addr)
+{
+    struct stat st;
+    if (lstat(socket_path, &st) < 0) {
+        if (errno == ENOENT)
+            return;
+        panic(string(socket_path) + ": " + strerror(errno));
+    }
+
+    if (!S_ISSOCK(st.st_mode))
+        panic(string(socket_path) + ": exists and is not a socket");
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0)
+        panic("socket failed");
+
+    int res = connect(probe, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    int saved_errno = errno;
+    close(probe);
+
+    if (res == 0)
+        panic(string(socket_path) + ": a server is already listening");
+    if (saved_errno != ECONNREFUSED)
+        panic(string(socket_path) + ": " + strerror(saved_errno));
+
+    unlink(socket_path);
+}
+
+int serve(const char *socket_path)
+{
+    sockaddr_un addr = server_address(socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        panic("socket failed");
+
+    remove_stale_socket(socket_path, addr);
+
+    // Requests run as our user, so only our user may connect
+    mode_t old_umask = umask(0177);
+    int bound = bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (bound < 0)
+        panic(string(socket_path) + ": bind failed");
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        panic("listen failed");
+
+    if (pipe2(server_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        panic("pipe failed");
+
+    struct sigaction action{};
+    action.sa_handler = server_sigchld_handler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, nullptr);
+
+    hashed_commands.prewarm(current_path_value());
+
+    // Maps running requests to their client connection
+    map<pid_t, int> running;
+
+    while (true) {
+        pollfd fds[2] = {
+            {listen_fd, POLLIN, 0},
+            {server_sigchld_pipe[0], POLLIN, 0},
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            panic("poll failed");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buff[64];
+            while (read(server_sigchld_pipe[0], buff, sizeof(buff)) > 0)
+                ;
+
+            pid_t pid;
+            int wstatus;
+            while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                auto it = running.find(pid);
+                if (it == running.end())
+                    continue;
+
+                int32_t exit_status = WIFEXITED(wstatus)
+                    ? WEXITSTATUS(wstatus)
+                    : 128 + WTERMSIG(wstatus);
+                write_full(it->second, &exit_status, sizeof(exit_status));
+                close(it->second);
+                running.erase(it);
+            }
         }
+
+        if (fds[0].revents & POLLIN) {
+            int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0)
+                continue;
+
+            // Also turn away other users if the socket was made reachable
+            ucred peer;
+            socklen_t peer_size = sizeof(peer);
+            if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) < 0 || peer.uid != geteuid()) {
+                close(conn);
+                continue;
+            }
+
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                // Child process
+                signal(SIGCHLD, SIG_DFL);
+                close(listen_fd);
+                close(server_sigchld_pipe[0]);
+                close(server_sigchld_pipe[1]);
+                serve_connection(conn);
+            }
+
+            if (pid < 0) {
+                error_message("fork failed");
+                close(conn);
+                continue;
+            }
+
+            running[pid] = conn;
+        }
+    }
+}
+
+// Returns -1 when the request can't be handed to the server, so the script
+// can run here instead. Once the server has the whole request, the script
+// may have run there, so a lost answer is an error and not a reason to run
+// it again.
+int run_on_server(const char *socket_path, const string &script, const string &arg0, const vector<string> &args)
+{
+    sockaddr_un addr = server_address(socket_path);
+
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0)
+        return -1;
+
+    // Also bounds connect, a server that doesn't accept makes it block
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &SERVER_SEND_TIMEOUT, sizeof(SERVER_SEND_TIMEOUT));
+
+    if (connect(conn, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(conn);
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "/");
+
+    string payload;
+    for (const string &str : {string(cwd), script, arg0})
+        payload.append(str).push_back('\0');
+    for (const string &arg : args)
+        payload.append(arg).push_back('\0');
+
+    uint32_t nenv = 0;
+    for (char **s = environ; *s; s++, nenv++)
+        payload.append(*s).push_back('\0');
+
+    if (payload.size() > SERVER_MAX_PAYLOAD) {
+        close(conn);
+        return -1;
+    }
+
+    server_request_header header{SERVER_MAGIC, (uint32_t)args.size(), nenv, (uint32_t)payload.size()};
+
+    int fds[3] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+
+    iovec iov{&header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t exit_status;
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(header) || !send_full(conn, payload.data(), payload.size())) {
+        close(conn);
+        return -1;
+    }
+
+    bool answered = read_full(conn, &exit_status, sizeof(exit_status));
+    close(conn);
+
+    if (!answered) {
+        error_message("lost the connection to the server");
+        return 1;
     }
 
     return exit_status;
@@ -1993,25 +8441,106 @@ int repl()
 
 int main(int argc, char *argv[])
 {
+    // Don't leave the read-ahead of a shared input file behind
+    atexit(input_sync_all);
+    atexit(output_flush_at_exit);
+    output_unbuffered = getenv("POSIX_SHELL_UNBUFFERED_OUTPUT") != nullptr;
+
+    const char *command = nullptr;
+    const char *serve_path = nullptr;
+    const char *client_path = nullptr;
+
+    // --stats and POSIX_SHELL_STATS print the accounting counters on
+    // exit, to stderr or to the given fd
+    const char *stats = getenv("POSIX_SHELL_STATS");
+
+    // -O LEVEL and POSIX_SHELL_OPTIMIZE set the optimization level, 0
+    // turns optimize_program off
+    if (const char *level = getenv("POSIX_SHELL_OPTIMIZE"))
+        optimization_level = atoi(level);
+
+    static const struct option long_options[] = {
+        {"stats", optional_argument, nullptr, 's'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+c:S:C:O:", long_options, nullptr)) != -1) {
+        if (opt == 'c')
+            command = optarg;
+        else if (opt == 'S')
+            serve_path = optarg;
+        else if (opt == 'C')
+            client_path = optarg;
+        else if (opt == 'O')
+            optimization_level = atoi(optarg);
+        else if (opt == 's')
+            stats = optarg ? optarg : "";
+        else
+            return 2;
+    }
+
+    if (stats)
+        stats_enable(*stats && is_digits(stats) ? atoi(stats) : 2);
+
+    if (command && client_path) {
+        // Thin client: leave all the work to the server
+        string arg0 = optind < argc ? argv[optind] : SHELL_NAME;
+        vector<string> args;
+        if (optind < argc)
+            args = vector<string>(argv + optind + 1, argv + argc);
+
+        int exit_status = run_on_server(client_path, command, arg0, args);
+        if (exit_status >= 0)
+            return exit_status;
+        // Without a server we run the script ourselves
+    }
+
+    lazy_function_bodies = getenv("POSIX_SHELL_LAZY_FUNCTIONS") != nullptr;
+    if (const char *size = getenv("POSIX_SHELL_PARSE_CACHE_SIZE"))
+        parse_cache_capacity = strtoul(size, nullptr, 10);
+
     xenv.init_from_environ();
     xenv.set_arg0(SHELL_NAME);
     xenv.set_shell_pid(getpid());
 
-    if (getopt(argc, argv, "+c:") == 'c') {
+    if (serve_path) {
+        try {
+            return serve(serve_path);
+        }
+        catch (const shell_exception &e) {
+            error_message(e.what());
+            return 1;
+        }
+    }
+    else if (command) {
         string arg0 = xenv.get_arg(0);
         vector<string> args;
         if (optind < argc) {
             arg0 = argv[optind];
             args = vector<string>(argv + optind + 1, argv + argc);
         }
-        return execute(optarg, arg0, args, false);
+        try {
+            return execute(command, arg0, args, false);
+        }
+        catch (const shell_exception &e) {
+            // Returning, unlike terminate, flushes the output
+            error_message(e.what());
+            return 2;
+        }
     }
-    else if (argc > 1) {
-        vector<string> args(argv + 2, argv + argc);
-        return execute(read_file(argv[1]), argv[1], args, false);
+    else if (optind < argc) {
+        vector<string> args(argv + optind + 1, argv + argc);
+        try {
+            return execute_script(read_file(argv[optind]), argv[optind], args);
+        }
+        catch (const shell_exception &e) {
+            error_message(e.what());
+            return 2;
+        }
     }
     else {
-        xenv.push_args({});
+        xenv.push_args(vector<string>{});
         return repl();
     }
-}
\ No newline at end of file
+}
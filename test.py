@@ -1,11 +1,26 @@
 #!/usr/bin/env python3
 
+import os
 import sys
 import subprocess
 
 TEST_BINARY = './main'
 REFERENCE_BINARY = '/bin/bash'
 
+# Every test runs once per mode, with these variables in the environment
+# of the shell under test. The modes switch to the slower fallbacks, which
+# have to give the same results.
+MODES = {
+    'default': {},
+    'fork pipelines': {'POSIX_SHELL_FORK_PIPELINES': '1'},
+    'fork subshells': {'POSIX_SHELL_FORK_SUBSHELLS': '1'},
+    'lazy functions': {'POSIX_SHELL_LAZY_FUNCTIONS': '1'},
+    'sigchld wait': {'POSIX_SHELL_SIGCHLD_WAIT': '1'},
+    'unbuffered output': {'POSIX_SHELL_UNBUFFERED_OUTPUT': '1'},
+    'no parse cache': {'POSIX_SHELL_PARSE_CACHE_SIZE': '0'},
+    'unoptimized': {'POSIX_SHELL_OPTIMIZE': '0'},
+}
+
 TESTS = [
     # simple commands
     r'echo 123',
@@ -35,6 +50,8 @@ TESTS = [
     # Pipelines
     r'echo hello | xxd',
     r'echo hello | xxd | xxd | xxd | xxd | xxd',
+    r'/bin/echo a | /usr/bin/tr a b | /bin/cat ; /bin/sh -c "exit 5" | /bin/true ; echo $? ; /bin/true | /bin/sh -c "exit 4" ; echo $?',
+    r'x=$(/bin/false) ; echo "$? [$x]" ; x=$(/bin/sh -c "echo out ; exit 3") ; echo "$? $x" ; for i in 1 2 3 4 5 ; do /bin/echo $i ; done | /usr/bin/sort -r | /usr/bin/head -2',
 
     # redirections
     r'echo hello >/dev/null',
@@ -44,13 +61,66 @@ TESTS = [
     r'echo hello > /tmp/x ; xxd /tmp/x ; rm /tmp/x',
 
     r'echo hello \>/dev/null',
+    r'> /tmp/x; echo created; cat /tmp/x; rm /tmp/x',
+    r'{ echo a; echo b >&2; } 2>/dev/null',
+    r'for i in 1 2 3; do echo $i; done > /tmp/x; for i in 4; do echo $i; done >> /tmp/x; xxd /tmp/x; rm /tmp/x',
+    r'if true; then echo yes; fi > /tmp/x; echo after; cat /tmp/x; rm /tmp/x',
+    r'case a in a) echo A;; esac > /dev/null; echo ok',
+    r'(echo sub) > /tmp/x; cat /tmp/x; rm /tmp/x',
+    r'f() { echo in f; } > /tmp/x; f; echo outside; cat /tmp/x; rm /tmp/x',
+    r"printf 'l1\nl2\nl3\n' > /tmp/x; { read a; head -1; cat; } < /tmp/x; rm /tmp/x",
+    r"""printf 'a b\nc d\n' > /tmp/x; while read x y; do echo "$y $x"; done < /tmp/x; rm /tmp/x""",
     r'wc wrong_name',
     r'wc wrong_name 2>/dev/null',
     r'wc wrong_name 2> /tmp/x ; xxd /tmp/x ; rm /tmp/x',
     r'wc wrong_name 2>&1',
     r'echo hello >&2',
+    r'exec 3>/tmp/x; echo a >&3; echo b >&3; exec 3>&-; cat /tmp/x; rm /tmp/x',
+    r'exec 12>/tmp/x; for i in 1 2 3; do echo $i >&12; done; fd=12; echo $fd >&$fd; cat /tmp/x; rm /tmp/x',
+    r'(exec >/tmp/x; echo in); echo out; cat /tmp/x; rm /tmp/x',
+    r'{ echo hi >&7; } 2>/dev/null; echo $?',
+    r'exec echo replaced; echo not reached',
+
+    # eval and .
+    r'eval "a=1; echo \$a"; for i in 1 2 3 1 2 3; do eval "v$i=\$i; echo \$v$i"; done; eval; echo $?',
+    r"printf 'echo in $1 $#\nx=set\nreturn 3\necho no\n' > /tmp/x; . /tmp/x p q; echo $? $x $#; f() { . /tmp/x; echo after $?; }; f; rm /tmp/x",
+    r"echo 'echo one' > /tmp/x; . /tmp/x; echo 'echo three' > /tmp/x; . /tmp/x; rm /tmp/x",
     r'echo hello 1>&2',
 
+    # cat builtin
+    r'echo hello > /tmp/x ; cat /tmp/x /tmp/x | xxd ; rm /tmp/x',
+    r'echo hello > /tmp/x ; cat < /tmp/x ; cat - < /tmp/x ; rm /tmp/x',
+    r'echo hello > /tmp/x ; cat /tmp/x > /tmp/y ; cat /tmp/x >> /tmp/y ; xxd /tmp/y ; rm /tmp/x /tmp/y',
+    r"cat -n Makefile ; printf 'a\n\nb\n' | cat -s -u - ; cat -u Makefile | head -1",
+
+    # read builtin
+    r"printf 'l1\nl2\nl3\n' | { read a; read b; cat; }",
+    r"""printf 'a\\\nb c\n' | { read x y; /bin/echo "$x|$y"; }""",
+    r"""printf 'a\\ b c\n' | { read -r x y; /bin/echo "$x|$y"; }""",
+    r"""printf 'a\\ b c\n' | { read x y; /bin/echo "$x|$y"; }""",
+    r"""printf '  a  b  c  \n' | { read x y; /bin/echo "[$x][$y]"; }""",
+    r"""printf 'x\ny' | { read a; read b || /bin/echo eof; /bin/echo "[$a][$b]"; }""",
+    r"""printf 'a:b::c\n' | { IFS=: read w x y z; /bin/echo "[$w][$x][$y][$z]"; }""",
+    r'echo "a b  c" > /tmp/x; read x y < /tmp/x; echo "[$x][$y]"; rm /tmp/x',
+
+    # echo and printf builtins
+    r"echo -n a; echo -e 'x\ty\101\0101'; echo -E 'x\ty'; echo -x -- a",
+    r"echo -e 'a\cb'; echo c",
+    r"printf '%5s|%-5s|%.2s|%c|%d|%5.2f|%x|%o|%%\n' ab cd efgh xyz 42 3.14159 255 8",
+    r"printf '%s\n' a b c; printf '%d %d\n' 1 2 3; printf 'x%sy\n'",
+    r"printf '%b|\n' 'a\101\0101\cZZ'; printf '\101\0101\x41\"\q\n'",
+    r"""printf '%d\n' "'A" """,
+
+    # inline pipelines
+    r"printf '%s\n' a b c | while read x; do echo \<$x\>; done",
+    r"printf '%s\n' a b c | cat | cat",
+    r'A=1; echo x | { read A; }; echo "A=$A"',
+    r"""f() { while read l; do echo "f:$l"; done; }; printf '1\n2\n' | f | cat""",
+    r'for i in 1 2 3; do echo $i; done | { read a; read b; echo "$b$a"; }',
+    r'echo a | echo b',
+    r'f() { : ; } ; printf "a\\nb\\nc\\n" | { read x ; f() { head -1 ; } ; f ; } ; { f() { seq 1 3000 ; } ; f ; } | { read a ; echo $a ; } ; x=$(f() { /bin/echo hi ; } ; f) ; echo $x',
+    r'{ cd / ; echo go ; } | { read l ; cat Makefile | head -1 ; } ; d=$(pwd) ; { cd / ; pwd ; } | { read l ; echo $l ; [ "$(pwd)" = "$d" ] && echo same ; } ; [ "$(pwd)" = "$d" ] && echo back',
+
     # substitutions
     r'echo hello $(echo world) yay',
     r'echo hello `echo world` yay',
@@ -64,6 +134,17 @@ TESTS = [
     r'echo $A ; (A=123) ; echo $A',
     r'A=123 echo $A ; echo $A',
     r"A=123 bash -c 'echo $A' ; echo $A",
+    r'A=abc ; B=$A ; C="${B}" ; D=${C} ; A=x ; echo $A $B $C $D ; B=y ; echo $C',
+    r'A="a  b" ; B=$A ; C="$A"c ; for x in "$B" $C ; do echo "[$x]" ; done',
+    r's=a ; t=$s ; for x in b c "d e" ; do s="$s$x" ; s=${s}- ; done ; u= ; u="$u${u:=z}" ; echo "$s|$t|$u"',
+
+    # subshells without fork
+    r'f() { A=1; echo in f; } ; x=$(f) ; echo "[$x] [$A]"',
+    r'x=$(echo a; echo; echo) ; echo "[$x]"',
+    r'(f() { echo f; }; A=1; f) ; echo "[$A]"',
+    r'cd /usr && (cd bin; A=1) ; pwd ; echo "[$A]" ; echo "$(cd /; pwd)" ; pwd',
+    r'(echo a; echo b) > /tmp/posix_shell_subshell_test ; cat /tmp/posix_shell_subshell_test',
+    r'cd /usr ; cd / ; cd - ; pwd ; echo | cd /etc ; pwd',
 
     # quoting
 
@@ -87,16 +168,32 @@ TESTS = [
 
     # if
     r'if false; then echo true; else echo false; fi',
+    r'for x in 1 2 3 ; do if [ $x = 1 ] ; then echo one ; elif [ $x = 2 ] ; then echo two ; else echo other ; fi ; done',
+    r'if false ; then echo a ; elif false ; then echo b ; elif true ; then echo c ; fi ; if false ; then : ; elif false ; then : ; fi ; echo $?',
 
     # for
     r'for x in 1 2 3; do echo $x; done',
     r'for x in 1$(echo 1 2 3)3; do echo $x; done',
+    r'for x in $(printf "a b\\n\\nc\\n\\n" ; sleep 0) ; do echo "[$x]" ; done ; IFS=: ; for x in $(printf ":a::b:\\n\\n" ; sleep 0) ; do echo "[$x]" ; IFS=b ; done',
+    r'for x in $(seq 1 5) ; do echo $x ; [ $x = 3 ] && break ; done ; for x in `seq 1 3000` ; do : ; done ; echo $x ; for x in $(true) ; do echo never ; done ; echo $?',
+    r'f=$(mktemp) ; seq 1 3 > $f ; n=0 ; for x in $(/bin/cat $f) ; do n=$((n + 1)) ; [ $n -le 3 ] && seq 1 5000 >> $f ; done ; echo $n ; rm $f',
+    r'''d=$(mktemp -d) ; mkfifo $d/p ; ./main -O 2 -c 'for x in $(echo a ; timeout 5 head -1 "$1") ; do echo "got $x" ; [ $x = a ] && timeout 5 sh -c "echo b > \"\$1\"" sh "$1" ; done' sh $d/p ; rm -r $d''',
+
+    # break, continue and return
+    r'for i in 1 2 ; do for j in a b ; do continue 2 ; echo no ; done ; echo no2 ; done ; echo $i ; for i in 1 2 ; do break 5 ; done ; echo $i',
+    r'for i in a b c ; do case $i in b) continue ;; esac ; echo $i ; done ; until false ; do break ; done ; echo until',
+    r'g() { for i in 1 2 3 ; do if [ $i = 2 ] ; then return 7 ; fi ; echo $i ; done ; echo no ; } ; g ; echo $?',
+    r'h() { while true ; do while true ; do break 2 ; done ; echo no ; done ; (return 4) ; echo "sub $?" ; return ; } ; h ; echo $?',
+    r'f() { return 300 ; } ; f ; echo $? ; k() { return 3 || echo no ; echo no2 ; } ; k ; echo $? ; A=$(false) ; echo $?',
+    r'false ; echo $? ; true ; echo $? ; : ; echo $? ; for i in 1 2 ; do false ; break ; done ; echo $?',
 
     # case
     r'case 2 in 1) echo A ;; (2) echo B ;; 3) echo C ;; esac',
     r'case 4 in 1) echo A ;; (2) echo B ;; 3) echo C ;; esac',
     r'case 4 in 1) echo A ;; (2) echo B ;; 3|4) echo C ;; esac',
     r"""case "a b" in a) echo A ;; (b) echo B ;; 'a b') echo C ;; esac""",
+    r'for f in a.c b.h c.txt D.C ; do case $f in *.[ch]) echo "$f C" ;; [A-Z]*) echo "$f upper" ;; *) echo "$f other" ;; esac ; done',
+    r'case "a*b" in "a*"*) echo quoted ;; esac ; case axb in "a*"*) echo bad ;; a?b) echo q ;; esac ; case ab in a[]b]) echo n ;; esac',
 
     # functions
 
@@ -107,6 +204,40 @@ TESTS = [
     r'foo() { echo aaa; } ; foo 1>&2',
     r'foo() { echo X$1,$2,$3X ; } ; foo ; foo 1 2 ; foo 1 2 3 4 ; foo "hello world"',
     r'foo() { echo X$1,$2,$3X ; } ; bar() { foo 1 2; } ; bar',
+    r'f() { { echo a } ; } ; if true ; then echo "}" ${x:-\}} ; fi } >&2 ; g() { h() { echo h$1 ; } ; } ; f ; g ; h 1',
+
+    # positional parameters
+    r'f() { echo "$#: $*" ; for a in "$@" ; do echo "[$a]" ; done ; } ; set -- "a b" c "" d ; f "$@" ; f $@ ; f "$*" ; f "x$@y"',
+    r'f() { echo "$#: $*" ; } ; g() { shift ; f "$@" ; } ; g 1 2 3 ; set -- ; f "$@" ; f "$@" ""',
+    r'set -- 1 2 3 ; for x ; do echo $x ; done ; for x in ; do echo no ; done ; shift 2 ; echo "$# $1" ; shift 5 ; echo $#',
+    r'IFS=: ; set -- a b ; echo "$*" ; A=$@ ; echo "$A"',
+    r'set -- $(seq 5) ; while [ $# -gt 0 ] ; do echo $1 ; shift ; done',
+    r'''x='a b' ; y=plain ; z="it's" ; e= ; n=$((6 * 7)) ; set | grep -E '^(x|y|z|e|n)=' ''',
+
+    # test builtin
+    r'[ 1 -lt 2 ] && echo lt ; [ a = b ] || echo ne ; [ -n "" ] || echo z ; [ ! -d /tmp ] || echo d ; [ "" ] || echo empty',
+    r'test 1 -eq 1 -a \( 2 -gt 3 -o a != b \) && echo yes ; test -f /etc/passwd -a ! -d /etc/passwd && echo file',
+
+    # arithmetic expansion
+    r'x=4 ; echo $((1 + 2 * 3)) $(((1 + 2) * 3)) $((-7 % 3)) $((1 << 4 | 0x10)) $((010 + x)) $((!x)) $((~0)) $((x > 3 ? x : 3))',
+    r'x=1 ; : $((0 && (x = 5))) $((1 || (x = 6))) ; y=$((x += 2)) ; echo $x $y $((x *= 3)) $x $((unset_var + 1))',
+    r's=ab ; s=$s$((s = 5)) ; echo $s ; s=ab ; s=${s}x$((s = 5)) ; echo $s ; s=ab ; s="$s$((1 + 1))" ; echo $s',
+    r'i=0 ; while [ $i -lt 5 ] ; do i=$((i + 1)) ; done ; echo $i "$i" ${#i} ${i}x ; i="${i}5" ; echo $((i + 1))',
+    r'n=10 ; s=0 ; i=0 ; while [ $i -lt $n ] ; do s=$((s + i)) ; i=$((i + 1)) ; done ; [ $s -eq 45 ] && echo $s ; IFS=4 ; echo $s',
+
+    # optimized loops and constants
+    r'true() { echo shadow ; return 1 ; } ; if true ; then echo yes ; else echo no ; fi ; false() { return 0 ; } ; while false ; do echo once ; break ; done',
+    r'p=/usr/local/bin ; n=0 ; while [ "${p%/*}" = /usr/local ] ; do n=$((n + 1)) ; [ $n -ge 3 ] && p=/x/y ; done ; echo $n ; x=a ; for i in 1 2 3 ; do echo "$x-$i" ${#x} ; x=b$i ; done',
+    r'for o in a b ; do for k in 1 2 ; do echo "$o$k ${o:-none}" ; done ; o=z ; done ; v=a:b ; for i in 1 2 ; do echo $v ; IFS=: ; done',
+    r'f() { echo f ; } ; y=1 ; for i in 1 2 ; do echo "$y" ; f ; done ; w=q ; for i in 1 2 ; do echo "$w" ; : ${w:=r} $((w = 5)) ; done ; g=1 ; for i in 1 2 ; do echo $g ; eval g=2 ; done',
+
+    # accounting
+    (r'stats > /tmp/posix_shell_stats_a ; echo builtin > /dev/null ; stats > /tmp/posix_shell_stats_b ; /bin/true ; stats > /tmp/posix_shell_stats_c ; '
+        r'{ read k a ; } < /tmp/posix_shell_stats_a ; { read k b ; } < /tmp/posix_shell_stats_b ; { read k c ; } < /tmp/posix_shell_stats_c ; '
+        r'echo $k ; expr $b - $a ; expr $c - $b ; rm /tmp/posix_shell_stats_a /tmp/posix_shell_stats_b /tmp/posix_shell_stats_c',
+        'forks\n0\n1\n'),
+    (r"./main --stats=3 -c '/bin/true ; echo hi' 3>&1 >/dev/null | grep -E '^(forks|execs|pipes) '", 'forks 1\nexecs 1\npipes 0\n'),
+    (r"env POSIX_SHELL_STATS=3 ./main -c '/bin/true ; echo hi ; /bin/true' 3>&1 >/dev/null | grep '^forks '", 'forks 2\n'),
 
     # advanced expansion
 
@@ -138,6 +269,11 @@ TESTS = [
 
     r'echo $',
 
+    # prefix and suffix removal
+    r'p=/usr/src/dir.d/file.tar.gz ; echo "${p##*/} ${p#*/} ${p%/*} ${p%%/*}x ${p%.*} ${p%%.*} ${p##*.} ${p#/usr} ${p%gz}"',
+    r'p=/usr/src/dir.d/file.tar.gz ; echo "${p%.[a-z]z} ${p%%[!/]*} ${p##*[[:punct:]]} ${p#?} ${p%??} ${p#*} ${p##*} ${p%*.t*}"',
+    r"""pat='*.' ; s='a*b*c' ; echo "${s#$pat} ${s#"$pat"} ${s#*\*} ${s%\**} ${s#'a*'}" """,
+
     # cases with no field splitting
     r'B="aaa bbb"; echo ${A:-$B}',
     r'''echo "${A:-$(echo -e 'a\tb')}"''',
@@ -145,14 +281,24 @@ TESTS = [
     r'A="a    b"; B=$A; echo "$B"',
 ]
 
-def run_test(command):
-    p = subprocess.Popen([REFERENCE_BINARY, '-c', command], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
-    output_ref = p.communicate()
-    p = subprocess.Popen([TEST_BINARY, '-c', command], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+def run_test(test, env):
+    # A test given as (command, output) checks something bash doesn't
+    # have, so its output is spelled out instead
+    if isinstance(test, tuple):
+        command, expected = test
+        output_ref = (expected.encode(), b'')
+    else:
+        command = test
+        p = subprocess.Popen([REFERENCE_BINARY, '-c', command], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        output_ref = p.communicate()
+
+    p = subprocess.Popen([TEST_BINARY, '-c', command], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=env)
     output_test = p.communicate()
 
     if (output_test != output_ref):
         print('\nERROR!')
+        print('Mode:')
+        print(' '.join('{}={}'.format(k, v) for k, v in env.items() if k.startswith('POSIX_SHELL_')) or 'default')
         print('Test:')
         print(command)
         print('Expected output:')
@@ -164,14 +310,23 @@ def run_test(command):
         return True
 
 def main():
-    passed_tests = 0
-    for t in TESTS:
-        if run_test(t):
-            print('.', end='')
-            sys.stdout.flush()
-            passed_tests += 1
-    
-    print('\nPassed {}/{} tests'.format(passed_tests, len(TESTS)))
+    # ./test.py MODE... runs only those modes
+    modes = sys.argv[1:] or list(MODES)
+    failed = False
+
+    for mode in modes:
+        env = dict(os.environ, **MODES[mode])
+        passed_tests = 0
+        for t in TESTS:
+            if run_test(t, env):
+                print('.', end='')
+                sys.stdout.flush()
+                passed_tests += 1
+
+        print('\nPassed {}/{} tests ({})'.format(passed_tests, len(TESTS), mode))
+        failed = failed or passed_tests != len(TESTS)
+
+    sys.exit(1 if failed else 0)
 
 if __name__ == '__main__':
     main()